@@ -2,6 +2,7 @@
 #define __BINA_H__
 
 #include <sys/types.h>
+#include <pthread.h>
 
 struct bina_context;
 struct bina_instruction;
@@ -9,7 +10,31 @@ struct bina_instruction;
 struct bina_arch {
 	int (*disassemble)(struct bina_context *);
 	void (*destroy)(struct bina_context *);
-	void (*print_instruction)(struct bina_instruction *);
+	int (*format_instruction)(struct bina_instruction *, char *buffer, unsigned int size);
+	
+	/* Decode just the length, type and branch target of one instruction,
+	 * returning its length, or zero if it's invalid. */
+	unsigned int (*decode_instruction)(const char *base, unsigned int size, unsigned int offset, struct bina_instruction *);
+	int (*decode_operands)(struct bina_instruction *);
+	
+	/* Recognise an indirect jump through a table of 32-bit absolute
+	 * addresses, indexed by a value checked against a bound just before
+	 * it.  Returns zero and the table's address and number of entries if
+	 * it is one. */
+	int (*jump_table)(struct bina_instruction *, unsigned long *address, unsigned int *nr_entries);
+	
+	/* Write code that runs an instruction out of line at address to,
+	 * then carries on after its real copy at from.  Returns the length,
+	 * at most BINA_DISPLACED_SIZE, or -1 if it can't be moved. */
+	int (*displace)(struct bina_instruction *, unsigned long from, unsigned long to, unsigned char *code);
+	
+	/* The most bytes a single instruction can span. */
+	unsigned int max_instruction_size;
+	
+	/* How many registers the def/use sets track, at most 32, and which
+	 * of them holds the condition flags. */
+	unsigned int nr_registers;
+	unsigned int flags_register;
 	
 	unsigned long break_code;
 	unsigned long break_mask;
@@ -18,6 +43,15 @@ struct bina_arch {
 
 extern const struct bina_arch x86_32_arch;
 
+/* The room each instruction gets when it's run out of line. */
+#define BINA_DISPLACED_SIZE	32
+
+/* Context creation flags. */
+#define BINA_FAST_DECODE	0x1	/* Use the native decoder, implies lazy operands. */
+#define BINA_LAZY_OPERANDS	0x2	/* Decode the control flow skeleton only. */
+#define BINA_PARALLEL		0x4	/* Decode across all cores, implies fast decode. */
+#define BINA_RECURSIVE		0x8	/* Decode only code reachable from the entry points, implies fast decode. */
+
 enum bina_instruction_type {
 	IT_U_BRANCH,
 	IT_C_BRANCH,
@@ -27,6 +61,12 @@ enum bina_instruction_type {
 	IT_OTHER,
 };
 
+enum bina_edge_kind {
+	EK_FALLTHROUGH	= 0,
+	EK_TAKEN		= 1,
+	EK_CALL			= 2,
+};
+
 enum bina_operand_type {
 	OT_NONE 		= 0,
 	OT_REGISTER 	= 1,
@@ -55,10 +95,85 @@ enum bina_operand_size {
 	SZ_NA			= 0xFF,
 };
 
+/* A memory operand, base + index * scale + displacement.  Registers
+ * are numbered as for register operands, with zero for none. */
 struct bina_register_expr {
-	int register_index;
-	int displacement;
+	int base_register;
+	int index_register;
 	int scale;
+	int displacement;
+};
+
+/* Registers in the x86 def/use sets.  The narrower forms of a general
+ * register, such as al, ah and ax, all count as the full register. */
+enum bina_x86_register {
+	X86_EAX,
+	X86_ECX,
+	X86_EDX,
+	X86_EBX,
+	X86_ESP,
+	X86_EBP,
+	X86_ESI,
+	X86_EDI,
+	X86_EFLAGS,
+	
+	X86_NR_REGISTERS,
+};
+
+/* Branch conditions, in x86 encoding order, as they read the flags a
+ * compare of a with b leaves: CC_L is a < b signed, CC_B unsigned. */
+enum bina_condition {
+	CC_NONE			= 0,
+	CC_O,
+	CC_NO,
+	CC_B,
+	CC_AE,
+	CC_E,
+	CC_NE,
+	CC_BE,
+	CC_A,
+	CC_S,
+	CC_NS,
+	CC_P,
+	CC_NP,
+	CC_L,
+	CC_GE,
+	CC_LE,
+	CC_G,
+};
+
+/* A word-sized value simple enough to follow through a loop: a
+ * constant, a register, or the word at a register plus a displacement,
+ * as locals and arguments are addressed. */
+enum bina_value_kind {
+	VK_NONE			= 0,
+	VK_CONSTANT		= 1,
+	VK_REGISTER		= 2,
+	VK_MEMORY		= 3,
+};
+
+struct bina_value {
+	enum bina_value_kind kind;
+	int reg;
+	int constant;
+};
+
+/* The arithmetic an instruction does, where it's one of the few forms
+ * the loop analysis understands: dst = src, dst += src, dst -= src, or
+ * just the flags from dst - src for OP_COMPARE.  dst is set for any
+ * instruction writing a value that can be named, whatever it does. */
+enum bina_operation {
+	OP_OTHER		= 0,
+	OP_MOVE			= 1,
+	OP_ADD			= 2,
+	OP_SUB			= 3,
+	OP_COMPARE		= 4,
+};
+
+struct bina_arithmetic {
+	enum bina_operation operation;
+	struct bina_value dst;
+	struct bina_value src;
 };
 
 struct bina_operand {
@@ -81,7 +196,30 @@ struct bina_operand {
 	} value;
 };
 
-#define MAX_OPERANDS	4
+/* A jump table found by bina_resolve_jump_tables(): the indirect jump
+ * at instruction, the table's address and size in the target, and the
+ * distinct offsets its entries point at, in order. */
+struct bina_jump_table {
+	unsigned int instruction;
+	unsigned long address;
+	unsigned int nr_entries;
+	
+	unsigned int *targets;
+	unsigned int nr_targets;
+};
+
+/* A direct branch, call or jump table entry, by where it goes. */
+struct bina_branch_ref {
+	unsigned int target;
+	unsigned int source;
+};
+
+/* Part of the target's image, at address, with its bytes at base. */
+struct bina_region {
+	unsigned long address;
+	const char *base;
+	unsigned int size;
+};
 
 struct bina_basic_block;
 struct bina_instruction {
@@ -93,14 +231,30 @@ struct bina_instruction {
 	
 	enum bina_instruction_type type;
 	
-	/* Instruction operands. */
-	struct bina_operand operands[MAX_OPERANDS];
+	/* Instruction operands.  These are NULL until decoded, see
+	 * bina_decode_operands(). */
+	struct bina_operand *operands;
 	unsigned int nr_operands;
+	int operands_decoded;
+	
+	/* Registers written and read, one bit per register, decoded along
+	 * with the operands.  A write to part of a register reads the rest
+	 * of it, so counts as both. */
+	unsigned int defs;
+	unsigned int uses;
+	
+	/* Also decoded with the operands.  condition is set for conditional
+	 * branches that test the flags. */
+	struct bina_arithmetic arithmetic;
+	enum bina_condition condition;
 	
 	/* Branch instruction helpers. */
 	struct bina_instruction *branch_target;
 	unsigned int branch_target_offset;
 	
+	/* For indirect jumps through a table that could be read. */
+	struct bina_jump_table *jump_table;
+	
 	/* Basic block helpers. */
 	int basic_block_leader;
 	struct bina_basic_block *basic_block;
@@ -113,17 +267,368 @@ struct bina_instruction {
 	struct bina_instruction *prev;
 };
 
+#define BINA_NO_INDEX	0xffffffff
+
+/* Region allocator.  Memory is handed out by bumping a pointer through
+ * large chunks, and is only ever given back all at once. */
+struct bina_arena_chunk;
+struct bina_arena {
+	struct bina_arena_chunk *chunks;
+};
+
+/* Compact representation.  The fields every CFG pass touches are packed
+ * into dense arrays, pointers are replaced with 32-bit indices, and the
+ * operands move out into a side table. */
+struct bina_hot_instruction {
+	unsigned int offset;
+	unsigned int branch_target;
+	unsigned int basic_block;
+	unsigned char size;
+	unsigned char type;
+	unsigned char basic_block_leader;
+	unsigned char nr_operands;
+};
+
+struct bina_hot_block {
+	unsigned int offset;
+	unsigned int first_instruction;
+	unsigned int nr_instructions;
+	unsigned int first_successor;
+	unsigned int nr_successors;
+	unsigned int first_predecessor;
+	unsigned int nr_predecessors;
+};
+
+struct bina_compact {
+	/* With room for max_instructions, so a patch can splice in place. */
+	struct bina_hot_instruction *instructions;
+	unsigned int nr_instructions;
+	unsigned int max_instructions;
+	
+	/* The operands of instruction i are operands[operand_index[i]] up to
+	 * operands[operand_index[i + 1]]. */
+	struct bina_operand *operands;
+	unsigned int *operand_index;
+	
+	/* The block tables have room for max_blocks and max_edges, and are
+	 * kept when the blocks are detected again if they're big enough. */
+	struct bina_hot_block *blocks;
+	unsigned int nr_blocks;
+	unsigned int max_blocks;
+	
+	/* Block indices, laid out exactly like the context's CSR arrays. */
+	unsigned int *successors;
+	unsigned int *predecessors;
+	unsigned int nr_edges;
+	unsigned int max_edges;
+};
+
+#define bina_for_each_hot_instruction(c, i) \
+	for ((i) = 0; (i) < (c)->nr_instructions; (i)++)
+
+#define bina_for_each_hot_block_instruction(c, b, i) \
+	for ((i) = (c)->blocks[b].first_instruction; \
+		(i) < (c)->blocks[b].first_instruction + (c)->blocks[b].nr_instructions; (i)++)
+
+#define bina_for_each_hot_successor(c, b, e) \
+	for ((e) = (c)->blocks[b].first_successor; \
+		(e) < (c)->blocks[b].first_successor + (c)->blocks[b].nr_successors; (e)++)
+
+#define bina_for_each_hot_predecessor(c, b, e) \
+	for ((e) = (c)->blocks[b].first_predecessor; \
+		(e) < (c)->blocks[b].first_predecessor + (c)->blocks[b].nr_predecessors; (e)++)
+
+/* A function found by bina_discover_functions().  Its blocks and edges
+ * are only built when bina_build_function() is first called on it, and
+ * use the compact layout: block instruction ranges index the context's
+ * instructions, and edges index this function's blocks.  Calls don't end
+ * blocks, and tail calls to other functions aren't edges. */
+struct bina_function {
+	struct bina_context *context;
+	unsigned int index;
+	unsigned int offset;
+	int built;
+	
+	struct bina_hot_block *blocks;
+	unsigned int nr_blocks;
+	
+	unsigned int *successors;
+	unsigned char *successor_kinds;
+	unsigned int *predecessors;
+	unsigned char *predecessor_kinds;
+	unsigned int nr_edges;
+	
+	/* Instruction indices of the calls made by the function. */
+	unsigned int *calls;
+	unsigned int nr_calls;
+};
+
+/* Which functions call which, from the direct call targets, see
+ * bina_build_call_graph().  Both directions are kept in compressed
+ * sparse row form, with each pair of functions linked at most once.
+ * Function f calls callees[first_callee[f] .. first_callee[f + 1]), and
+ * callers work the same way.
+ *
+ * Strongly connected components are numbered bottom up: a function's
+ * callees are all in its own component or in lower numbered ones.
+ * Component c holds members[first_member[c] .. first_member[c + 1]), and
+ * the components calling into it are listed the same way, once each. */
+struct bina_call_graph {
+	unsigned int *first_callee;
+	unsigned int *callees;
+	unsigned int *first_caller;
+	unsigned int *callers;
+	unsigned int nr_edges;
+	
+	unsigned int *component;
+	unsigned int *first_member;
+	unsigned int *members;
+	unsigned int *first_component_caller;
+	unsigned int *component_callers;
+	
+	/* How many other components each one calls into. */
+	unsigned int *nr_component_callees;
+	unsigned int nr_components;
+};
+
+struct bina_block_edge {
+	unsigned int source;
+	unsigned int target;
+};
+
+/* A natural loop, see bina_analyse_loops().  Its blocks, nested loops'
+ * included, are a slice of the forest's blocks array with the header
+ * first, and a nested loop's slice lies inside its parent's.  Exits are
+ * the edges leaving the loop, and back edges the ones returning to the
+ * header from inside it. */
+struct bina_loop {
+	unsigned int header;
+	unsigned int parent;
+	unsigned int depth;
+	
+	/* Set if an edge into the middle of a cycle lies inside this loop,
+	 * with no loop of its own. */
+	int irreducible;
+	
+	unsigned int first_block;
+	unsigned int nr_blocks;
+	unsigned int first_exit;
+	unsigned int nr_exits;
+	unsigned int first_back_edge;
+	unsigned int nr_back_edges;
+};
+
+/* Dominators and loops over the basic blocks.  dominators holds each
+ * block's immediate dominator, or BINA_NO_INDEX where that's the virtual
+ * root above the entry points and any blocks they don't reach, and
+ * block_loops the innermost loop holding each block, if any.  Inner
+ * loops are numbered before the loops containing them.  Retreating edges
+ * that aren't back edges of any loop are kept as irreducible edges. */
+struct bina_loop_forest {
+	unsigned int *dominators;
+	unsigned int *block_loops;
+	
+	struct bina_loop *loops;
+	unsigned int nr_loops;
+	
+	unsigned int *blocks;
+	struct bina_block_edge *exits;
+	struct bina_block_edge *back_edges;
+	struct bina_block_edge *irreducible_edges;
+	unsigned int nr_irreducible_edges;
+	
+	/* One per loop, see bina_estimate_trip_counts(). */
+	struct bina_trip_count *trip_counts;
+};
+
+enum bina_trip_kind {
+	TK_UNKNOWN		= 0,
+	TK_CONSTANT		= 1,
+	TK_SYMBOLIC		= 2,
+};
+
+/* A loop's trip count, from a basic induction variable: one stepped by
+ * a constant exactly once on every iteration, by the update instruction.
+ * It starts at init, which is the variable itself where its value on
+ * entry isn't known, and the loop carries on while the variable compares
+ * with bound as condition says, at the test branch.  There it has been
+ * stepped k + adjust times on iteration k, counting from zero.
+ *
+ * count is the number of times the variable is stepped each time the
+ * loop is entered, which for the usual loop is how often its body runs.
+ * It's only worked out when init and bound are both constants; with
+ * either held in a register or memory the estimate is symbolic, roughly
+ * (bound - init) / step. */
+struct bina_trip_count {
+	enum bina_trip_kind kind;
+	unsigned long long count;
+	
+	struct bina_value variable;
+	struct bina_value init;
+	struct bina_value bound;
+	int step;
+	int adjust;
+	enum bina_condition condition;
+	
+	unsigned int update;
+	unsigned int test;
+};
+
+/* A control flow graph in the compact layout, over either a section's
+ * blocks or a function's, see bina_get_section_graph() and
+ * bina_get_function_graph().  entry is the block analyses start from. */
+struct bina_hot_graph {
+	struct bina_context *context;
+	struct bina_hot_block *blocks;
+	unsigned int nr_blocks;
+	unsigned int *successors;
+	unsigned int *predecessors;
+	unsigned int nr_edges;
+	unsigned int entry;
+	
+	/* Set when the arrays are private copies for bina_put_hot_graph()
+	 * to free. */
+	int copied;
+};
+
+/* Dataflow problem flags. */
+#define BINA_DATAFLOW_BACKWARD	0x1	/* Facts flow from successors to predecessors. */
+#define BINA_DATAFLOW_INTERSECT	0x2	/* Meet with intersection rather than union. */
+
+#define BINA_BITS_PER_WORD	(8 * sizeof(unsigned long))
+
+/* A gen/kill bit vector problem over a graph.  Each of the per-block
+ * sets is nr_words words, block b's starting at b * nr_words, and in and
+ * out are at the block's entry and exit whichever way facts flow.  Fill
+ * in gen and kill, then call bina_dataflow_solve(). */
+struct bina_dataflow {
+	struct bina_hot_graph *graph;
+	unsigned int flags;
+	unsigned int nr_bits;
+	unsigned int nr_words;
+	
+	unsigned long *gen;
+	unsigned long *kill;
+	unsigned long *in;
+	unsigned long *out;
+};
+
+#define bina_dataflow_set(df, sets, b)	(&(sets)[(size_t)(b) * (df)->nr_words])
+#define bina_bit_test(set, n)	(((set)[(n) / BINA_BITS_PER_WORD] >> ((n) % BINA_BITS_PER_WORD)) & 1)
+#define bina_bit_set(set, n)	((set)[(n) / BINA_BITS_PER_WORD] |= 1UL << ((n) % BINA_BITS_PER_WORD))
+#define bina_bit_clear(set, n)	((set)[(n) / BINA_BITS_PER_WORD] &= ~(1UL << ((n) % BINA_BITS_PER_WORD)))
+
+/* A register definition for reaching definitions: an instruction index
+ * and the register it writes. */
+struct bina_definition {
+	unsigned int instruction;
+	unsigned int reg;
+};
+
+/* A per-function analysis for bina_analyse_bottom_up(), returning
+ * non-zero to stop the run. */
+typedef int (*bina_function_analysis_fn)(struct bina_function *fn, void *priv);
+
 struct bina_context {
 	const struct bina_arch *arch;
+	unsigned int flags;
+	
+	/* Serialises arena allocation for work that can run on several
+	 * threads at once: per-function graphs and lazy operands. */
+	pthread_mutex_t lock;
+	
+	/* Analysis data for the lifetime of the context lives in arena, and
+	 * anything derived from the basic blocks lives in block_arena.  The
+	 * compact view, the jump tables, the loops and the functions each
+	 * have an arena of their own, since a patch can throw any of them
+	 * away by itself. */
+	struct bina_arena arena;
+	struct bina_arena block_arena;
+	struct bina_arena compact_arena;
+	struct bina_arena jump_table_arena;
+	struct bina_arena loop_arena;
+	struct bina_arena function_arena;
+	
+	/* Operand arrays a patch has taken off its instructions, by length,
+	 * for decoding to hand out again.  Each links to the next through
+	 * its first slot. */
+	struct bina_operand *free_operands[4];
 	
 	char *base;
 	unsigned int size;
 	
+	/* Where the code is loaded in the target, when known.  Zero for a
+	 * bare buffer. */
+	unsigned long load_address;
+	
+	/* Entry point offsets that seed a recursive descent. */
+	unsigned int *entries;
+	unsigned int nr_entries;
+	
+	/* The rest of the image, where that's known, for reading the data
+	 * the code refers to.  The context's own bytes are always readable
+	 * at load_address. */
+	const struct bina_region *regions;
+	unsigned int nr_regions;
+	
 	struct bina_instruction *instructions;
 	unsigned int nr_instructions;
+	unsigned int max_instructions;
 	
+	/* Offset lookup index.  Maps every byte offset to one more than the
+	 * index of the instruction covering it, or zero for undecoded bytes. */
+	unsigned int *offset_index;
+	
+	/* Optional rendered instruction text.  All lines live back to back
+	 * in one arena, and text_offsets holds each instruction's start. */
+	char *text;
+	unsigned int *text_offsets;
+	
+	/* The blocks in address order.  There's room for max_basic_blocks,
+	 * so a patch can add some without moving them all. */
 	struct bina_basic_block *blocks;
 	unsigned int nr_basic_blocks;
+	unsigned int max_basic_blocks;
+	
+	/* Control flow graph edges, in compressed sparse row form.  Each
+	 * block's successor and predecessor lists are slices of these
+	 * arrays, laid out in block order, and the kind arrays hold an enum
+	 * bina_edge_kind per edge.  All four have room for max_edges. */
+	struct bina_basic_block **successors;
+	unsigned char *successor_kinds;
+	struct bina_basic_block **predecessors;
+	unsigned char *predecessor_kinds;
+	unsigned int nr_edges;
+	unsigned int max_edges;
+	
+	/* Opt-in compact view, see bina_build_compact(). */
+	struct bina_compact *compact;
+	
+	/* See bina_resolve_jump_tables(). */
+	struct bina_jump_table *jump_tables;
+	unsigned int nr_jump_tables;
+	int jump_tables_resolved;
+	
+	/* Every direct branch and jump table entry, sorted by target.  Built
+	 * the first time bina_patch_range() needs to know what branches into
+	 * a patch, and kept up to date by it from then on. */
+	struct bina_branch_ref *branch_refs;
+	unsigned int nr_branch_refs;
+	unsigned int max_branch_refs;
+	
+	/* Dominators and loops, see bina_analyse_loops(). */
+	struct bina_loop_forest *loops;
+	
+	/* Functions, sorted by entry offset, see bina_discover_functions(). */
+	struct bina_function *functions;
+	unsigned int nr_functions;
+	
+	/* See bina_build_call_graph(). */
+	struct bina_call_graph *call_graph;
+	
+	/* The mapped cache file, for contexts from bina_cache_load(). */
+	void *cache;
+	size_t cache_size;
 };
 
 struct bina_basic_block {
@@ -136,18 +641,38 @@ struct bina_basic_block {
 	unsigned int nr_instructions;
 	
 	struct bina_basic_block **predecessors;
+	unsigned char *predecessor_kinds;
 	unsigned int nr_predecessors;
 	struct bina_basic_block **successors;
+	unsigned char *successor_kinds;
 	unsigned int nr_successors;
 	
 	struct bina_basic_block *next;
 	struct bina_basic_block *prev;
 };
 
+/* Breakpoint flags. */
+#define BINA_BREAK_ONESHOT	0x1	/* Remove on the first hit, for coverage. */
+
 struct bina_trace;
 struct bina_breakpoint {
 	struct bina_trace *trace;
 	struct bina_instruction *instruction;
+	unsigned int flags;
+	
+	/* Cleared once a one-shot breakpoint has been hit and removed. */
+	int armed;
+	
+	/* Set while bina_install_breakpoints() has it in a batch. */
+	int queued;
+	
+	/* How many threads are stepping over it, with the original code
+	 * put back meanwhile. */
+	unsigned int lifted;
+	
+	/* Set once its instruction has a copy in the scratch area, or -1 if
+	 * it can't be moved and has to be stepped over in place. */
+	int displaced;
 	
 	unsigned long addr;
 	unsigned long code_real;
@@ -158,7 +683,13 @@ struct bina_breakpoint {
 
 typedef int (*bina_break_handler_fn)(struct bina_breakpoint *breakpoint);
 
-#define MAX_BREAKPOINTS		256
+struct bina_thread {
+	pid_t tid;
+	int stopped;
+	
+	/* The breakpoint this thread is single stepping over, if any. */
+	struct bina_breakpoint *stepping;
+};
 
 struct bina_trace {
 	struct bina_context *context;
@@ -170,22 +701,167 @@ struct bina_trace {
 	const char *path;
 	void *text_base;
 	
-	struct bina_breakpoint breakpoints[MAX_BREAKPOINTS];
+	/* Breakpoints come out of an arena, so they never move, and are
+	 * found by the index of the instruction they're on.  A trap address
+	 * goes through the context's offset index to get there. */
+	struct bina_arena breakpoint_arena;
+	struct bina_breakpoint **breakpoints;
 	unsigned int nr_breakpoints;
+	
+	/* The tracee's /proc/<pid>/mem, for batched text writes, or -1. */
+	int mem_fd;
+	
+	/* Every thread of the tracee, and one that's stopped right now, for
+	 * the ptrace calls that need one. */
+	struct bina_thread *threads;
+	unsigned int nr_threads, max_threads;
+	pid_t current;
+	
+	/* Where in the tracee instructions are run out of line, one slot
+	 * for each, by index, or zero. */
+	unsigned long scratch;
 };
 
 extern struct bina_context *bina_create(const struct bina_arch *arch, char *base, unsigned int size);
+extern struct bina_context *bina_create_flags(const struct bina_arch *arch, char *base, unsigned int size, unsigned int flags);
+extern struct bina_context *bina_create_recursive(const struct bina_arch *arch, char *base, unsigned int size, unsigned int flags, const unsigned int *entries, unsigned int nr_entries);
 extern void bina_destroy(struct bina_context *ctx);
 
+#define MAX_INSTRUCTION_TEXT	256
+
+extern int bina_decode_operands(struct bina_instruction *ins);
+extern int bina_decode_block_operands(struct bina_basic_block *block);
 extern void bina_print_instruction(struct bina_instruction *ins);
+extern int bina_format_instruction(struct bina_instruction *ins, char *buffer, unsigned int size);
+extern int bina_render_instructions(struct bina_context *ctx);
+extern const char *bina_instruction_text(struct bina_instruction *ins);
 extern int bina_detect_basic_blocks(struct bina_context *ctx);
 extern void bina_destroy_basic_blocks(struct bina_context *ctx);
 extern struct bina_instruction *bina_instruction_at(struct bina_context *ctx, unsigned int offset);
+extern struct bina_instruction *bina_instruction_covering(struct bina_context *ctx, unsigned int offset);
+extern struct bina_basic_block *bina_block_at(struct bina_context *ctx, unsigned int offset);
+extern unsigned int bina_lookup_instructions(struct bina_context *ctx, unsigned long load_base, const unsigned long *addrs, unsigned int count, struct bina_instruction **out);
+extern unsigned int bina_lookup_blocks(struct bina_context *ctx, unsigned long load_base, const unsigned long *addrs, unsigned int count, struct bina_basic_block **out);
+
+/* Streaming disassembly.  Instructions are handed out as they're
+ * decoded, and blocks as soon as they're complete, from a bounded window
+ * that is reused once the block callback returns.  Blocks end at control
+ * transfers, undecodable bytes and forward branch targets; targets that
+ * point backwards can't split blocks already delivered.  A non-zero
+ * return from either callback stops the stream and is returned. */
+struct bina_stream_ops {
+	int (*instruction)(struct bina_instruction *ins, void *priv);
+	int (*block)(struct bina_basic_block *block, void *priv);
+};
+
+extern int bina_stream(const struct bina_arch *arch, char *base, unsigned int size, const struct bina_stream_ops *ops, void *priv);
+
+/* A mapped ELF image, with a context over each executable section.
+ * Contexts, names and symbols all refer into the mapping, which stays
+ * until bina_close_elf().  The mapping is a private copy, so sections can
+ * be patched with bina_patch_range(). */
+struct bina_elf_section {
+	const char *name;
+	unsigned int index;
+	unsigned long address;
+	char *base;
+	unsigned int size;
+	struct bina_context *ctx;
+};
+
+struct bina_symbol {
+	const char *name;
+	unsigned long address;
+	unsigned int size;
+	struct bina_elf_section *section;
+	unsigned int offset;
+};
+
+struct bina_elf {
+	char *image;
+	size_t size;
+	unsigned long entry;
+	
+	struct bina_elf_section *sections;
+	unsigned int nr_sections;
+	
+	/* Function symbols in executable sections, sorted by address. */
+	struct bina_symbol *symbols;
+	unsigned int nr_symbols;
+	
+	/* Every section loaded into memory, for the contexts to read data
+	 * from. */
+	struct bina_region *regions;
+	unsigned int nr_regions;
+};
+
+extern struct bina_elf *bina_open_elf(const struct bina_arch *arch, const char *path, unsigned int flags);
+extern void bina_close_elf(struct bina_elf *elf);
 
 extern struct bina_trace *bina_trace_init(struct bina_context *ctx, const char *path, void *text_base, bina_break_handler_fn handler);
 extern void bina_trace_destroy(struct bina_trace *trace);
 extern struct bina_breakpoint *bina_install_breakpoint(struct bina_trace *trace, struct bina_instruction *ins, void *state);
+extern struct bina_breakpoint *bina_install_breakpoint_flags(struct bina_trace *trace, struct bina_instruction *ins, void *state, unsigned int flags);
+extern int bina_install_breakpoints(struct bina_trace *trace, struct bina_instruction **instructions, unsigned int count, void *state, unsigned int flags);
+extern int bina_remove_breakpoints(struct bina_trace *trace);
+extern int bina_trace_detach(struct bina_trace *trace);
 extern int bina_trace_run(struct bina_trace *trace);
 
+extern int bina_resolve_jump_tables(struct bina_context *ctx);
 extern int bina_analyse_loops(struct bina_context *ctx);
+extern int bina_estimate_trip_counts(struct bina_context *ctx);
+
+extern int bina_build_compact(struct bina_context *ctx);
+extern void bina_destroy_compact(struct bina_context *ctx);
+
+extern int bina_patch_range(struct bina_context *ctx, unsigned int offset, unsigned int length);
+
+extern int bina_discover_functions(struct bina_context *ctx);
+extern struct bina_function *bina_function_at(struct bina_context *ctx, unsigned int offset);
+extern int bina_build_function(struct bina_function *fn);
+
+extern int bina_get_section_graph(struct bina_context *ctx, struct bina_hot_graph *graph);
+extern int bina_get_function_graph(struct bina_function *fn, struct bina_hot_graph *graph);
+extern void bina_put_hot_graph(struct bina_hot_graph *graph);
+
+extern int bina_dataflow_init(struct bina_dataflow *df, struct bina_hot_graph *graph, unsigned int nr_bits, unsigned int flags);
+extern int bina_dataflow_solve(struct bina_dataflow *df);
+extern void bina_dataflow_destroy(struct bina_dataflow *df);
+extern int bina_liveness(struct bina_dataflow *df, struct bina_hot_graph *graph);
+extern int bina_reaching_definitions(struct bina_dataflow *df, struct bina_hot_graph *graph,
+	struct bina_definition **definitions, unsigned int *nr_definitions);
+
+extern int bina_build_call_graph(struct bina_context *ctx);
+extern int bina_analyse_bottom_up(struct bina_context *ctx, bina_function_analysis_fn analyse, void *priv, unsigned int nr_threads);
+
+/* Persistent analysis cache.  A saved context holds its instructions,
+ * blocks and edges, and its loop forest if it has one, keyed by a hash
+ * of the code bytes, and loads with its basic blocks already detected. */
+extern int bina_cache_save(struct bina_context *ctx, const char *path);
+extern struct bina_context *bina_cache_load(const struct bina_arch *arch, char *base, unsigned int size, const char *path);
+extern struct bina_context *bina_create_cached(const struct bina_arch *arch, char *base, unsigned int size, unsigned int flags, const char *path);
+
+#ifdef __BINA_LIBRARY__
+/* Instruction storage helpers for architecture backends. */
+extern struct bina_instruction *bina_new_instruction(struct bina_context *ctx);
+extern void bina_finish_instructions(struct bina_context *ctx);
+extern struct bina_operand *bina_alloc_operands(struct bina_context *ctx, unsigned int nr);
+extern void bina_free_operands(struct bina_context *ctx, struct bina_operand *operands, unsigned int nr);
+extern int bina_linear_sweep(struct bina_context *ctx);
+extern int bina_parallel_sweep(struct bina_context *ctx);
+extern int bina_recursive_sweep(struct bina_context *ctx);
+extern int bina_build_offset_index(struct bina_context *ctx);
+extern int bina_set_entries(struct bina_context *ctx, const unsigned int *entries, unsigned int nr_entries);
+extern unsigned int bina_context_flags(unsigned int flags);
+
+extern int bina_compact_sync_blocks(struct bina_context *ctx);
+extern void bina_compact_sync_block(struct bina_context *ctx, unsigned int index);
+
+extern unsigned int bina_max_block_edges(struct bina_context *ctx);
+extern unsigned int bina_block_edges(struct bina_basic_block *block, struct bina_basic_block **targets, unsigned char *kinds);
+
+extern void *bina_arena_alloc(struct bina_arena *arena, size_t nr, size_t size);
+extern void bina_arena_reset(struct bina_arena *arena);
+extern void bina_arena_destroy(struct bina_arena *arena);
+#endif
 #endif
@@ -3,7 +3,31 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <pthread.h>
 #include <libdis.h>
+#include "x86-32.h"
+
+/* libdisasm keeps its state in globals, so it stays initialised for as
+ * long as any context might still ask for instruction text.  Contexts
+ * may be created and destroyed on different threads. */
+static int libdisasm_users;
+static pthread_mutex_t libdisasm_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void libdisasm_get(void)
+{
+	pthread_mutex_lock(&libdisasm_lock);
+	if (libdisasm_users++ == 0)
+		x86_init(opt_none, NULL, NULL);
+	pthread_mutex_unlock(&libdisasm_lock);
+}
+
+static void libdisasm_put(void)
+{
+	pthread_mutex_lock(&libdisasm_lock);
+	if (--libdisasm_users == 0)
+		x86_cleanup();
+	pthread_mutex_unlock(&libdisasm_lock);
+}
 
 static void printi(x86_insn_t *insn)
 {
@@ -37,23 +61,13 @@ static void decode_branch(struct bina_instruction *bi, x86_insn_t *ri)
 
 static void decode_operand_expression(struct bina_operand *bo, x86_op_t *ro)
 {
-	/*unsigned int     scale;         / * scale factor * /
-    x86_reg_t        index, base;   / * index, base registers * /
-        int32_t          disp;          / * displacement * /
-        char             disp_sign;     / * is negative? 1/0 * /
-        char             disp_size; */
-    
-    /*printf("expr: ");
-    printi(ro->insn);
-    printf("\n");
-    
-    printf("scale=%d, index=%d, base=%d, disp=0x%x\n",
-		ro->data.expression.scale,
-		ro->data.expression.index.id,
-		ro->data.expression.base.id,
-		ro->data.expression.disp);*/
-    
-	return;
+	x86_ea_t *ea = &ro->data.expression;
+	
+	bo->size = SZ_NA;
+	bo->value.reg_expr.base_register = ea->base.id;
+	bo->value.reg_expr.index_register = ea->index.id;
+	bo->value.reg_expr.scale = ea->scale;
+	bo->value.reg_expr.displacement = ea->disp;
 }
 
 static void decode_operand_data(struct bina_operand *bo, x86_op_t *ro)
@@ -128,17 +142,255 @@ static void decode_operand(struct bina_operand *bo, x86_op_t *ro)
 	}
 }
 
-static void decode_operands(struct bina_instruction *bi, x86_insn_t *ri)
+/* libdisasm's register ids are private to it, so general registers are
+ * recognised by name, in every width. */
+static const char *const register_names[][4] = {
+	[X86_EAX] = { "eax", "ax", "al", "ah" },
+	[X86_ECX] = { "ecx", "cx", "cl", "ch" },
+	[X86_EDX] = { "edx", "dx", "dl", "dh" },
+	[X86_EBX] = { "ebx", "bx", "bl", "bh" },
+	[X86_ESP] = { "esp", "sp" },
+	[X86_EBP] = { "ebp", "bp" },
+	[X86_ESI] = { "esi", "si" },
+	[X86_EDI] = { "edi", "di" },
+};
+
+static int register_unit(x86_reg_t *reg)
+{
+	unsigned int r, n;
+	
+	for (r = 0; r < sizeof(register_names) / sizeof(register_names[0]); r++) {
+		for (n = 0; n < 4 && register_names[r][n]; n++) {
+			if (!strcmp(reg->name, register_names[r][n]))
+				return r;
+		}
+	}
+	
+	return -1;
+}
+
+static void access_operand(x86_op_t *op, x86_insn_t *insn, void *arg)
+{
+	struct bina_instruction *bi = arg;
+	int unit;
+	
+	if (op->type == op_register) {
+		unit = register_unit(&op->data.reg);
+		if (unit < 0)
+			return;
+		
+		if (op->access & op_read)
+			bi->uses |= 1 << unit;
+		
+		if (op->access & op_write) {
+			bi->defs |= 1 << unit;
+			if (op->data.reg.size < 4)
+				bi->uses |= 1 << unit;
+		}
+	} else if (op->type == op_expression) {
+		/* Address registers are only ever read. */
+		unit = register_unit(&op->data.expression.base);
+		if (unit >= 0)
+			bi->uses |= 1 << unit;
+		
+		unit = register_unit(&op->data.expression.index);
+		if (unit >= 0)
+			bi->uses |= 1 << unit;
+	}
+}
+
+/* Work out which registers an instruction writes and reads, implicit
+ * operands included.  Calls and returns follow the cdecl convention:
+ * a call clobbers the scratch registers, and a return hands back the
+ * result and the callee-saved registers. */
+static void decode_registers(struct bina_instruction *bi, x86_insn_t *ri)
+{
+	x86_op_t *op1 = x86_operand_1st(ri), *op2 = x86_operand_2nd(ri);
+	int unit;
+	
+	bi->defs = bi->uses = 0;
+	x86_operand_foreach(ri, access_operand, bi, op_any);
+	
+	if (ri->flags_set)
+		bi->defs |= 1 << X86_EFLAGS;
+	if (ri->flags_tested)
+		bi->uses |= 1 << X86_EFLAGS;
+	
+	/* xor %eax, %eax and the like don't depend on the old value. */
+	if ((ri->type == insn_xor || ri->type == insn_sub) && op1 && op2 &&
+			op1->type == op_register && op2->type == op_register &&
+			op1->data.reg.id == op2->data.reg.id && op1->data.reg.size == 4) {
+		unit = register_unit(&op1->data.reg);
+		if (unit >= 0)
+			bi->uses &= ~(1 << unit);
+	}
+	
+	if (ri->type == insn_call)
+		bi->defs |= (1 << X86_EAX) | (1 << X86_ECX) | (1 << X86_EDX) | (1 << X86_EFLAGS);
+	
+	if (ri->type == insn_return)
+		bi->uses |= (1 << X86_EAX) | (1 << X86_EDX) | (1 << X86_EBX) | (1 << X86_ESP) |
+			(1 << X86_EBP) | (1 << X86_ESI) | (1 << X86_EDI);
+}
+
+/* Name a word-sized operand for the loop analysis.  Narrow immediates
+ * are sign extended, as they are in word-sized instructions. */
+static void decode_value(struct bina_value *v, x86_op_t *op)
+{
+	int unit;
+	
+	v->kind = VK_NONE;
+	
+	switch (op->type) {
+	case op_register:
+		unit = register_unit(&op->data.reg);
+		if (unit >= 0 && op->data.reg.size == 4) {
+			v->kind = VK_REGISTER;
+			v->reg = unit;
+		}
+		break;
+	case op_immediate:
+		v->kind = VK_CONSTANT;
+		if (op->datatype == op_byte)
+			v->constant = op->data.sbyte;
+		else if (op->datatype == op_word)
+			v->constant = op->data.sword;
+		else
+			v->constant = op->data.sdword;
+		break;
+	case op_expression:
+		if (op->datatype != op_dword || op->data.expression.index.id)
+			break;
+		
+		unit = register_unit(&op->data.expression.base);
+		if (unit >= 0) {
+			v->kind = VK_MEMORY;
+			v->reg = unit;
+			v->constant = op->data.expression.disp;
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+static void decode_arithmetic(struct bina_instruction *bi, x86_insn_t *ri)
+{
+	struct bina_arithmetic *a = &bi->arithmetic;
+	x86_op_t *op1 = x86_operand_1st(ri), *op2 = x86_operand_2nd(ri);
+	x86_ea_t *ea;
+	int unit;
+	
+	memset(a, 0, sizeof(*a));
+	if (!op1)
+		return;
+	
+	if (op1->access & op_write)
+		decode_value(&a->dst, op1);
+	
+	/* lea computes an address rather than loading from it; a base
+	 * plus a displacement into the same register is an add. */
+	if ((unsigned char)bi->base[0] == 0x8d) {
+		if (a->dst.kind != VK_REGISTER || !op2 || op2->type != op_expression)
+			return;
+		
+		ea = &op2->data.expression;
+		unit = register_unit(&ea->base);
+		if (!ea->index.id && unit == a->dst.reg) {
+			a->operation = OP_ADD;
+			a->src.kind = VK_CONSTANT;
+			a->src.constant = ea->disp;
+		}
+		
+		return;
+	}
+	
+	switch (ri->type) {
+	case insn_mov:
+		a->operation = OP_MOVE;
+		break;
+	case insn_add:
+		a->operation = OP_ADD;
+		break;
+	case insn_sub:
+		a->operation = OP_SUB;
+		break;
+	case insn_inc:
+	case insn_dec:
+		a->operation = ri->type == insn_inc ? OP_ADD : OP_SUB;
+		a->src.kind = VK_CONSTANT;
+		a->src.constant = 1;
+		return;
+	case insn_cmp:
+		a->operation = OP_COMPARE;
+		decode_value(&a->dst, op1);
+		break;
+	case insn_test:
+	case insn_xor:
+		/* test %eax, %eax compares with zero, and xor %eax, %eax
+		 * clears it. */
+		if (!op2 || op1->type != op_register || op2->type != op_register ||
+				op1->data.reg.id != op2->data.reg.id)
+			return;
+		
+		a->operation = ri->type == insn_test ? OP_COMPARE : OP_MOVE;
+		decode_value(&a->dst, op1);
+		a->src.kind = VK_CONSTANT;
+		a->src.constant = 0;
+		return;
+	default:
+		return;
+	}
+	
+	if (op2)
+		decode_value(&a->src, op2);
+}
+
+/* A conditional branch's condition, from its opcode: 0x70 + cc short,
+ * or 0x0f 0x80 + cc near.  Prefixes, such as branch hints, are skipped.
+ * jecxz and the loop instructions don't test the flags. */
+static enum bina_condition decode_condition(struct bina_instruction *bi)
 {
-	int i;
+	const unsigned char *p = (const unsigned char *)bi->base;
+	const unsigned char *end = p + bi->size;
+	
+	while (p < end && (*p == 0x2e || *p == 0x3e || *p == 0x66 || *p == 0x67 ||
+			*p == 0xf2 || *p == 0xf3))
+		p++;
+	
+	if (p < end && *p >= 0x70 && *p <= 0x7f)
+		return CC_O + (*p & 0xf);
+	
+	if (p + 1 < end && p[0] == 0x0f && p[1] >= 0x80 && p[1] <= 0x8f)
+		return CC_O + (p[1] & 0xf);
+	
+	return CC_NONE;
+}
+
+static int decode_operands(struct bina_instruction *bi, x86_insn_t *ri)
+{
+	int i, count;
 	
 	x86_op_t *op1 = x86_operand_1st(ri);
 	x86_op_t *op2 = x86_operand_2nd(ri);
 	x86_op_t *op3 = x86_operand_3rd(ri);
 	
 	bi->nr_operands = 0;
+	decode_registers(bi, ri);
+	decode_arithmetic(bi, ri);
+	bi->condition = ri->type == insn_jcc ? decode_condition(bi) : CC_NONE;
 	
-	for (i = 0; i < MAX_OPERANDS; i++) {
+	count = op1 ? (op2 ? (op3 ? 3 : 2) : 1) : 0;
+	if (!count)
+		return 0;
+	
+	/* Operand storage comes out of the context arena, so instructions
+	 * that never have their operands decoded don't pay for them. */
+	bi->operands = bina_alloc_operands(bi->context, count);
+	if (!bi->operands)
+		return -1;
+	
+	for (i = 0; i < count; i++) {
 		bi->operands[i].ins = bi;
 	}
 	
@@ -156,9 +408,11 @@ static void decode_operands(struct bina_instruction *bi, x86_insn_t *ri)
 			}
 		}
 	}
+	
+	return 0;
 }
 
-static void decode(struct bina_instruction *bi, x86_insn_t *ri)
+static int decode(struct bina_instruction *bi, x86_insn_t *ri)
 {
 	switch(ri->type) {
 	case insn_call:
@@ -184,20 +438,43 @@ static void decode(struct bina_instruction *bi, x86_insn_t *ri)
 		break;
 	}
 	
-	decode_operands(bi, ri);
+	/* In lazy mode only the control flow skeleton is recorded, and
+	 * operands are decoded when first asked for. */
+	if (bi->context->flags & BINA_LAZY_OPERANDS)
+		return 0;
+	
+	if (decode_operands(bi, ri))
+		return -1;
+	
+	bi->operands_decoded = 1;
+	return 0;
 }
 
 static int x86_32_disasm(struct bina_context *ctx)
 {
-	int offset, index, length;
+	int offset, length, rc;
 	
-	ctx->instructions = calloc(ctx->size, sizeof(*ctx->instructions));
-	if (!ctx->instructions)
-		return -1;
+	libdisasm_get();
 	
-	x86_init(opt_none, NULL, NULL);
+	/* The fast path never touches libdisasm while decoding, it's only
+	 * needed later for operands and instruction text. */
+	if (ctx->flags & BINA_FAST_DECODE) {
+		if (ctx->flags & BINA_RECURSIVE)
+			rc = bina_recursive_sweep(ctx);
+		else if (ctx->flags & BINA_PARALLEL)
+			rc = bina_parallel_sweep(ctx);
+		else
+			rc = bina_linear_sweep(ctx);
+		
+		if (rc) {
+			free(ctx->instructions);
+			libdisasm_put();
+			return -1;
+		}
+		
+		return 0;
+	}
 
-	index = 0;
 	offset = 0;
 	while (offset < ctx->size) {
 		x86_insn_t insn;
@@ -205,29 +482,27 @@ static int x86_32_disasm(struct bina_context *ctx)
 		length = x86_disasm((unsigned char *)ctx->base, ctx->size, 0, offset, &insn);
 
 		if (length) {
-			struct bina_instruction *bi = &ctx->instructions[index];
+			struct bina_instruction *bi = bina_new_instruction(ctx);
+			
+			if (!bi) {
+				x86_oplist_free(&insn);
+				free(ctx->instructions);
+				libdisasm_put();
+				return -1;
+			}
 			
-			bi->index = index;
 			bi->offset = offset;
 			bi->base = ctx->base + offset;
 			bi->size = length;
-			bi->context = ctx;
-			bi->arch_priv = calloc(1, 256);
 			
-			if (bi->arch_priv) {
-				x86_format_insn(&insn, (char *)bi->arch_priv, 255, att_syntax);
+			if (decode(bi, &insn)) {
+				x86_oplist_free(&insn);
+				free(ctx->instructions);
+				libdisasm_put();
+				return -1;
 			}
-			
-			if (index < sizeof(*ctx->instructions) - 1)
-				bi->next = &ctx->instructions[index + 1];
-			
-			if (index > 0)
-				bi->prev = &ctx->instructions[index - 1];
-			
-			decode(bi, &insn);
 	
 			offset += length;
-			index++;
 		} else {
 			printf("warn: invalid instruction\n");
 			offset++;
@@ -236,32 +511,69 @@ static int x86_32_disasm(struct bina_context *ctx)
 		x86_oplist_free(&insn);
 	}
 
-	x86_cleanup();
-	
-	ctx->nr_instructions = index;
+	bina_finish_instructions(ctx);
 	
 	return 0;
 }
 
 static void x86_32_destroy(struct bina_context *ctx)
 {
-	int i;
-	for (i = 0; i < ctx->nr_instructions; i++) {
-		free(ctx->instructions[i].arch_priv);
+	free(ctx->instructions);
+	libdisasm_put();
+}
+
+static int x86_32_decode_operands(struct bina_instruction *ins)
+{
+	struct bina_context *ctx = ins->context;
+	x86_insn_t insn;
+	int rc = -1;
+	
+	/* Streamed instructions have no disassembled context holding a
+	 * reference, so take one for the duration. */
+	libdisasm_get();
+	
+	if (x86_disasm((unsigned char *)ctx->base, ctx->size, 0, ins->offset, &insn)) {
+		rc = decode_operands(ins, &insn);
+		x86_oplist_free(&insn);
 	}
 	
-	free(ctx->instructions);
+	libdisasm_put();
+	return rc;
 }
 
-static void x86_32_print(struct bina_instruction *ins)
+static int x86_32_format(struct bina_instruction *ins, char *buffer, unsigned int size)
 {
-	printf("%s", (char *)ins->arch_priv);
+	struct bina_context *ctx = ins->context;
+	x86_insn_t insn;
+	int length;
+	
+	/* Instruction text is rarely wanted, so rather than keeping it
+	 * around, re-decode the instruction whenever it's asked for. */
+	libdisasm_get();
+	
+	length = x86_disasm((unsigned char *)ctx->base, ctx->size, 0, ins->offset, &insn);
+	if (length) {
+		length = x86_format_insn(&insn, buffer, size, att_syntax);
+		x86_oplist_free(&insn);
+	} else {
+		length = -1;
+	}
+	
+	libdisasm_put();
+	return length;
 }
 
 const struct bina_arch x86_32_arch = {
 	.disassemble = x86_32_disasm,
 	.destroy = x86_32_destroy,
-	.print_instruction = x86_32_print,
+	.format_instruction = x86_32_format,
+	.decode_instruction = x86_32_fast_decode,
+	.decode_operands = x86_32_decode_operands,
+	.jump_table = x86_32_jump_table,
+	.displace = x86_32_displace,
+	.max_instruction_size = 15,
+	.nr_registers = X86_NR_REGISTERS,
+	.flags_register = X86_EFLAGS,
 	
 	.break_code = 0xcc,
 	.break_mask = 0xff,
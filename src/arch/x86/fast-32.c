@@ -0,0 +1,512 @@
+#include <bina.h>
+#include <stddef.h>
+#include "x86-32.h"
+
+/*
+ * A table-driven x86-32 decoder that only recovers what the control flow
+ * passes need: the instruction length, its bina_instruction_type and any
+ * direct branch target.  It keeps no state, so it is safe to call from
+ * any number of threads at once.
+ */
+
+#define MAX_INSN_LENGTH		15
+
+#define F_MODRM		0x01	/* A ModRM byte (and maybe SIB/displacement) follows. */
+#define F_IMM8		0x02	/* An 8-bit immediate follows. */
+#define F_IMMZ		0x04	/* A 16- or 32-bit immediate, by operand size. */
+#define F_IMM16		0x08	/* A 16-bit immediate follows. */
+#define F_MOFFS		0x10	/* A memory offset, by address size. */
+#define F_PREFIX	0x20	/* Legacy prefix byte. */
+#define F_INVALID	0x40	/* Not a valid opcode in 32-bit mode. */
+
+#define M	F_MODRM
+#define I8	F_IMM8
+#define IZ	F_IMMZ
+#define I16	F_IMM16
+#define MO	F_MOFFS
+#define P	F_PREFIX
+#define X	F_INVALID
+
+static const unsigned char one_byte[256] = {
+	/*  0     1     2     3     4     5     6     7     8     9     a     b     c     d     e     f */
+	    M,    M,    M,    M,   I8,   IZ,    0,    0,    M,    M,    M,    M,   I8,   IZ,    0,    0, /* 0 */
+	    M,    M,    M,    M,   I8,   IZ,    0,    0,    M,    M,    M,    M,   I8,   IZ,    0,    0, /* 1 */
+	    M,    M,    M,    M,   I8,   IZ,    P,    0,    M,    M,    M,    M,   I8,   IZ,    P,    0, /* 2 */
+	    M,    M,    M,    M,   I8,   IZ,    P,    0,    M,    M,    M,    M,   I8,   IZ,    P,    0, /* 3 */
+	    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0, /* 4 */
+	    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0, /* 5 */
+	    0,    0,    M,    M,    P,    P,    P,    P,   IZ, M|IZ,   I8, M|I8,    0,    0,    0,    0, /* 6 */
+	   I8,   I8,   I8,   I8,   I8,   I8,   I8,   I8,   I8,   I8,   I8,   I8,   I8,   I8,   I8,   I8, /* 7 */
+	 M|I8, M|IZ, M|I8, M|I8,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M, /* 8 */
+	    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,IZ|I16,   0,    0,    0,    0,    0, /* 9 */
+	   MO,   MO,   MO,   MO,    0,    0,    0,    0,   I8,   IZ,    0,    0,    0,    0,    0,    0, /* a */
+	   I8,   I8,   I8,   I8,   I8,   I8,   I8,   I8,   IZ,   IZ,   IZ,   IZ,   IZ,   IZ,   IZ,   IZ, /* b */
+	 M|I8, M|I8,  I16,    0,    M,    M, M|I8, M|IZ,I16|I8,   0,  I16,    0,    0,   I8,    0,    0, /* c */
+	    M,    M,    M,    M,   I8,   I8,    0,    0,    M,    M,    M,    M,    M,    M,    M,    M, /* d */
+	   I8,   I8,   I8,   I8,   I8,   I8,   I8,   I8,   IZ,   IZ,IZ|I16,  I8,    0,    0,    0,    0, /* e */
+	    P,    0,    P,    P,    0,    0,    M,    M,    0,    0,    0,    0,    0,    0,    M,    M, /* f */
+};
+
+static const unsigned char two_byte[256] = {
+	/*  0     1     2     3     4     5     6     7     8     9     a     b     c     d     e     f */
+	    M,    M,    M,    M,    X,    0,    0,    0,    0,    0,    X,    0,    X,    M,    0, M|I8, /* 0 */
+	    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M, /* 1 */
+	    M,    M,    M,    M,    M,    X,    M,    X,    M,    M,    M,    M,    M,    M,    M,    M, /* 2 */
+	    0,    0,    0,    0,    0,    0,    X,    0,    M,    X, M|I8,    X,    X,    X,    X,    X, /* 3 */
+	    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M, /* 4 */
+	    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M, /* 5 */
+	    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M, /* 6 */
+	 M|I8, M|I8, M|I8, M|I8,    M,    M,    M,    0,    M,    M,    X,    X,    M,    M,    M,    M, /* 7 */
+	   IZ,   IZ,   IZ,   IZ,   IZ,   IZ,   IZ,   IZ,   IZ,   IZ,   IZ,   IZ,   IZ,   IZ,   IZ,   IZ, /* 8 */
+	    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M, /* 9 */
+	    0,    0,    0,    M, M|I8,    M,    X,    X,    0,    0,    0,    M, M|I8,    M,    M,    M, /* a */
+	    M,    M,    M,    M,    M,    M,    M,    M,    M,    M, M|I8,    M,    M,    M,    M,    M, /* b */
+	    M,    M, M|I8,    M, M|I8, M|I8, M|I8,    M,    0,    0,    0,    0,    0,    0,    0,    0, /* c */
+	    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M, /* d */
+	    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M, /* e */
+	    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M,    M, /* f */
+};
+
+#undef M
+#undef I8
+#undef IZ
+#undef I16
+#undef MO
+#undef P
+#undef X
+
+/* Skip over a ModRM byte and whatever SIB and displacement bytes it
+ * implies.  Returns NULL if the encoding runs off the end of the input. */
+static const unsigned char *skip_modrm(const unsigned char *p, const unsigned char *end, int addr16, unsigned char *modrm)
+{
+	unsigned int mod, rm, disp = 0;
+
+	if (p >= end)
+		return NULL;
+
+	*modrm = *p++;
+	mod = *modrm >> 6;
+	rm = *modrm & 7;
+
+	if (mod == 3)
+		return p;
+
+	if (addr16) {
+		if (mod == 0 && rm == 6)
+			disp = 2;
+		else if (mod == 1)
+			disp = 1;
+		else if (mod == 2)
+			disp = 2;
+	} else {
+		if (rm == 4) {
+			if (p >= end)
+				return NULL;
+
+			/* A SIB base of ebp with no displacement means disp32. */
+			if (mod == 0 && (*p & 7) == 5)
+				disp = 4;
+
+			p++;
+		}
+
+		if (mod == 0 && rm == 5)
+			disp = 4;
+		else if (mod == 1)
+			disp = 1;
+		else if (mod == 2)
+			disp = 4;
+	}
+
+	if (disp > end - p)
+		return NULL;
+
+	return p + disp;
+}
+
+/* VEX and EVEX encoded instructions always carry a ModRM byte, except
+ * for vzeroupper/vzeroall, and take an 8-bit immediate in the 0f3a map
+ * and a handful of 0f map opcodes. */
+static int vex_flags(unsigned int map, unsigned char op)
+{
+	switch (map) {
+	case 1:
+		if (op == 0x77)
+			return 0;
+
+		if ((op >= 0x70 && op <= 0x73) || op == 0xc2 || (op >= 0xc4 && op <= 0xc6))
+			return F_MODRM | F_IMM8;
+
+		return F_MODRM;
+	case 2:
+		return F_MODRM;
+	case 3:
+		return F_MODRM | F_IMM8;
+	default:
+		return F_INVALID;
+	}
+}
+
+static int read_rel(const unsigned char *p, unsigned int size)
+{
+	switch (size) {
+	case 1:
+		return (signed char)p[0];
+	case 2:
+		return (short)(p[0] | (p[1] << 8));
+	default:
+		return (int)(p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24));
+	}
+}
+
+unsigned int x86_32_fast_decode(const char *base, unsigned int size, unsigned int offset, struct bina_instruction *bi)
+{
+	const unsigned char *start = (const unsigned char *)base + offset;
+	const unsigned char *p = start, *end;
+	enum bina_instruction_type type = IT_OTHER;
+	unsigned int imm_size = 0, length;
+	unsigned char op, modrm = 0;
+	unsigned int map = 0;
+	int opsize16 = 0, addr16 = 0, relative = 0, flags;
+
+	if (offset >= size)
+		return 0;
+
+	end = start + ((size - offset > MAX_INSN_LENGTH) ? MAX_INSN_LENGTH : size - offset);
+
+	/* Legacy prefixes. */
+	for (;;) {
+		if (p >= end)
+			return 0;
+
+		if (!(one_byte[*p] & F_PREFIX))
+			break;
+
+		if (*p == 0x66)
+			opsize16 = 1;
+		else if (*p == 0x67)
+			addr16 = 1;
+
+		p++;
+	}
+
+	op = *p++;
+	flags = one_byte[op];
+
+	if (op == 0x0f) {
+		if (p >= end)
+			return 0;
+
+		op = *p++;
+		flags = two_byte[op];
+		map = 1;
+
+		if (op == 0x38 || op == 0x3a) {
+			/* Three byte opcodes: skip the final opcode byte. */
+			if (p >= end)
+				return 0;
+
+			p++;
+		} else if (op >= 0x80 && op <= 0x8f) {
+			type = IT_C_BRANCH;
+			relative = 1;
+		}
+	} else if ((op == 0xc4 || op == 0xc5 || op == 0x62) && p < end && *p >= 0xc0) {
+		/* In 32-bit mode these are LES/LDS/BOUND, unless the following
+		 * byte would be a register ModRM, which makes them VEX/EVEX. */
+		unsigned int prefix_size = (op == 0xc5) ? 1 : (op == 0xc4) ? 2 : 3;
+
+		if (prefix_size + 1 > end - p)
+			return 0;
+
+		if (op == 0xc5)
+			map = 1;
+		else if (op == 0xc4)
+			map = p[0] & 0x1f;
+		else
+			map = p[0] & 0x07;
+
+		p += prefix_size;
+		op = *p++;
+		flags = vex_flags(map, op);
+	} else {
+		switch (op) {
+		case 0x70 ... 0x7f:
+		case 0xe0 ... 0xe3:
+			/* jcc, loop and jecxz are all conditional. */
+			type = IT_C_BRANCH;
+			relative = 1;
+			break;
+		case 0xe8:
+			type = IT_CALL;
+			relative = 1;
+			break;
+		case 0xe9:
+		case 0xeb:
+			type = IT_U_BRANCH;
+			relative = 1;
+			break;
+		case 0x9a:
+			type = IT_CALL;
+			break;
+		case 0xea:
+			type = IT_U_BRANCH;
+			break;
+		case 0xc2:
+		case 0xc3:
+		case 0xca:
+		case 0xcb:
+		case 0xcf:
+			type = IT_RETURN;
+			break;
+		case 0x38 ... 0x3d:
+			type = IT_COMPARE;
+			break;
+		}
+	}
+
+	if (flags & F_INVALID)
+		return 0;
+
+	if (flags & F_MODRM) {
+		p = skip_modrm(p, end, addr16, &modrm);
+		if (!p)
+			return 0;
+
+		/* One byte opcode groups selected by the ModRM reg field. */
+		switch (map ? 0 : op) {
+		case 0x80 ... 0x83:
+			if (((modrm >> 3) & 7) == 7)
+				type = IT_COMPARE;
+			break;
+		case 0xf6:
+			if (((modrm >> 3) & 7) < 2)
+				flags |= F_IMM8;
+			break;
+		case 0xf7:
+			if (((modrm >> 3) & 7) < 2)
+				flags |= F_IMMZ;
+			break;
+		case 0xff:
+			switch ((modrm >> 3) & 7) {
+			case 2:
+			case 3:
+				type = IT_CALL;
+				break;
+			case 4:
+			case 5:
+				type = IT_U_BRANCH;
+				break;
+			}
+			break;
+		}
+	}
+
+	if (flags & F_IMM16)
+		imm_size += 2;
+	if (flags & F_IMMZ)
+		imm_size += opsize16 ? 2 : 4;
+	if (flags & F_MOFFS)
+		imm_size += addr16 ? 2 : 4;
+	if (flags & F_IMM8)
+		imm_size += 1;
+
+	if (imm_size > end - p)
+		return 0;
+
+	length = (p - start) + imm_size;
+
+	bi->size = length;
+	bi->type = type;
+	bi->branch_target_offset = -1;
+
+	/* A relative branch displacement is always the last immediate. */
+	if (relative) {
+		unsigned int rel_size = (flags & F_IMM8) ? 1 : (opsize16 ? 2 : 4);
+
+		bi->branch_target_offset = offset + length + read_rel(start + length - rel_size, rel_size);
+	}
+
+	return length;
+}
+
+/* Is this ModRM (and what follows it) a table operand: disp32 plus an
+ * index register times four, with no base? */
+static int table_operand(const unsigned char *p, unsigned int *index, unsigned long *address)
+{
+	unsigned char sib = p[1];
+
+	if ((p[0] & 0xc7) != 0x04 || (sib >> 6) != 2 || (sib & 7) != 5 || ((sib >> 3) & 7) == 4)
+		return -1;
+
+	*index = (sib >> 3) & 7;
+	*address = (unsigned int)read_rel(p + 2, 4);
+	return 0;
+}
+
+static struct bina_instruction *adjacent_prev(struct bina_instruction *ins)
+{
+	struct bina_instruction *prev = ins->prev;
+
+	if (!prev || prev->offset + prev->size != ins->offset)
+		return NULL;
+
+	return prev;
+}
+
+/* Recognise the jump tables compilers emit for switch statements:
+ *
+ *	cmp $n, index		cmp $n, index
+ *	ja default		ja default
+ *	jmp *table(,index,4)	mov table(,index,4), reg
+ *				jmp *reg
+ *
+ * A few ordinary instructions may sit between the branch and the table
+ * access, such as a load of the index at -O0, and jae means the bound
+ * is exclusive.  Position independent tables, addressed through a base
+ * register, aren't handled. */
+int x86_32_jump_table(struct bina_instruction *ins, unsigned long *address, unsigned int *nr_entries)
+{
+	const unsigned char *p = (const unsigned char *)ins->base;
+	struct bina_instruction *access, *x;
+	unsigned int index, n, reg, above;
+	int bound;
+
+	if (ins->size == 7 && p[0] == 0xff && ((p[1] >> 3) & 7) == 4) {
+		if (table_operand(p + 1, &index, address))
+			return -1;
+
+		access = ins;
+	} else if (ins->size == 2 && p[0] == 0xff && (p[1] & 0xf8) == 0xe0) {
+		access = adjacent_prev(ins);
+		if (!access || access->size != 7)
+			return -1;
+
+		p = (const unsigned char *)access->base;
+		if (p[0] != 0x8b || ((p[1] >> 3) & 7) != (ins->base[1] & 7) ||
+				table_operand(p + 1, &index, address))
+			return -1;
+	} else {
+		return -1;
+	}
+
+	/* Back over a few instructions to the bounds check. */
+	x = adjacent_prev(access);
+	for (n = 0; x && x->type == IT_OTHER && n < 4; n++)
+		x = adjacent_prev(x);
+
+	if (!x || x->type != IT_C_BRANCH)
+		return -1;
+
+	p = (const unsigned char *)x->base;
+	if (p[0] == 0x0f)
+		p++;
+
+	if (p[0] == 0x77 || p[0] == 0x87)
+		above = 1;
+	else if (p[0] == 0x73 || p[0] == 0x83)
+		above = 0;
+	else
+		return -1;
+
+	x = adjacent_prev(x);
+	if (!x)
+		return -1;
+
+	p = (const unsigned char *)x->base;
+	if (p[0] == 0x83 && x->size >= 3 && ((p[1] >> 3) & 7) == 7) {
+		reg = p[1];
+		bound = (signed char)p[x->size - 1];
+	} else if (p[0] == 0x81 && x->size >= 6 && ((p[1] >> 3) & 7) == 7) {
+		reg = p[1];
+		bound = read_rel(p + x->size - 4, 4);
+	} else if (p[0] == 0x3d && x->size == 5) {
+		reg = 0xc0;
+		bound = read_rel(p + 1, 4);
+	} else {
+		return -1;
+	}
+
+	/* A compare against a register has to be checking the index.  One
+	 * against memory is usually the variable the index is loaded from. */
+	if ((reg >> 6) == 3 && (reg & 7) != index)
+		return -1;
+
+	if (bound < 0)
+		return -1;
+
+	*nr_entries = bound + above;
+	return 0;
+}
+
+static unsigned int put_rel32(unsigned char *code, unsigned long from, unsigned long target)
+{
+	unsigned int rel = (unsigned int)(target - from - 4);
+
+	code[0] = rel;
+	code[1] = rel >> 8;
+	code[2] = rel >> 16;
+	code[3] = rel >> 24;
+	return 4;
+}
+
+/* Copy an instruction to run at to, followed by a jump back to the one
+ * after it.  Relative branches are re-aimed, with a short jcc widened
+ * to the near form, and a call pushes its real return address and
+ * jumps, with an indirect one keeping its operand.  That operand can't
+ * be esp-based, since the push moves esp.  Far calls would push the
+ * copy's address, and loop and jecxz have no near form, so those, and
+ * branches with prefixes, can't be moved. */
+int x86_32_displace(struct bina_instruction *ins, unsigned long from, unsigned long to, unsigned char *code)
+{
+	const unsigned char *p = (const unsigned char *)ins->base;
+	unsigned long next = from + ins->size;
+	unsigned int n = 0, k;
+
+	if (p[0] >= 0x70 && p[0] <= 0x7f) {
+		code[n++] = 0x0f;
+		code[n++] = 0x80 | (p[0] & 0x0f);
+		n += put_rel32(code + n, to + n, next + read_rel(p + 1, 1));
+	} else if (p[0] == 0x0f && p[1] >= 0x80 && p[1] <= 0x8f) {
+		code[n++] = 0x0f;
+		code[n++] = p[1];
+		n += put_rel32(code + n, to + n, next + read_rel(p + 2, 4));
+	} else if (p[0] == 0xeb || p[0] == 0xe9) {
+		code[n++] = 0xe9;
+		return n + put_rel32(code + n, to + n, next + read_rel(p + 1, p[0] == 0xeb ? 1 : 4));
+	} else if (p[0] == 0xe8) {
+		code[n++] = 0x68;
+		code[n++] = next;
+		code[n++] = next >> 8;
+		code[n++] = next >> 16;
+		code[n++] = next >> 24;
+		code[n++] = 0xe9;
+		return n + put_rel32(code + n, to + n, next + read_rel(p + 1, 4));
+	} else if (p[0] == 0xff && ((p[1] >> 3) & 7) == 2) {
+		if ((p[1] & 7) == 4 && ((p[1] >> 6) == 3 || (p[2] & 7) == 4))
+			return -1;
+
+		code[n++] = 0x68;
+		code[n++] = next;
+		code[n++] = next >> 8;
+		code[n++] = next >> 16;
+		code[n++] = next >> 24;
+		code[n++] = 0xff;
+		code[n++] = (p[1] & ~0x38) | (4 << 3);
+		for (k = 2; k < ins->size; k++)
+			code[n++] = p[k];
+
+		return n;
+	} else if ((p[0] >= 0xe0 && p[0] <= 0xe3) || ins->type == IT_CALL || ins->type == IT_C_BRANCH ||
+			(ins->type == IT_U_BRANCH && p[0] != 0xff)) {
+		return -1;
+	} else {
+		for (k = 0; k < ins->size; k++)
+			code[n++] = p[k];
+	}
+
+	code[n++] = 0xe9;
+	n += put_rel32(code + n, to + n, next);
+
+	return n;
+}
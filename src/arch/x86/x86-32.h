@@ -0,0 +1,11 @@
+#ifndef __BINA_X86_32_H__
+#define __BINA_X86_32_H__
+
+#include <bina.h>
+
+/* The hooks fast-32.c provides for x86_32_arch in disasm-32.c. */
+extern unsigned int x86_32_fast_decode(const char *base, unsigned int size, unsigned int offset, struct bina_instruction *bi);
+extern int x86_32_jump_table(struct bina_instruction *ins, unsigned long *address, unsigned int *nr_entries);
+extern int x86_32_displace(struct bina_instruction *ins, unsigned long from, unsigned long to, unsigned char *code);
+
+#endif
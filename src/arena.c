@@ -0,0 +1,105 @@
+#include <bina.h>
+#include <malloc.h>
+#include <string.h>
+
+#define ARENA_MIN_CHUNK		(64 * 1024)
+#define ARENA_MAX_CHUNK		(64 * 1024 * 1024)
+#define ARENA_ALIGN			16
+
+struct bina_arena_chunk {
+	struct bina_arena_chunk *prev;
+	size_t size;
+	size_t used;
+	char data[] __attribute__((aligned(ARENA_ALIGN)));
+};
+
+static struct bina_arena_chunk *new_chunk(struct bina_arena *arena, size_t size)
+{
+	struct bina_arena_chunk *chunk;
+	size_t chunk_size = ARENA_MIN_CHUNK;
+
+	/* Grow chunks geometrically, so a context needs only a handful of
+	 * them however big it gets. */
+	if (arena->chunks) {
+		chunk_size = arena->chunks->size * 2;
+		if (chunk_size > ARENA_MAX_CHUNK)
+			chunk_size = ARENA_MAX_CHUNK;
+	}
+
+	if (chunk_size < size)
+		chunk_size = size;
+
+	chunk = malloc(sizeof(*chunk) + chunk_size);
+	if (!chunk)
+		return NULL;
+
+	chunk->size = chunk_size;
+	chunk->used = 0;
+	chunk->prev = arena->chunks;
+	arena->chunks = chunk;
+
+	return chunk;
+}
+
+void *bina_arena_alloc(struct bina_arena *arena, size_t nr, size_t size)
+{
+	struct bina_arena_chunk *chunk = arena->chunks;
+	size_t bytes;
+	void *p;
+
+	if (size && nr > (size_t)-1 / size)
+		return NULL;
+
+	bytes = (nr * size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+	if (!chunk || chunk->size - chunk->used < bytes) {
+		chunk = new_chunk(arena, bytes);
+		if (!chunk)
+			return NULL;
+	}
+
+	p = chunk->data + chunk->used;
+	chunk->used += bytes;
+
+	/* Chunks are reused after a reset, so always hand out zeroed
+	 * memory, the same as calloc. */
+	memset(p, 0, bytes);
+	return p;
+}
+
+void bina_arena_reset(struct bina_arena *arena)
+{
+	struct bina_arena_chunk *chunk, *prev, *keep = NULL;
+
+	/* Keep the largest chunk around for the next round of allocations,
+	 * and give everything else back. */
+	for (chunk = arena->chunks; chunk; chunk = prev) {
+		prev = chunk->prev;
+
+		if (!keep || chunk->size > keep->size) {
+			free(keep);
+			keep = chunk;
+		} else {
+			free(chunk);
+		}
+	}
+
+	if (keep) {
+		keep->prev = NULL;
+		keep->used = 0;
+	}
+
+	arena->chunks = keep;
+}
+
+void bina_arena_destroy(struct bina_arena *arena)
+{
+	struct bina_arena_chunk *chunk, *prev;
+
+	for (chunk = arena->chunks; chunk; chunk = prev) {
+		prev = chunk->prev;
+		free(chunk);
+	}
+
+	arena->chunks = NULL;
+}
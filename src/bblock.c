@@ -1,6 +1,25 @@
 #include <bina.h>
 #include <malloc.h>
 
+static int mark_table_leaders(struct bina_context *ctx, struct bina_jump_table *table)
+{
+	unsigned int n;
+	int nr = 0;
+	
+	for (n = 0; n < table->nr_targets; n++) {
+		struct bina_instruction *target = bina_instruction_at(ctx, table->targets[n]);
+		
+		if (!target->basic_block_leader) {
+			target->basic_block_leader = 1;
+			if (ctx->compact)
+				ctx->compact->instructions[target->index].basic_block_leader = 1;
+			nr++;
+		}
+	}
+	
+	return nr;
+}
+
 static int mark_leaders(struct bina_context *ctx)
 {
 	int i, bblock_index;
@@ -10,9 +29,18 @@ static int mark_leaders(struct bina_context *ctx)
 	bblock_index = 1;
 	
 	/* Find jump/call sites and instructions. */
-	for (i = 1; i < ctx->nr_instructions; i++) {
+	for (i = 0; i < ctx->nr_instructions; i++) {
 		struct bina_instruction *ins = &ctx->instructions[i];
 		struct bina_instruction *callsite;
+		
+		/* An instruction that doesn't follow on from the one before it,
+		 * because the bytes in between were never decoded, starts a
+		 * basic block. */
+		if (ins->prev && ins->prev->offset + ins->prev->size != ins->offset &&
+				!ins->basic_block_leader) {
+			ins->basic_block_leader = 1;
+			bblock_index++;
+		}
 				
 		switch(ins->type) {
 		case IT_CALL:
@@ -28,6 +56,10 @@ static int mark_leaders(struct bina_context *ctx)
 				}
 			}
 			
+			/* So is every target in a jump table. */
+			if (ins->jump_table)
+				bblock_index += mark_table_leaders(ctx, ins->jump_table);
+			
 			/* The instruction after a branch is the leader of a basic block. */
 			if (ins->next && !ins->next->basic_block_leader) {
 				ins->next->basic_block_leader = 1;
@@ -51,54 +83,197 @@ static int mark_leaders(struct bina_context *ctx)
 	return bblock_index;
 }
 
-static void add_block_linkage(struct bina_basic_block *parent, struct bina_basic_block *linkage)
+static int set_compact_leader(struct bina_context *ctx, unsigned int index)
 {
-	parent->successors[parent->nr_successors] = linkage;
-	parent->nr_successors++;
+	struct bina_hot_instruction *hot = &ctx->compact->instructions[index];
+	
+	if (hot->basic_block_leader)
+		return 0;
 	
-	linkage->predecessors[linkage->nr_predecessors] = parent;
-	linkage->nr_predecessors++;
+	hot->basic_block_leader = 1;
+	ctx->instructions[index].basic_block_leader = 1;
+	return 1;
 }
 
-static void create_block_graph(struct bina_context *ctx)
+/* The same as mark_leaders(), but walking the dense hot array.  Only the
+ * branches and the leaders they create touch the full instructions. */
+static int mark_leaders_compact(struct bina_context *ctx)
 {
-	int i, n;
-
-	for (i = 0; i < ctx->nr_instructions; i++) {
-		struct bina_instruction *ins = &ctx->instructions[i];
+	struct bina_compact *c = ctx->compact;
+	unsigned int i;
+	int bblock_index;
+	
+	/* First instruction is a leader. */
+	set_compact_leader(ctx, 0);
+	bblock_index = 1;
+	
+	bina_for_each_hot_instruction(c, i) {
+		struct bina_hot_instruction *hot = &c->instructions[i];
+		
+		/* Undecoded bytes before this instruction start a basic block. */
+		if (i > 0 && hot[-1].offset + hot[-1].size != hot->offset)
+			bblock_index += set_compact_leader(ctx, i);
 		
-		/* If instruction has a jump target, then it must be a jump instruction. */
-		if (ins->branch_target) {
-			/* The target of this jump is a successive block. */
-			add_block_linkage(ins->basic_block, ins->branch_target->basic_block);
+		switch(hot->type) {
+		case IT_CALL:
+		case IT_U_BRANCH:
+		case IT_C_BRANCH:
+			/* The call site of a branch is the leader of a basic block. */
+			if (hot->branch_target != BINA_NO_INDEX) {
+				ctx->instructions[i].branch_target = &ctx->instructions[hot->branch_target];
+				bblock_index += set_compact_leader(ctx, hot->branch_target);
+			} else if (ctx->instructions[i].jump_table) {
+				bblock_index += mark_table_leaders(ctx, ctx->instructions[i].jump_table);
+			}
 			
-			/* If this jump is conditional, then a successive block
-			 * is the next block. */
-			 if (ins->type == IT_C_BRANCH) {
-				add_block_linkage(ins->basic_block, ins->basic_block->next);
-			 }
-		} else {
-			/* If it's not a jump target, then we need to see if it's at the
-			 * end of a bblock.  If it is, then that bblock's successor is
-			 * the following bblock.  Unless it's a ret. */
-			 if (ins->type == IT_RETURN)
-				continue;
-				
-			 for (n = 0; n < ctx->nr_basic_blocks; n++) {
-				 struct bina_basic_block *block = &ctx->blocks[n];
-				 struct bina_instruction *last = &block->instructions[block->nr_instructions - 1];
-				 
-				 /* It /is/ the last! */
-				 if (ins == last) {
-					/* Check to see if it's actually the end of the code. */
-					if (ins->basic_block->index + 1 >= ctx->nr_basic_blocks)
-						continue;
+			/* The instruction after a branch is the leader of a basic block. */
+			if (i + 1 < c->nr_instructions)
+				bblock_index += set_compact_leader(ctx, i + 1);
+			
+			break;
+		case IT_RETURN:
+			/* The instruction after a return is the leader of basic block. */
+			if (i + 1 < c->nr_instructions)
+				bblock_index += set_compact_leader(ctx, i + 1);
+			
+			break;
+		default:
+			continue;
+		}
+	}
+	
+	return bblock_index;
+}
 
-					add_block_linkage(ins->basic_block, ins->basic_block->next);
-				}
-			}
+/* Besides a jump table's targets, there can only ever be at most two
+ * successors: a branch target and the fallthrough block. */
+#define MAX_BLOCK_EDGES		2
+
+/* The most edges any one block can have, for sizing bina_block_edges()'s
+ * arrays. */
+unsigned int bina_max_block_edges(struct bina_context *ctx)
+{
+	unsigned int i, max_edges = MAX_BLOCK_EDGES;
+	
+	for (i = 0; i < ctx->nr_jump_tables; i++) {
+		if (ctx->jump_tables[i].nr_targets + MAX_BLOCK_EDGES > max_edges)
+			max_edges = ctx->jump_tables[i].nr_targets + MAX_BLOCK_EDGES;
+	}
+	
+	return max_edges;
+}
+
+unsigned int bina_block_edges(struct bina_basic_block *block, struct bina_basic_block **targets, unsigned char *kinds)
+{
+	struct bina_instruction *last = &block->instructions[block->nr_instructions - 1];
+	struct bina_context *ctx = last->context;
+	unsigned int nr = 0, n;
+	
+	/* The target of a jump or call is a successive block. */
+	if (last->branch_target) {
+		targets[nr] = last->branch_target->basic_block;
+		kinds[nr] = (last->type == IT_CALL) ? EK_CALL : EK_TAKEN;
+		nr++;
+	}
+	
+	if (last->jump_table) {
+		for (n = 0; n < last->jump_table->nr_targets; n++) {
+			targets[nr] = bina_instruction_at(ctx, last->jump_table->targets[n])->basic_block;
+			kinds[nr] = EK_TAKEN;
+			nr++;
+		}
+	}
+	
+	/* Everything except a return or an unconditional jump falls through
+	 * to the next block, unless it's actually the end of the code or the
+	 * next block doesn't start straight after this one. */
+	if (last->type != IT_RETURN && last->type != IT_U_BRANCH && block->next &&
+			block->next->offset == block->offset + block->size) {
+		targets[nr] = block->next;
+		kinds[nr] = EK_FALLTHROUGH;
+		nr++;
+	}
+	
+	return nr;
+}
+
+static int create_block_graph(struct bina_context *ctx)
+{
+	struct bina_basic_block **targets;
+	unsigned char *kinds;
+	unsigned int i, n, nr, succ_pos, pred_pos, max_edges = bina_max_block_edges(ctx);
+	int rc = -1;
+	
+	targets = malloc(max_edges * sizeof(*targets));
+	kinds = malloc(max_edges * sizeof(*kinds));
+	if (!targets || !kinds)
+		goto out;
+	
+	/* Pass one: count the edges leaving and entering every block. */
+	ctx->nr_edges = 0;
+	for (i = 0; i < ctx->nr_basic_blocks; i++) {
+		nr = bina_block_edges(&ctx->blocks[i], targets, kinds);
+		
+		for (n = 0; n < nr; n++) {
+			targets[n]->nr_predecessors++;
+		}
+		
+		ctx->nr_edges += nr;
+	}
+	
+	ctx->successors = bina_arena_alloc(&ctx->block_arena, ctx->nr_edges, sizeof(*ctx->successors));
+	ctx->successor_kinds = bina_arena_alloc(&ctx->block_arena, ctx->nr_edges, sizeof(*ctx->successor_kinds));
+	ctx->predecessors = bina_arena_alloc(&ctx->block_arena, ctx->nr_edges, sizeof(*ctx->predecessors));
+	ctx->predecessor_kinds = bina_arena_alloc(&ctx->block_arena, ctx->nr_edges, sizeof(*ctx->predecessor_kinds));
+	if (ctx->nr_edges && (!ctx->successors || !ctx->successor_kinds ||
+			!ctx->predecessors || !ctx->predecessor_kinds))
+		goto out;
+	
+	ctx->max_edges = ctx->nr_edges;
+	
+	/* Carve each block's slice out of the shared edge arrays.  The
+	 * successor slices are laid out in the same pass that fills them,
+	 * since a block's successors are all discovered together. */
+	pred_pos = 0;
+	for (i = 0; i < ctx->nr_basic_blocks; i++) {
+		struct bina_basic_block *block = &ctx->blocks[i];
+		
+		block->predecessors = &ctx->predecessors[pred_pos];
+		block->predecessor_kinds = &ctx->predecessor_kinds[pred_pos];
+		pred_pos += block->nr_predecessors;
+		block->nr_predecessors = 0;
+	}
+	
+	/* Pass two: fill in both directions of every edge. */
+	succ_pos = 0;
+	for (i = 0; i < ctx->nr_basic_blocks; i++) {
+		struct bina_basic_block *block = &ctx->blocks[i];
+		
+		nr = bina_block_edges(block, targets, kinds);
+		
+		block->successors = &ctx->successors[succ_pos];
+		block->successor_kinds = &ctx->successor_kinds[succ_pos];
+		block->nr_successors = nr;
+		succ_pos += nr;
+		
+		for (n = 0; n < nr; n++) {
+			struct bina_basic_block *target = targets[n];
+			
+			block->successors[n] = target;
+			block->successor_kinds[n] = kinds[n];
+			
+			target->predecessors[target->nr_predecessors] = block;
+			target->predecessor_kinds[target->nr_predecessors] = kinds[n];
+			target->nr_predecessors++;
 		}
 	}
+	
+	rc = 0;
+	
+out:
+	free(targets);
+	free(kinds);
+	return rc;
 }
 
 void create_block_descriptors(struct bina_context *ctx)
@@ -126,11 +301,6 @@ void create_block_descriptors(struct bina_context *ctx)
 			bblock->instructions = ins;
 			bblock->nr_instructions = 0;
 			
-			bblock->predecessors = calloc(ctx->nr_basic_blocks, sizeof(*bblock->predecessors));
-			
-			/* There can only ever be at most two successors. */
-			bblock->successors = calloc(2, sizeof(*bblock->predecessors));
-			
 			block_index++;
 		}
 		
@@ -142,21 +312,66 @@ void create_block_descriptors(struct bina_context *ctx)
 
 int bina_detect_basic_blocks(struct bina_context *ctx)
 {
-	ctx->nr_basic_blocks = mark_leaders(ctx);
+	if (bina_resolve_jump_tables(ctx))
+		return -1;
+	
+	if (ctx->compact)
+		ctx->nr_basic_blocks = mark_leaders_compact(ctx);
+	else
+		ctx->nr_basic_blocks = mark_leaders(ctx);
+	
 	if (ctx->nr_basic_blocks < 0)
 		return ctx->nr_basic_blocks;
 
-	ctx->blocks = calloc(ctx->nr_basic_blocks, sizeof(*ctx->blocks));
+	ctx->blocks = bina_arena_alloc(&ctx->block_arena, ctx->nr_basic_blocks, sizeof(*ctx->blocks));
 	if (!ctx->blocks)
 		return -1;
 	
+	ctx->max_basic_blocks = ctx->nr_basic_blocks;
 	create_block_descriptors(ctx);
-	create_block_graph(ctx);
+	
+	if (create_block_graph(ctx)) {
+		bina_destroy_basic_blocks(ctx);
+		return -1;
+	}
+	
+	if (ctx->compact && bina_compact_sync_blocks(ctx)) {
+		bina_destroy_basic_blocks(ctx);
+		return -1;
+	}
 	
 	return 0;
 }
 
 void bina_destroy_basic_blocks(struct bina_context *ctx)
 {
-	free(ctx->blocks);
+	unsigned int i;
+	
+	/* Forget the leaders, so the blocks can be detected again. */
+	for (i = 0; i < ctx->nr_instructions; i++) {
+		ctx->instructions[i].basic_block_leader = 0;
+		ctx->instructions[i].basic_block = NULL;
+		
+		if (ctx->compact)
+			ctx->compact->instructions[i].basic_block_leader = 0;
+	}
+	
+	/* Everything hanging off the blocks goes in one go. */
+	bina_arena_reset(&ctx->block_arena);
+	
+	ctx->successors = NULL;
+	ctx->successor_kinds = NULL;
+	ctx->predecessors = NULL;
+	ctx->predecessor_kinds = NULL;
+	ctx->nr_edges = 0;
+	ctx->max_edges = 0;
+	
+	ctx->blocks = NULL;
+	ctx->nr_basic_blocks = 0;
+	ctx->max_basic_blocks = 0;
+	ctx->loops = NULL;
+	bina_arena_reset(&ctx->loop_arena);
+	
+	if (ctx->compact)
+		bina_compact_sync_blocks(ctx);
 }
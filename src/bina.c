@@ -1,7 +1,159 @@
 #include <bina.h>
 #include <malloc.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
 
-struct bina_context *bina_create(const struct bina_arch *arch, char *base, unsigned int size)
+struct bina_instruction *bina_new_instruction(struct bina_context *ctx)
+{
+	struct bina_instruction *ins;
+	
+	if (ctx->nr_instructions == ctx->max_instructions) {
+		unsigned int capacity;
+		
+		/* x86 instructions average three to four bytes, so start from
+		 * a quarter of the section and double when that runs out. */
+		if (ctx->max_instructions)
+			capacity = ctx->max_instructions * 2;
+		else
+			capacity = ctx->size / 4 + 16;
+		
+		ins = realloc(ctx->instructions, capacity * sizeof(*ins));
+		if (!ins)
+			return NULL;
+		
+		ctx->instructions = ins;
+		ctx->max_instructions = capacity;
+	}
+	
+	ins = &ctx->instructions[ctx->nr_instructions];
+	memset(ins, 0, sizeof(*ins));
+	
+	ins->index = ctx->nr_instructions;
+	ins->context = ctx;
+	
+	ctx->nr_instructions++;
+	return ins;
+}
+
+void bina_finish_instructions(struct bina_context *ctx)
+{
+	struct bina_instruction *shrunk;
+	unsigned int i;
+	
+	/* Give back the unused tail of the array.  Pointers into the array
+	 * are only handed out from here on, so they stay valid. */
+	if (ctx->nr_instructions && ctx->nr_instructions < ctx->max_instructions) {
+		shrunk = realloc(ctx->instructions, ctx->nr_instructions * sizeof(*shrunk));
+		if (shrunk) {
+			ctx->instructions = shrunk;
+			ctx->max_instructions = ctx->nr_instructions;
+		}
+	}
+	
+	for (i = 0; i < ctx->nr_instructions; i++) {
+		struct bina_instruction *ins = &ctx->instructions[i];
+		unsigned int n;
+		
+		ins->next = (i + 1 < ctx->nr_instructions) ? &ctx->instructions[i + 1] : NULL;
+		ins->prev = (i > 0) ? &ctx->instructions[i - 1] : NULL;
+		
+		for (n = 0; n < ins->nr_operands; n++) {
+			ins->operands[n].ins = ins;
+		}
+	}
+}
+
+int bina_build_offset_index(struct bina_context *ctx)
+{
+	unsigned int i, n;
+
+	/* Rebuilding an existing index reuses it. */
+	if (ctx->offset_index) {
+		memset(ctx->offset_index, 0, ctx->size * sizeof(*ctx->offset_index));
+	} else {
+		ctx->offset_index = bina_arena_alloc(&ctx->arena, ctx->size, sizeof(*ctx->offset_index));
+		if (!ctx->offset_index && ctx->size)
+			return -1;
+	}
+
+	/* Every byte of an instruction maps back to that instruction, so
+	 * lookups of addresses in the middle of an instruction work too. */
+	for (i = 0; i < ctx->nr_instructions; i++) {
+		struct bina_instruction *ins = &ctx->instructions[i];
+
+		for (n = 0; n < ins->size && ins->offset + n < ctx->size; n++) {
+			ctx->offset_index[ins->offset + n] = i + 1;
+		}
+	}
+
+	return 0;
+}
+
+int bina_linear_sweep(struct bina_context *ctx)
+{
+	const struct bina_arch *arch = ctx->arch;
+	unsigned int offset = 0;
+	
+	while (offset < ctx->size) {
+		struct bina_instruction decoded, *ins;
+		unsigned int length;
+		
+		length = arch->decode_instruction(ctx->base, ctx->size, offset, &decoded);
+		if (!length) {
+			offset++;
+			continue;
+		}
+		
+		ins = bina_new_instruction(ctx);
+		if (!ins)
+			return -1;
+		
+		ins->offset = offset;
+		ins->base = ctx->base + offset;
+		ins->size = length;
+		ins->type = decoded.type;
+		ins->branch_target_offset = decoded.branch_target_offset;
+		
+		offset += length;
+	}
+	
+	bina_finish_instructions(ctx);
+	return 0;
+}
+
+/* Record entry point offsets: function seeds, and where a recursive
+ * descent starts. */
+int bina_set_entries(struct bina_context *ctx, const unsigned int *entries, unsigned int nr_entries)
+{
+	if (!nr_entries)
+		return 0;
+	
+	ctx->entries = bina_arena_alloc(&ctx->arena, nr_entries, sizeof(*ctx->entries));
+	if (!ctx->entries)
+		return -1;
+	
+	memcpy(ctx->entries, entries, nr_entries * sizeof(*ctx->entries));
+	ctx->nr_entries = nr_entries;
+	return 0;
+}
+
+/* The flags a context really runs with, given the ones asked for. */
+unsigned int bina_context_flags(unsigned int flags)
+{
+	/* Only the fast decoder is safe to run on several threads, and it
+	 * never produces operands up front.  The work list also needs its
+	 * branch targets without going through libdisasm. */
+	if (flags & (BINA_PARALLEL | BINA_RECURSIVE))
+		flags |= BINA_FAST_DECODE;
+	
+	if (flags & BINA_FAST_DECODE)
+		flags |= BINA_LAZY_OPERANDS;
+	
+	return flags;
+}
+
+static struct bina_context *create_context(const struct bina_arch *arch, char *base, unsigned int size, unsigned int flags, const unsigned int *entries, unsigned int nr_entries)
 {
 	struct bina_context *ctx;
 	int rc;
@@ -22,41 +174,305 @@ struct bina_context *bina_create(const struct bina_arch *arch, char *base, unsig
 	ctx->base = base;
 	ctx->size = size;
 	ctx->arch = arch;
+	ctx->flags = bina_context_flags(flags);
+	
+	pthread_mutex_init(&ctx->lock, NULL);
+	
+	rc = bina_set_entries(ctx, entries, nr_entries);
+	if (!rc)
+		rc = arch->disassemble(ctx);
 	
-	rc = arch->disassemble(ctx);
 	if (rc) {
+		pthread_mutex_destroy(&ctx->lock);
+		bina_arena_destroy(&ctx->arena);
 		free(ctx);
 		return NULL;
 	}
 
+	rc = bina_build_offset_index(ctx);
+	if (rc) {
+		bina_destroy(ctx);
+		return NULL;
+	}
+
 	return ctx;
 }
 
+struct bina_context *bina_create(const struct bina_arch *arch, char *base, unsigned int size)
+{
+	return bina_create_flags(arch, base, size, 0);
+}
+
+struct bina_context *bina_create_flags(const struct bina_arch *arch, char *base, unsigned int size, unsigned int flags)
+{
+	return create_context(arch, base, size, flags, NULL, 0);
+}
+
+/* Decode only what's reachable from the given entry offsets, following
+ * branch targets and fallthroughs.  With no entries, decoding starts at
+ * the beginning of the buffer. */
+struct bina_context *bina_create_recursive(const struct bina_arch *arch, char *base, unsigned int size, unsigned int flags, const unsigned int *entries, unsigned int nr_entries)
+{
+	return create_context(arch, base, size, flags | BINA_RECURSIVE, entries, nr_entries);
+}
+
 void bina_destroy(struct bina_context *ctx)
 {
 	if (ctx->blocks)
 		bina_destroy_basic_blocks(ctx);
 
-	if (ctx->arch->destroy)
+	bina_destroy_compact(ctx);
+
+	/* A context loaded from a cache never went through the architecture,
+	 * so there's nothing of its to release. */
+	if (ctx->cache) {
+		free(ctx->instructions);
+		munmap(ctx->cache, ctx->cache_size);
+	} else if (ctx->arch->destroy) {
 		ctx->arch->destroy(ctx);
+	}
 		
+	free(ctx->text);
+	free(ctx->text_offsets);
+	free(ctx->branch_refs);
+	
+	bina_arena_destroy(&ctx->function_arena);
+	bina_arena_destroy(&ctx->loop_arena);
+	bina_arena_destroy(&ctx->jump_table_arena);
+	bina_arena_destroy(&ctx->compact_arena);
+	bina_arena_destroy(&ctx->block_arena);
+	bina_arena_destroy(&ctx->arena);
+	pthread_mutex_destroy(&ctx->lock);
 	free(ctx);
 }
 
+struct bina_instruction *bina_instruction_covering(struct bina_context *ctx, unsigned int offset)
+{
+	unsigned int index;
+
+	if (offset >= ctx->size)
+		return NULL;
+
+	index = ctx->offset_index[offset];
+	if (!index)
+		return NULL;
+
+	return &ctx->instructions[index - 1];
+}
+
 struct bina_instruction *bina_instruction_at(struct bina_context *ctx, unsigned int offset)
 {
-	int i;
+	struct bina_instruction *ins = bina_instruction_covering(ctx, offset);
+
+	/* Only exact instruction boundaries count. */
+	if (ins && ins->offset == offset)
+		return ins;
+
+	return NULL;
+}
+
+struct bina_basic_block *bina_block_at(struct bina_context *ctx, unsigned int offset)
+{
+	struct bina_instruction *ins;
+
+	if (!ctx->blocks)
+		return NULL;
+
+	ins = bina_instruction_covering(ctx, offset);
+	if (!ins)
+		return NULL;
+
+	return ins->basic_block;
+}
+
+unsigned int bina_lookup_instructions(struct bina_context *ctx, unsigned long load_base, const unsigned long *addrs, unsigned int count, struct bina_instruction **out)
+{
+	unsigned int i, found = 0;
+
+	for (i = 0; i < count; i++) {
+		/* Addresses below the load base wrap around, and are rejected
+		 * by the bounds check in the lookup. */
+		unsigned long offset = addrs[i] - load_base;
+
+		if (offset < ctx->size)
+			out[i] = bina_instruction_at(ctx, (unsigned int)offset);
+		else
+			out[i] = NULL;
+
+		if (out[i])
+			found++;
+	}
+
+	return found;
+}
+
+unsigned int bina_lookup_blocks(struct bina_context *ctx, unsigned long load_base, const unsigned long *addrs, unsigned int count, struct bina_basic_block **out)
+{
+	unsigned int i, found = 0;
+
+	for (i = 0; i < count; i++) {
+		unsigned long offset = addrs[i] - load_base;
+
+		if (offset < ctx->size)
+			out[i] = bina_block_at(ctx, (unsigned int)offset);
+		else
+			out[i] = NULL;
+
+		if (out[i])
+			found++;
+	}
+
+	return found;
+}
+
+#define NR_FREE_OPERAND_LISTS(ctx)	(sizeof((ctx)->free_operands) / sizeof(*(ctx)->free_operands))
+
+/* Operands come out of the context arena, or off the free list if a patch
+ * has given back an array of the same length.  Called with the context
+ * lock held, as decode_operands is. */
+struct bina_operand *bina_alloc_operands(struct bina_context *ctx, unsigned int nr)
+{
+	struct bina_operand *operands;
+	
+	if (nr < NR_FREE_OPERAND_LISTS(ctx) && ctx->free_operands[nr]) {
+		operands = ctx->free_operands[nr];
+		ctx->free_operands[nr] = *(struct bina_operand **)operands;
+		memset(operands, 0, nr * sizeof(*operands));
+		return operands;
+	}
+	
+	return bina_arena_alloc(&ctx->arena, nr, sizeof(*operands));
+}
+
+/* Give back the operands of an instruction that's being replaced.  Ones
+ * too long to keep a list for stay in the arena. */
+void bina_free_operands(struct bina_context *ctx, struct bina_operand *operands, unsigned int nr)
+{
+	if (!operands || !nr || nr >= NR_FREE_OPERAND_LISTS(ctx))
+		return;
 	
+	*(struct bina_operand **)operands = ctx->free_operands[nr];
+	ctx->free_operands[nr] = operands;
+}
+
+int bina_decode_operands(struct bina_instruction *ins)
+{
+	const struct bina_arch *arch = ins->context->arch;
+	int rc;
+	
+	if (__atomic_load_n(&ins->operands_decoded, __ATOMIC_ACQUIRE))
+		return 0;
+	
+	if (!arch->decode_operands)
+		return -1;
+	
+	/* Operands come out of the context arena, and the same instruction
+	 * may be asked for from more than one thread. */
+	pthread_mutex_lock(&ins->context->lock);
+	
+	rc = 0;
+	if (!ins->operands_decoded) {
+		rc = arch->decode_operands(ins);
+		if (!rc)
+			__atomic_store_n(&ins->operands_decoded, 1, __ATOMIC_RELEASE);
+	}
+	
+	pthread_mutex_unlock(&ins->context->lock);
+	return rc;
+}
+
+int bina_decode_block_operands(struct bina_basic_block *block)
+{
+	unsigned int i;
+	int rc;
+	
+	for (i = 0; i < block->nr_instructions; i++) {
+		rc = bina_decode_operands(&block->instructions[i]);
+		if (rc)
+			return rc;
+	}
+	
+	return 0;
+}
+
+int bina_format_instruction(struct bina_instruction *ins, char *buffer, unsigned int size)
+{
+	return ins->context->arch->format_instruction(ins, buffer, size);
+}
+
+const char *bina_instruction_text(struct bina_instruction *ins)
+{
+	struct bina_context *ctx = ins->context;
+	
+	if (!ctx->text)
+		return NULL;
+	
+	return ctx->text + ctx->text_offsets[ins->index];
+}
+
+int bina_render_instructions(struct bina_context *ctx)
+{
+	unsigned int i, used, capacity;
+	char *text;
+	
+	if (ctx->text)
+		return 0;
+	
+	ctx->text_offsets = calloc(ctx->nr_instructions, sizeof(*ctx->text_offsets));
+	if (!ctx->text_offsets && ctx->nr_instructions)
+		return -1;
+	
+	/* Start with a guess at the average line length, and grow the
+	 * arena geometrically from there. */
+	capacity = 32 * ctx->nr_instructions + MAX_INSTRUCTION_TEXT;
+	text = malloc(capacity);
+	if (!text)
+		goto fail;
+	
+	used = 0;
 	for (i = 0; i < ctx->nr_instructions; i++) {
-		if (ctx->instructions[i].offset == offset) {
-			return &ctx->instructions[i];
+		if (capacity - used < MAX_INSTRUCTION_TEXT) {
+			char *grown = realloc(text, capacity * 2);
+			
+			if (!grown)
+				goto fail;
+			
+			text = grown;
+			capacity *= 2;
 		}
+		
+		if (bina_format_instruction(&ctx->instructions[i], text + used, MAX_INSTRUCTION_TEXT) < 0)
+			text[used] = 0;
+		
+		ctx->text_offsets[i] = used;
+		used += strlen(text + used) + 1;
 	}
 	
-	return NULL;
+	/* Give back what we over-allocated. */
+	ctx->text = used ? realloc(text, used) : NULL;
+	if (!ctx->text)
+		ctx->text = text;
+	
+	return 0;
+	
+fail:
+	free(text);
+	free(ctx->text_offsets);
+	ctx->text_offsets = NULL;
+	return -1;
 }
 
 void bina_print_instruction(struct bina_instruction *ins)
 {
-	ins->context->arch->print_instruction(ins);
+	char line[MAX_INSTRUCTION_TEXT];
+	const char *text = bina_instruction_text(ins);
+	
+	if (!text) {
+		if (bina_format_instruction(ins, line, sizeof(line)) < 0)
+			return;
+		
+		text = line;
+	}
+	
+	printf("%s", text);
 }
@@ -0,0 +1,666 @@
+#include <bina.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* On-disk analysis cache.  The file is a header followed by flat tables
+ * that refer to each other only by index, so it can be mapped anywhere.
+ * The hot instruction and block tables use the compact view's layout,
+ * which lets a loaded context use the mapping as its compact view
+ * directly.  Files are native-endian, and the header records the table
+ * entry sizes so a file from a different layout is simply rejected. */
+
+#define CACHE_MAGIC		"BINACACH"
+#define CACHE_VERSION		3
+
+/* Tables start on this boundary within the file. */
+#define CACHE_ALIGN		16
+
+struct cache_header {
+	char magic[8];
+	unsigned int version;
+	unsigned int flags;
+	unsigned long long hash;
+	unsigned int size;
+
+	unsigned int instruction_size;
+	unsigned int block_size;
+	unsigned int loop_size;
+	unsigned int trip_count_size;
+
+	unsigned int nr_instructions;
+	unsigned int nr_blocks;
+	unsigned int nr_edges;
+	unsigned int nr_entries;
+
+	/* The loop forest, if one was saved, and its trip counts if those
+	 * had been estimated too. */
+	unsigned int has_loops;
+	unsigned int nr_loops;
+	unsigned int nr_loop_blocks;
+	unsigned int nr_exits;
+	unsigned int nr_back_edges;
+	unsigned int nr_irreducible_edges;
+	unsigned int nr_trip_counts;
+
+	/* File offsets of each table. */
+	unsigned int instructions;
+	unsigned int target_offsets;
+	unsigned int blocks;
+	unsigned int successors;
+	unsigned int predecessors;
+	unsigned int successor_kinds;
+	unsigned int predecessor_kinds;
+	unsigned int entries;
+	unsigned int dominators;
+	unsigned int block_loops;
+	unsigned int loops;
+	unsigned int loop_blocks;
+	unsigned int exits;
+	unsigned int back_edges;
+	unsigned int irreducible_edges;
+	unsigned int trip_counts;
+};
+
+/* A quick 64-bit hash of the input bytes, eight at a time.  This only
+ * has to tell one build of a binary from another, not resist attack. */
+static unsigned long long content_hash(const char *base, unsigned int size)
+{
+	unsigned long long hash = 0xcbf29ce484222325ULL ^ size, word;
+	unsigned int i;
+
+	for (i = 0; i + sizeof(word) <= size; i += sizeof(word)) {
+		memcpy(&word, base + i, sizeof(word));
+		hash = (hash ^ word) * 0x100000001b3ULL;
+		hash ^= hash >> 29;
+	}
+
+	for (; i < size; i++) {
+		hash = (hash ^ (unsigned char)base[i]) * 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+static unsigned int place_table(unsigned int *end, unsigned int nr, unsigned int size)
+{
+	unsigned int offset = (*end + CACHE_ALIGN - 1) & ~(CACHE_ALIGN - 1);
+
+	*end = offset + nr * size;
+	return offset;
+}
+
+/* The forest's block, exit and back edge tables are shared by all its
+ * loops, so their lengths are where the last slices end. */
+static void count_forest(struct cache_header *hdr, struct bina_loop_forest *forest)
+{
+	unsigned int l;
+
+	hdr->has_loops = 1;
+	hdr->nr_loops = forest->nr_loops;
+	hdr->nr_irreducible_edges = forest->nr_irreducible_edges;
+	hdr->nr_trip_counts = forest->trip_counts ? forest->nr_loops : 0;
+
+	for (l = 0; l < forest->nr_loops; l++) {
+		struct bina_loop *loop = &forest->loops[l];
+
+		if (loop->first_block + loop->nr_blocks > hdr->nr_loop_blocks)
+			hdr->nr_loop_blocks = loop->first_block + loop->nr_blocks;
+		if (loop->first_exit + loop->nr_exits > hdr->nr_exits)
+			hdr->nr_exits = loop->first_exit + loop->nr_exits;
+		if (loop->first_back_edge + loop->nr_back_edges > hdr->nr_back_edges)
+			hdr->nr_back_edges = loop->first_back_edge + loop->nr_back_edges;
+	}
+}
+
+static void layout(struct cache_header *hdr, struct bina_context *ctx, unsigned int *file_size)
+{
+	unsigned int end = sizeof(*hdr);
+
+	memset(hdr, 0, sizeof(*hdr));
+	memcpy(hdr->magic, CACHE_MAGIC, sizeof(hdr->magic));
+	hdr->version = CACHE_VERSION;
+	hdr->flags = ctx->flags;
+	hdr->hash = content_hash(ctx->base, ctx->size);
+	hdr->size = ctx->size;
+	hdr->instruction_size = sizeof(struct bina_hot_instruction);
+	hdr->block_size = sizeof(struct bina_hot_block);
+	hdr->loop_size = sizeof(struct bina_loop);
+	hdr->trip_count_size = sizeof(struct bina_trip_count);
+
+	hdr->nr_instructions = ctx->nr_instructions;
+	hdr->nr_blocks = ctx->blocks ? ctx->nr_basic_blocks : 0;
+	hdr->nr_edges = ctx->blocks ? ctx->nr_edges : 0;
+	hdr->nr_entries = ctx->nr_entries;
+
+	if (ctx->blocks && ctx->loops)
+		count_forest(hdr, ctx->loops);
+
+	hdr->instructions = place_table(&end, hdr->nr_instructions, sizeof(struct bina_hot_instruction));
+	hdr->target_offsets = place_table(&end, hdr->nr_instructions, sizeof(unsigned int));
+	hdr->blocks = place_table(&end, hdr->nr_blocks, sizeof(struct bina_hot_block));
+	hdr->successors = place_table(&end, hdr->nr_edges, sizeof(unsigned int));
+	hdr->predecessors = place_table(&end, hdr->nr_edges, sizeof(unsigned int));
+	hdr->successor_kinds = place_table(&end, hdr->nr_edges, 1);
+	hdr->predecessor_kinds = place_table(&end, hdr->nr_edges, 1);
+	hdr->entries = place_table(&end, hdr->nr_entries, sizeof(unsigned int));
+	hdr->dominators = place_table(&end, hdr->has_loops ? hdr->nr_blocks : 0, sizeof(unsigned int));
+	hdr->block_loops = place_table(&end, hdr->has_loops ? hdr->nr_blocks : 0, sizeof(unsigned int));
+	hdr->loops = place_table(&end, hdr->nr_loops, sizeof(struct bina_loop));
+	hdr->loop_blocks = place_table(&end, hdr->nr_loop_blocks, sizeof(unsigned int));
+	hdr->exits = place_table(&end, hdr->nr_exits, sizeof(struct bina_block_edge));
+	hdr->back_edges = place_table(&end, hdr->nr_back_edges, sizeof(struct bina_block_edge));
+	hdr->irreducible_edges = place_table(&end, hdr->nr_irreducible_edges, sizeof(struct bina_block_edge));
+	hdr->trip_counts = place_table(&end, hdr->nr_trip_counts, sizeof(struct bina_trip_count));
+
+	*file_size = end;
+}
+
+static void copy_table(char *image, unsigned int offset, const void *table, unsigned int nr, unsigned int size)
+{
+	if (nr)
+		memcpy(image + offset, table, (size_t)nr * size);
+}
+
+static void fill_forest(struct cache_header *hdr, struct bina_loop_forest *forest, char *image)
+{
+	copy_table(image, hdr->dominators, forest->dominators, hdr->nr_blocks, sizeof(unsigned int));
+	copy_table(image, hdr->block_loops, forest->block_loops, hdr->nr_blocks, sizeof(unsigned int));
+	copy_table(image, hdr->loops, forest->loops, hdr->nr_loops, sizeof(struct bina_loop));
+	copy_table(image, hdr->loop_blocks, forest->blocks, hdr->nr_loop_blocks, sizeof(unsigned int));
+	copy_table(image, hdr->exits, forest->exits, hdr->nr_exits, sizeof(struct bina_block_edge));
+	copy_table(image, hdr->back_edges, forest->back_edges, hdr->nr_back_edges, sizeof(struct bina_block_edge));
+	copy_table(image, hdr->irreducible_edges, forest->irreducible_edges, hdr->nr_irreducible_edges, sizeof(struct bina_block_edge));
+	copy_table(image, hdr->trip_counts, forest->trip_counts, hdr->nr_trip_counts, sizeof(struct bina_trip_count));
+}
+
+static void fill(struct cache_header *hdr, struct bina_context *ctx, char *image)
+{
+	struct bina_hot_instruction *hot_insns = (void *)(image + hdr->instructions);
+	unsigned int *target_offsets = (void *)(image + hdr->target_offsets);
+	struct bina_hot_block *hot_blocks = (void *)(image + hdr->blocks);
+	unsigned int *successors = (void *)(image + hdr->successors);
+	unsigned int *predecessors = (void *)(image + hdr->predecessors);
+	unsigned int i;
+
+	memcpy(image, hdr, sizeof(*hdr));
+
+	for (i = 0; i < hdr->nr_instructions; i++) {
+		struct bina_instruction *ins = &ctx->instructions[i];
+		struct bina_hot_instruction *hot = &hot_insns[i];
+
+		hot->offset = ins->offset;
+		hot->size = ins->size;
+		hot->type = ins->type;
+		hot->basic_block_leader = hdr->nr_blocks ? ins->basic_block_leader : 0;
+		hot->branch_target = (hdr->nr_blocks && ins->branch_target) ? ins->branch_target->index : BINA_NO_INDEX;
+		hot->basic_block = (hdr->nr_blocks && ins->basic_block) ? ins->basic_block->index : BINA_NO_INDEX;
+
+		/* Operands aren't saved; they decode again on demand. */
+		hot->nr_operands = 0;
+
+		target_offsets[i] = ins->branch_target_offset;
+	}
+
+	for (i = 0; i < hdr->nr_blocks; i++) {
+		struct bina_basic_block *block = &ctx->blocks[i];
+		struct bina_hot_block *hot = &hot_blocks[i];
+
+		hot->offset = block->offset;
+		hot->first_instruction = block->instructions - ctx->instructions;
+		hot->nr_instructions = block->nr_instructions;
+		hot->first_successor = block->successors - ctx->successors;
+		hot->nr_successors = block->nr_successors;
+		hot->first_predecessor = block->predecessors - ctx->predecessors;
+		hot->nr_predecessors = block->nr_predecessors;
+	}
+
+	for (i = 0; i < hdr->nr_edges; i++) {
+		successors[i] = ctx->successors[i]->index;
+		predecessors[i] = ctx->predecessors[i]->index;
+	}
+
+	if (hdr->nr_edges) {
+		memcpy(image + hdr->successor_kinds, ctx->successor_kinds, hdr->nr_edges);
+		memcpy(image + hdr->predecessor_kinds, ctx->predecessor_kinds, hdr->nr_edges);
+	}
+
+	if (hdr->nr_entries)
+		memcpy(image + hdr->entries, ctx->entries, hdr->nr_entries * sizeof(*ctx->entries));
+
+	if (hdr->has_loops)
+		fill_forest(hdr, ctx->loops, image);
+}
+
+/* Write the analysis results for a context to path.  The file is built
+ * alongside and renamed into place, so readers never see half of it. */
+int bina_cache_save(struct bina_context *ctx, const char *path)
+{
+	struct cache_header hdr;
+	unsigned int file_size;
+	char *tmp, *image;
+	int fd, rc = -1;
+
+	layout(&hdr, ctx, &file_size);
+
+	tmp = malloc(strlen(path) + 8);
+	if (!tmp)
+		return -1;
+
+	sprintf(tmp, "%s.XXXXXX", path);
+	fd = mkstemp(tmp);
+	if (fd < 0) {
+		free(tmp);
+		return -1;
+	}
+
+	if (ftruncate(fd, file_size))
+		goto out;
+
+	image = mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (image == MAP_FAILED)
+		goto out;
+
+	fill(&hdr, ctx, image);
+	munmap(image, file_size);
+
+	if (rename(tmp, path) == 0)
+		rc = 0;
+
+out:
+	close(fd);
+	if (rc)
+		unlink(tmp);
+
+	free(tmp);
+	return rc;
+}
+
+static int table_fits(size_t file_size, unsigned int offset, unsigned int nr, unsigned int size)
+{
+	return offset <= file_size && (size_t)nr * size <= file_size - offset;
+}
+
+/* A context loaded from the cache has to be the one that asking for
+ * flags would have produced, or a linear sweep could stand in for a
+ * recursive descent. */
+static int check_header(struct cache_header *hdr, size_t file_size, char *base, unsigned int size,
+	int match_flags, unsigned int flags)
+{
+	if (file_size < sizeof(*hdr) || memcmp(hdr->magic, CACHE_MAGIC, sizeof(hdr->magic)))
+		return -1;
+
+	if (hdr->version != CACHE_VERSION ||
+			hdr->instruction_size != sizeof(struct bina_hot_instruction) ||
+			hdr->block_size != sizeof(struct bina_hot_block) ||
+			hdr->loop_size != sizeof(struct bina_loop) ||
+			hdr->trip_count_size != sizeof(struct bina_trip_count))
+		return -1;
+
+	if (match_flags && hdr->flags != bina_context_flags(flags))
+		return -1;
+
+	if (hdr->size != size || hdr->hash != content_hash(base, size))
+		return -1;
+
+	if (!table_fits(file_size, hdr->instructions, hdr->nr_instructions, sizeof(struct bina_hot_instruction)) ||
+			!table_fits(file_size, hdr->target_offsets, hdr->nr_instructions, sizeof(unsigned int)) ||
+			!table_fits(file_size, hdr->blocks, hdr->nr_blocks, sizeof(struct bina_hot_block)) ||
+			!table_fits(file_size, hdr->successors, hdr->nr_edges, sizeof(unsigned int)) ||
+			!table_fits(file_size, hdr->predecessors, hdr->nr_edges, sizeof(unsigned int)) ||
+			!table_fits(file_size, hdr->successor_kinds, hdr->nr_edges, 1) ||
+			!table_fits(file_size, hdr->predecessor_kinds, hdr->nr_edges, 1) ||
+			!table_fits(file_size, hdr->entries, hdr->nr_entries, sizeof(unsigned int)))
+		return -1;
+
+	if (hdr->has_loops && (
+			!table_fits(file_size, hdr->dominators, hdr->nr_blocks, sizeof(unsigned int)) ||
+			!table_fits(file_size, hdr->block_loops, hdr->nr_blocks, sizeof(unsigned int)) ||
+			!table_fits(file_size, hdr->loops, hdr->nr_loops, sizeof(struct bina_loop)) ||
+			!table_fits(file_size, hdr->loop_blocks, hdr->nr_loop_blocks, sizeof(unsigned int)) ||
+			!table_fits(file_size, hdr->exits, hdr->nr_exits, sizeof(struct bina_block_edge)) ||
+			!table_fits(file_size, hdr->back_edges, hdr->nr_back_edges, sizeof(struct bina_block_edge)) ||
+			!table_fits(file_size, hdr->irreducible_edges, hdr->nr_irreducible_edges, sizeof(struct bina_block_edge)) ||
+			!table_fits(file_size, hdr->trip_counts, hdr->nr_trip_counts, sizeof(struct bina_trip_count)) ||
+			(hdr->nr_trip_counts && hdr->nr_trip_counts != hdr->nr_loops)))
+		return -1;
+
+	return 0;
+}
+
+/* A corrupt file shouldn't be able to send us outside the tables. */
+static int check_tables(struct bina_context *ctx, struct bina_compact *c)
+{
+	unsigned int i;
+
+	for (i = 0; i < c->nr_instructions; i++) {
+		struct bina_hot_instruction *hot = &c->instructions[i];
+
+		if (hot->offset >= ctx->size || hot->size > ctx->size - hot->offset || hot->nr_operands)
+			return -1;
+
+		if (hot->branch_target != BINA_NO_INDEX && hot->branch_target >= c->nr_instructions)
+			return -1;
+
+		if (hot->basic_block != BINA_NO_INDEX && hot->basic_block >= c->nr_blocks)
+			return -1;
+	}
+
+	for (i = 0; i < c->nr_blocks; i++) {
+		struct bina_hot_block *hot = &c->blocks[i];
+
+		if (!hot->nr_instructions || hot->first_instruction >= c->nr_instructions ||
+				hot->nr_instructions > c->nr_instructions - hot->first_instruction ||
+				hot->first_successor > c->nr_edges ||
+				hot->nr_successors > c->nr_edges - hot->first_successor ||
+				hot->first_predecessor > c->nr_edges ||
+				hot->nr_predecessors > c->nr_edges - hot->first_predecessor)
+			return -1;
+	}
+
+	for (i = 0; i < c->nr_edges; i++) {
+		if (c->successors[i] >= c->nr_blocks || c->predecessors[i] >= c->nr_blocks)
+			return -1;
+	}
+
+	return 0;
+}
+
+static int check_edges(struct bina_block_edge *edges, unsigned int nr, unsigned int nr_blocks)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr; i++) {
+		if (edges[i].source >= nr_blocks || edges[i].target >= nr_blocks)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Point a forest at the mapped tables, like the edge kinds, once every
+ * index in them checks out. */
+static struct bina_loop_forest *load_forest(struct bina_context *ctx, struct cache_header *hdr, char *image)
+{
+	struct bina_loop_forest *forest;
+	unsigned int i, nr_blocks = hdr->nr_blocks, nr_loops = hdr->nr_loops;
+
+	forest = bina_arena_alloc(&ctx->loop_arena, 1, sizeof(*forest));
+	if (!forest)
+		return NULL;
+
+	forest->dominators = (unsigned int *)(image + hdr->dominators);
+	forest->block_loops = (unsigned int *)(image + hdr->block_loops);
+	forest->loops = (struct bina_loop *)(image + hdr->loops);
+	forest->nr_loops = nr_loops;
+	forest->blocks = (unsigned int *)(image + hdr->loop_blocks);
+	forest->exits = (struct bina_block_edge *)(image + hdr->exits);
+	forest->back_edges = (struct bina_block_edge *)(image + hdr->back_edges);
+	forest->irreducible_edges = (struct bina_block_edge *)(image + hdr->irreducible_edges);
+	forest->nr_irreducible_edges = hdr->nr_irreducible_edges;
+	forest->trip_counts = hdr->nr_trip_counts ? (struct bina_trip_count *)(image + hdr->trip_counts) : NULL;
+
+	for (i = 0; i < nr_blocks; i++) {
+		if ((forest->dominators[i] != BINA_NO_INDEX && forest->dominators[i] >= nr_blocks) ||
+				(forest->block_loops[i] != BINA_NO_INDEX && forest->block_loops[i] >= nr_loops))
+			return NULL;
+	}
+
+	for (i = 0; i < nr_loops; i++) {
+		struct bina_loop *loop = &forest->loops[i];
+
+		if (loop->header >= nr_blocks || (loop->parent != BINA_NO_INDEX && loop->parent >= nr_loops) ||
+				loop->first_block > hdr->nr_loop_blocks ||
+				loop->nr_blocks > hdr->nr_loop_blocks - loop->first_block ||
+				loop->first_exit > hdr->nr_exits ||
+				loop->nr_exits > hdr->nr_exits - loop->first_exit ||
+				loop->first_back_edge > hdr->nr_back_edges ||
+				loop->nr_back_edges > hdr->nr_back_edges - loop->first_back_edge)
+			return NULL;
+
+		if (forest->trip_counts && forest->trip_counts[i].kind != TK_UNKNOWN &&
+				(forest->trip_counts[i].update >= ctx->nr_instructions ||
+				 forest->trip_counts[i].test >= ctx->nr_instructions))
+			return NULL;
+	}
+
+	for (i = 0; i < hdr->nr_loop_blocks; i++) {
+		if (forest->blocks[i] >= nr_blocks)
+			return NULL;
+	}
+
+	if (check_edges(forest->exits, hdr->nr_exits, nr_blocks) ||
+			check_edges(forest->back_edges, hdr->nr_back_edges, nr_blocks) ||
+			check_edges(forest->irreducible_edges, hdr->nr_irreducible_edges, nr_blocks))
+		return NULL;
+
+	return forest;
+}
+
+static int load_instructions(struct bina_context *ctx, unsigned int *target_offsets)
+{
+	struct bina_compact *c = ctx->compact;
+	unsigned int i;
+
+	ctx->instructions = calloc(c->nr_instructions, sizeof(*ctx->instructions));
+	if (c->nr_instructions && !ctx->instructions)
+		return -1;
+
+	ctx->nr_instructions = ctx->max_instructions = c->nr_instructions;
+
+	bina_for_each_hot_instruction(c, i) {
+		struct bina_instruction *ins = &ctx->instructions[i];
+		struct bina_hot_instruction *hot = &c->instructions[i];
+
+		ins->index = i;
+		ins->context = ctx;
+		ins->offset = hot->offset;
+		ins->base = ctx->base + hot->offset;
+		ins->size = hot->size;
+		ins->type = hot->type;
+		ins->branch_target_offset = target_offsets[i];
+		ins->basic_block_leader = hot->basic_block_leader;
+
+		if (hot->branch_target != BINA_NO_INDEX)
+			ins->branch_target = &ctx->instructions[hot->branch_target];
+	}
+
+	bina_finish_instructions(ctx);
+	return 0;
+}
+
+/* Rebuild the pointer-based blocks and edge slices from the mapped
+ * tables.  The kind arrays are used from the mapping as they are. */
+static int load_blocks(struct bina_context *ctx, unsigned char *successor_kinds, unsigned char *predecessor_kinds)
+{
+	struct bina_compact *c = ctx->compact;
+	unsigned int i, n;
+
+	if (!c->nr_blocks)
+		return 0;
+
+	ctx->blocks = bina_arena_alloc(&ctx->block_arena, c->nr_blocks, sizeof(*ctx->blocks));
+	ctx->successors = bina_arena_alloc(&ctx->block_arena, c->nr_edges, sizeof(*ctx->successors));
+	ctx->predecessors = bina_arena_alloc(&ctx->block_arena, c->nr_edges, sizeof(*ctx->predecessors));
+	if (!ctx->blocks || (c->nr_edges && (!ctx->successors || !ctx->predecessors)))
+		return -1;
+
+	ctx->nr_basic_blocks = ctx->max_basic_blocks = c->nr_blocks;
+	ctx->nr_edges = ctx->max_edges = c->nr_edges;
+	ctx->successor_kinds = successor_kinds;
+	ctx->predecessor_kinds = predecessor_kinds;
+
+	for (i = 0; i < c->nr_edges; i++) {
+		ctx->successors[i] = &ctx->blocks[c->successors[i]];
+		ctx->predecessors[i] = &ctx->blocks[c->predecessors[i]];
+	}
+
+	for (i = 0; i < c->nr_blocks; i++) {
+		struct bina_basic_block *block = &ctx->blocks[i];
+		struct bina_hot_block *hot = &c->blocks[i];
+
+		if (i > 0) {
+			block->prev = &ctx->blocks[i - 1];
+			block->prev->next = block;
+		}
+
+		block->index = i;
+		block->offset = hot->offset;
+		block->base = ctx->base + hot->offset;
+		block->instructions = &ctx->instructions[hot->first_instruction];
+		block->nr_instructions = hot->nr_instructions;
+		block->successors = &ctx->successors[hot->first_successor];
+		block->successor_kinds = &ctx->successor_kinds[hot->first_successor];
+		block->nr_successors = hot->nr_successors;
+		block->predecessors = &ctx->predecessors[hot->first_predecessor];
+		block->predecessor_kinds = &ctx->predecessor_kinds[hot->first_predecessor];
+		block->nr_predecessors = hot->nr_predecessors;
+
+		bina_for_each_hot_block_instruction(c, i, n) {
+			ctx->instructions[n].basic_block = block;
+			block->size += ctx->instructions[n].size;
+		}
+	}
+
+	return 0;
+}
+
+static struct bina_context *cache_load(const struct bina_arch *arch, char *base, unsigned int size, const char *path,
+	int match_flags, unsigned int flags)
+{
+	struct bina_context *ctx;
+	struct cache_header *hdr;
+	struct bina_compact *c;
+	struct stat st;
+	char *image;
+	int fd;
+
+	if (!arch || !base || !path)
+		return NULL;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) || st.st_size < sizeof(*hdr)) {
+		close(fd);
+		return NULL;
+	}
+
+	/* Private and writable, so the tables can be updated in place if the
+	 * blocks are ever redetected.  Only touched pages get copied. */
+	image = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (image == MAP_FAILED)
+		return NULL;
+
+	hdr = (struct cache_header *)image;
+	if (check_header(hdr, st.st_size, base, size, match_flags, flags)) {
+		munmap(image, st.st_size);
+		return NULL;
+	}
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (!ctx) {
+		munmap(image, st.st_size);
+		return NULL;
+	}
+
+	ctx->arch = arch;
+	ctx->base = base;
+	ctx->size = size;
+	ctx->flags = hdr->flags | BINA_FAST_DECODE | BINA_LAZY_OPERANDS;
+	pthread_mutex_init(&ctx->lock, NULL);
+	ctx->cache = image;
+	ctx->cache_size = st.st_size;
+
+	ctx->entries = (unsigned int *)(image + hdr->entries);
+	ctx->nr_entries = hdr->nr_entries;
+
+	c = bina_arena_alloc(&ctx->compact_arena, 1, sizeof(*c));
+	if (!c)
+		goto fail;
+
+	c->instructions = (struct bina_hot_instruction *)(image + hdr->instructions);
+	c->nr_instructions = c->max_instructions = hdr->nr_instructions;
+	c->blocks = (struct bina_hot_block *)(image + hdr->blocks);
+	c->nr_blocks = hdr->nr_blocks;
+	c->max_blocks = hdr->nr_blocks;
+	c->successors = (unsigned int *)(image + hdr->successors);
+	c->predecessors = (unsigned int *)(image + hdr->predecessors);
+	c->nr_edges = c->max_edges = hdr->nr_edges;
+
+	/* No operands yet, so every instruction's slice is empty. */
+	c->operand_index = bina_arena_alloc(&ctx->compact_arena, c->nr_instructions + 1, sizeof(*c->operand_index));
+	if (!c->operand_index)
+		goto fail;
+
+	if (check_tables(ctx, c))
+		goto fail;
+
+	ctx->compact = c;
+
+	if (load_instructions(ctx, (unsigned int *)(image + hdr->target_offsets)))
+		goto fail;
+
+	if (bina_build_offset_index(ctx))
+		goto fail;
+
+	if (load_blocks(ctx, (unsigned char *)(image + hdr->successor_kinds),
+			(unsigned char *)(image + hdr->predecessor_kinds)))
+		goto fail;
+
+	if (hdr->has_loops && hdr->nr_blocks) {
+		ctx->loops = load_forest(ctx, hdr, image);
+		if (!ctx->loops)
+			goto fail;
+	}
+
+	return ctx;
+
+fail:
+	ctx->blocks = NULL;
+	bina_destroy(ctx);
+	return NULL;
+}
+
+/* Load the analysis for the code at base from a file written by
+ * bina_cache_save().  Returns NULL if there's no usable file, including
+ * when the code has changed since it was written.  The loaded context
+ * decodes operands lazily, and keeps whatever flags it was saved with. */
+struct bina_context *bina_cache_load(const struct bina_arch *arch, char *base, unsigned int size, const char *path)
+{
+	return cache_load(arch, base, size, path, 0, 0);
+}
+
+/* Load from the cache at path if it's current and was made with the same
+ * flags, otherwise disassemble, detect basic blocks and refresh the cache
+ * for next time.  Saving again after bina_analyse_loops() keeps the loop
+ * forest too. */
+struct bina_context *bina_create_cached(const struct bina_arch *arch, char *base, unsigned int size, unsigned int flags, const char *path)
+{
+	struct bina_context *ctx;
+
+	ctx = cache_load(arch, base, size, path, 1, flags);
+	if (ctx)
+		return ctx;
+
+	ctx = bina_create_flags(arch, base, size, flags);
+	if (!ctx)
+		return NULL;
+
+	if (bina_detect_basic_blocks(ctx)) {
+		bina_destroy(ctx);
+		return NULL;
+	}
+
+	/* Failing to write the cache only costs the next run time. */
+	bina_cache_save(ctx, path);
+	return ctx;
+}
@@ -0,0 +1,629 @@
+#include <bina.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+static unsigned int online_threads(void)
+{
+	long nr = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return nr < 1 ? 1 : nr;
+}
+
+static void *graph_alloc(struct bina_context *ctx, unsigned int nr, size_t size)
+{
+	void *p;
+
+	/* Functions may still be being built on other threads. */
+	pthread_mutex_lock(&ctx->lock);
+	p = bina_arena_alloc(&ctx->function_arena, nr ? nr : 1, size);
+	pthread_mutex_unlock(&ctx->lock);
+
+	return p;
+}
+
+struct build_all {
+	struct bina_context *ctx;
+	unsigned int next;
+	int failed;
+};
+
+static void *build_worker(void *arg)
+{
+	struct build_all *all = arg;
+	unsigned int index;
+
+	while ((index = __sync_fetch_and_add(&all->next, 1)) < all->ctx->nr_functions) {
+		if (bina_build_function(&all->ctx->functions[index]))
+			__atomic_store_n(&all->failed, 1, __ATOMIC_RELAXED);
+	}
+
+	return NULL;
+}
+
+/* Every function's calls are needed, so build them all across the cores
+ * first.  Each build is independent of the others. */
+static int build_all_functions(struct bina_context *ctx)
+{
+	struct build_all all = { .ctx = ctx };
+	unsigned int nr_threads = online_threads(), started, i;
+	pthread_t *threads;
+
+	if (nr_threads > ctx->nr_functions)
+		nr_threads = ctx->nr_functions;
+
+	threads = calloc(nr_threads ? nr_threads : 1, sizeof(*threads));
+	if (!threads)
+		return -1;
+
+	for (started = 0; started < nr_threads; started++) {
+		if (pthread_create(&threads[started], NULL, build_worker, &all))
+			break;
+	}
+
+	if (!started)
+		build_worker(&all);
+
+	for (i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	free(threads);
+	return all.failed ? -1 : 0;
+}
+
+/* The function a call lands on, or NULL for indirect and unresolved
+ * calls. */
+static struct bina_function *callee_of(struct bina_context *ctx, unsigned int call)
+{
+	struct bina_instruction *ins = &ctx->instructions[call];
+
+	return bina_function_at(ctx, ins->branch_target_offset);
+}
+
+/* Lay out the call edges in both directions.  mark[g] holds one more
+ * than the last caller seen linking to g, so repeated calls to the same
+ * function only make one edge. */
+static int link_functions(struct bina_context *ctx, struct bina_call_graph *graph, unsigned int *mark)
+{
+	unsigned int n = ctx->nr_functions, f, k, pos;
+	unsigned int *nr_callers;
+
+	graph->first_callee = graph_alloc(ctx, n + 1, sizeof(*graph->first_callee));
+	graph->first_caller = graph_alloc(ctx, n + 1, sizeof(*graph->first_caller));
+	nr_callers = calloc(n + 1, sizeof(*nr_callers));
+	if (!graph->first_callee || !graph->first_caller || !nr_callers) {
+		free(nr_callers);
+		return -1;
+	}
+
+	memset(mark, 0, n * sizeof(*mark));
+	for (f = 0; f < n; f++) {
+		struct bina_function *fn = &ctx->functions[f];
+
+		graph->first_callee[f] = graph->nr_edges;
+
+		for (k = 0; k < fn->nr_calls; k++) {
+			struct bina_function *callee = callee_of(ctx, fn->calls[k]);
+
+			if (!callee || mark[callee->index] == f + 1)
+				continue;
+
+			mark[callee->index] = f + 1;
+			nr_callers[callee->index]++;
+			graph->nr_edges++;
+		}
+	}
+
+	graph->first_callee[n] = graph->nr_edges;
+
+	pos = 0;
+	for (f = 0; f < n; f++) {
+		graph->first_caller[f] = pos;
+		pos += nr_callers[f];
+		nr_callers[f] = 0;
+	}
+
+	graph->first_caller[n] = pos;
+
+	graph->callees = graph_alloc(ctx, graph->nr_edges, sizeof(*graph->callees));
+	graph->callers = graph_alloc(ctx, graph->nr_edges, sizeof(*graph->callers));
+	if (!graph->callees || !graph->callers) {
+		free(nr_callers);
+		return -1;
+	}
+
+	memset(mark, 0, n * sizeof(*mark));
+	for (f = 0, pos = 0; f < n; f++) {
+		struct bina_function *fn = &ctx->functions[f];
+
+		for (k = 0; k < fn->nr_calls; k++) {
+			struct bina_function *callee = callee_of(ctx, fn->calls[k]);
+			unsigned int g;
+
+			if (!callee || mark[callee->index] == f + 1)
+				continue;
+
+			g = callee->index;
+			mark[g] = f + 1;
+			graph->callees[pos++] = g;
+			graph->callers[graph->first_caller[g] + nr_callers[g]++] = f;
+		}
+	}
+
+	free(nr_callers);
+	return 0;
+}
+
+/* Tarjan's algorithm, with an explicit stack of frames in place of the
+ * recursion, since call chains can be far deeper than the C stack
+ * allows.  Components are completed callees first, which is exactly the
+ * bottom up numbering we want. */
+static int find_components(struct bina_context *ctx, struct bina_call_graph *graph)
+{
+	unsigned int n = ctx->nr_functions, counter = 0, nr_stack = 0, nr_frames = 0;
+	unsigned int *order, *low, *edge, *stack, *frames, root, v, w;
+	unsigned char *on_stack;
+	int rc = -1;
+
+	graph->component = graph_alloc(ctx, n, sizeof(*graph->component));
+	order = calloc(n + 1, sizeof(*order));
+	low = calloc(n + 1, sizeof(*low));
+	edge = calloc(n + 1, sizeof(*edge));
+	stack = calloc(n + 1, sizeof(*stack));
+	frames = calloc(n + 1, sizeof(*frames));
+	on_stack = calloc(n + 1, sizeof(*on_stack));
+	if (!graph->component || !order || !low || !edge || !stack || !frames || !on_stack)
+		goto out;
+
+	/* order[v] is zero until v is visited. */
+	for (root = 0; root < n; root++) {
+		if (order[root])
+			continue;
+
+		order[root] = low[root] = ++counter;
+		edge[root] = graph->first_callee[root];
+		stack[nr_stack++] = root;
+		on_stack[root] = 1;
+		frames[nr_frames++] = root;
+
+		while (nr_frames) {
+			v = frames[nr_frames - 1];
+
+			if (edge[v] < graph->first_callee[v + 1]) {
+				w = graph->callees[edge[v]++];
+
+				if (!order[w]) {
+					order[w] = low[w] = ++counter;
+					edge[w] = graph->first_callee[w];
+					stack[nr_stack++] = w;
+					on_stack[w] = 1;
+					frames[nr_frames++] = w;
+				} else if (on_stack[w] && order[w] < low[v]) {
+					low[v] = order[w];
+				}
+
+				continue;
+			}
+
+			nr_frames--;
+
+			if (low[v] == order[v]) {
+				do {
+					w = stack[--nr_stack];
+					on_stack[w] = 0;
+					graph->component[w] = graph->nr_components;
+				} while (w != v);
+
+				graph->nr_components++;
+			}
+
+			if (nr_frames && low[v] < low[frames[nr_frames - 1]])
+				low[frames[nr_frames - 1]] = low[v];
+		}
+	}
+
+	rc = 0;
+
+out:
+	free(order);
+	free(low);
+	free(edge);
+	free(stack);
+	free(frames);
+	free(on_stack);
+	return rc;
+}
+
+/* Group the members of each component, and link each component to the
+ * distinct components calling into it. */
+static int link_components(struct bina_context *ctx, struct bina_call_graph *graph, unsigned int *mark)
+{
+	unsigned int n = ctx->nr_functions, nr = graph->nr_components;
+	unsigned int *count, f, c, k, e, pos;
+
+	graph->first_member = graph_alloc(ctx, nr + 1, sizeof(*graph->first_member));
+	graph->members = graph_alloc(ctx, n, sizeof(*graph->members));
+	graph->first_component_caller = graph_alloc(ctx, nr + 1, sizeof(*graph->first_component_caller));
+	graph->nr_component_callees = graph_alloc(ctx, nr, sizeof(*graph->nr_component_callees));
+	count = calloc(nr + 1, sizeof(*count));
+	if (!graph->first_member || !graph->members || !graph->first_component_caller ||
+			!graph->nr_component_callees || !count) {
+		free(count);
+		return -1;
+	}
+
+	for (f = 0; f < n; f++) {
+		count[graph->component[f]]++;
+	}
+
+	for (c = 0, pos = 0; c < nr; c++) {
+		graph->first_member[c] = pos;
+		pos += count[c];
+		count[c] = 0;
+	}
+
+	graph->first_member[nr] = pos;
+
+	for (f = 0; f < n; f++) {
+		c = graph->component[f];
+		graph->members[graph->first_member[c] + count[c]++] = f;
+	}
+
+	/* Count the distinct component edges, then fill them in. */
+	memset(count, 0, (nr + 1) * sizeof(*count));
+	memset(mark, 0, n * sizeof(*mark));
+	for (c = 0, e = 0; c < nr; c++) {
+		for (k = graph->first_member[c]; k < graph->first_member[c + 1]; k++) {
+			f = graph->members[k];
+
+			for (pos = graph->first_callee[f]; pos < graph->first_callee[f + 1]; pos++) {
+				unsigned int d = graph->component[graph->callees[pos]];
+
+				if (d == c || mark[d] == c + 1)
+					continue;
+
+				mark[d] = c + 1;
+				graph->nr_component_callees[c]++;
+				count[d]++;
+				e++;
+			}
+		}
+	}
+
+	for (c = 0, pos = 0; c < nr; c++) {
+		graph->first_component_caller[c] = pos;
+		pos += count[c];
+		count[c] = 0;
+	}
+
+	graph->first_component_caller[nr] = pos;
+
+	graph->component_callers = graph_alloc(ctx, e, sizeof(*graph->component_callers));
+	if (!graph->component_callers) {
+		free(count);
+		return -1;
+	}
+
+	memset(mark, 0, n * sizeof(*mark));
+	for (c = 0; c < nr; c++) {
+		for (k = graph->first_member[c]; k < graph->first_member[c + 1]; k++) {
+			f = graph->members[k];
+
+			for (pos = graph->first_callee[f]; pos < graph->first_callee[f + 1]; pos++) {
+				unsigned int d = graph->component[graph->callees[pos]];
+
+				if (d == c || mark[d] == c + 1)
+					continue;
+
+				mark[d] = c + 1;
+				graph->component_callers[graph->first_component_caller[d] + count[d]++] = c;
+			}
+		}
+	}
+
+	free(count);
+	return 0;
+}
+
+/* Build the call graph over the context's functions, discovering and
+ * building them first if need be.  Only direct calls to a known function
+ * entry make edges. */
+int bina_build_call_graph(struct bina_context *ctx)
+{
+	struct bina_call_graph *graph;
+	unsigned int *mark;
+	int rc = -1;
+
+	if (ctx->call_graph)
+		return 0;
+
+	if (bina_discover_functions(ctx) || build_all_functions(ctx))
+		return -1;
+
+	graph = graph_alloc(ctx, 1, sizeof(*graph));
+	mark = calloc(ctx->nr_functions + 1, sizeof(*mark));
+	if (!graph || !mark)
+		goto out;
+
+	if (link_functions(ctx, graph, mark) || find_components(ctx, graph) ||
+			link_components(ctx, graph, mark))
+		goto out;
+
+	ctx->call_graph = graph;
+	rc = 0;
+
+out:
+	free(mark);
+	return rc;
+}
+
+/* A worker's queue of ready components.  The owner pushes and pops at
+ * the tail, so it carries on down the call graph with what's likely
+ * still in its cache, and thieves take from the head.  Each component
+ * is pushed exactly once, so a queue never holds more than all of them. */
+struct work_queue {
+	pthread_mutex_t lock;
+	unsigned int *items;
+	unsigned int head, tail;
+};
+
+struct schedule {
+	struct bina_context *ctx;
+	struct bina_call_graph *graph;
+	bina_function_analysis_fn analyse;
+	void *priv;
+
+	struct work_queue *queues;
+	unsigned int nr_queues;
+
+	/* Callee components each component is still waiting on. */
+	unsigned int *pending;
+	unsigned int remaining;
+	int rc;
+
+	/* Idle workers sleep on wake until something is queued or the run
+	 * is over.  nr_ready counts components queued but not yet taken. */
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	int nr_ready;
+	int done;
+};
+
+struct worker {
+	struct schedule *schedule;
+	unsigned int id;
+};
+
+static void queue_push(struct work_queue *queue, unsigned int component)
+{
+	pthread_mutex_lock(&queue->lock);
+	queue->items[queue->tail++] = component;
+	pthread_mutex_unlock(&queue->lock);
+}
+
+static int queue_take(struct work_queue *queue, int steal, unsigned int *component)
+{
+	int found = 0;
+
+	pthread_mutex_lock(&queue->lock);
+
+	if (queue->head < queue->tail) {
+		*component = steal ? queue->items[queue->head++] : queue->items[--queue->tail];
+		found = 1;
+
+		if (queue->head == queue->tail)
+			queue->head = queue->tail = 0;
+	}
+
+	pthread_mutex_unlock(&queue->lock);
+	return found;
+}
+
+/* Queue a component that's ready to run, and wake a worker for it. */
+static void make_ready(struct schedule *schedule, unsigned int queue, unsigned int component)
+{
+	queue_push(&schedule->queues[queue], component);
+
+	pthread_mutex_lock(&schedule->lock);
+	schedule->nr_ready++;
+	pthread_cond_signal(&schedule->wake);
+	pthread_mutex_unlock(&schedule->lock);
+}
+
+static int find_work(struct worker *worker, unsigned int *component)
+{
+	struct schedule *schedule = worker->schedule;
+	unsigned int i;
+	int found = queue_take(&schedule->queues[worker->id], 0, component);
+
+	for (i = 1; !found && i < schedule->nr_queues; i++) {
+		unsigned int victim = (worker->id + i) % schedule->nr_queues;
+
+		found = queue_take(&schedule->queues[victim], 1, component);
+	}
+
+	if (found) {
+		pthread_mutex_lock(&schedule->lock);
+		schedule->nr_ready--;
+		pthread_mutex_unlock(&schedule->lock);
+	}
+
+	return found;
+}
+
+/* Sleep until there's something queued, or the run is over. */
+static void wait_for_work(struct schedule *schedule)
+{
+	pthread_mutex_lock(&schedule->lock);
+	while (schedule->nr_ready <= 0 && !schedule->done)
+		pthread_cond_wait(&schedule->wake, &schedule->lock);
+	pthread_mutex_unlock(&schedule->lock);
+}
+
+/* Every component has run, or one has failed, so wake everyone up to
+ * leave. */
+static void finish_schedule(struct schedule *schedule)
+{
+	pthread_mutex_lock(&schedule->lock);
+	schedule->done = 1;
+	pthread_cond_broadcast(&schedule->wake);
+	pthread_mutex_unlock(&schedule->lock);
+}
+
+/* Run the analysis over one component.  Its members call each other, so
+ * there's no better order among them than their entry order. */
+static int run_component(struct schedule *schedule, unsigned int c)
+{
+	struct bina_call_graph *graph = schedule->graph;
+	unsigned int k;
+	int rc;
+
+	for (k = graph->first_member[c]; k < graph->first_member[c + 1]; k++) {
+		rc = schedule->analyse(&schedule->ctx->functions[graph->members[k]], schedule->priv);
+		if (rc)
+			return rc;
+	}
+
+	return 0;
+}
+
+static void *schedule_worker(void *arg)
+{
+	struct worker *worker = arg;
+	struct schedule *schedule = worker->schedule;
+	struct bina_call_graph *graph = schedule->graph;
+	unsigned int c, e;
+	int rc, expected;
+
+	while (__atomic_load_n(&schedule->remaining, __ATOMIC_ACQUIRE) &&
+			!__atomic_load_n(&schedule->rc, __ATOMIC_RELAXED)) {
+		if (!find_work(worker, &c)) {
+			wait_for_work(schedule);
+			continue;
+		}
+
+		rc = run_component(schedule, c);
+		if (rc) {
+			expected = 0;
+			__atomic_compare_exchange_n(&schedule->rc, &expected, rc, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+			finish_schedule(schedule);
+			break;
+		}
+
+		/* Callers whose last callee this was are ready now. */
+		for (e = graph->first_component_caller[c]; e < graph->first_component_caller[c + 1]; e++) {
+			unsigned int d = graph->component_callers[e];
+
+			if (!__atomic_sub_fetch(&schedule->pending[d], 1, __ATOMIC_ACQ_REL))
+				make_ready(schedule, worker->id, d);
+		}
+
+		if (!__atomic_sub_fetch(&schedule->remaining, 1, __ATOMIC_RELEASE))
+			finish_schedule(schedule);
+	}
+
+	return NULL;
+}
+
+/* Run an analysis over every function, with each one's callees done
+ * before it, except within a cycle of calls.  Independent functions run
+ * at the same time across nr_threads workers, or one per core if that's
+ * zero, so the analysis must be safe to run on several functions at
+ * once.  Returns the first non-zero result from the analysis, or -1 if
+ * the call graph can't be built. */
+int bina_analyse_bottom_up(struct bina_context *ctx, bina_function_analysis_fn analyse, void *priv, unsigned int nr_threads)
+{
+	struct schedule schedule = { .ctx = ctx, .analyse = analyse, .priv = priv };
+	struct bina_call_graph *graph;
+	struct worker *workers = NULL;
+	pthread_t *threads = NULL;
+	unsigned int i, c, started = 0, nr_locks = 0;
+	int rc = -1, have_wake = 0;
+
+	if (bina_build_call_graph(ctx))
+		return -1;
+
+	graph = schedule.graph = ctx->call_graph;
+	if (!graph->nr_components)
+		return 0;
+
+	if (!nr_threads)
+		nr_threads = online_threads();
+
+	if (nr_threads > graph->nr_components)
+		nr_threads = graph->nr_components;
+
+	schedule.nr_queues = nr_threads;
+	schedule.remaining = graph->nr_components;
+	schedule.pending = malloc(graph->nr_components * sizeof(*schedule.pending));
+	schedule.queues = calloc(nr_threads, sizeof(*schedule.queues));
+	workers = calloc(nr_threads, sizeof(*workers));
+	threads = calloc(nr_threads, sizeof(*threads));
+	if (!schedule.pending || !schedule.queues || !workers || !threads)
+		goto out;
+
+	memcpy(schedule.pending, graph->nr_component_callees, graph->nr_components * sizeof(*schedule.pending));
+
+	if (pthread_mutex_init(&schedule.lock, NULL))
+		goto out;
+
+	if (pthread_cond_init(&schedule.wake, NULL)) {
+		pthread_mutex_destroy(&schedule.lock);
+		goto out;
+	}
+
+	have_wake = 1;
+
+	for (; nr_locks < nr_threads; nr_locks++) {
+		struct work_queue *queue = &schedule.queues[nr_locks];
+
+		queue->items = malloc(graph->nr_components * sizeof(*queue->items));
+		if (!queue->items || pthread_mutex_init(&queue->lock, NULL)) {
+			free(queue->items);
+			goto out;
+		}
+
+		workers[nr_locks].schedule = &schedule;
+		workers[nr_locks].id = nr_locks;
+	}
+
+	/* Leaves of the call graph are where it starts, dealt out evenly. */
+	for (c = 0, i = 0; c < graph->nr_components; c++) {
+		if (!schedule.pending[c])
+			make_ready(&schedule, i++ % nr_threads, c);
+	}
+
+	for (; started < nr_threads; started++) {
+		if (pthread_create(&threads[started], NULL, schedule_worker, &workers[started]))
+			break;
+	}
+
+	/* Any worker steals from every queue, so one is enough. */
+	if (!started)
+		schedule_worker(&workers[0]);
+
+	for (i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	rc = schedule.rc;
+
+out:
+	for (i = 0; i < nr_locks; i++) {
+		pthread_mutex_destroy(&schedule.queues[i].lock);
+		free(schedule.queues[i].items);
+	}
+
+	if (have_wake) {
+		pthread_cond_destroy(&schedule.wake);
+		pthread_mutex_destroy(&schedule.lock);
+	}
+
+	free(schedule.pending);
+	free(schedule.queues);
+	free(workers);
+	free(threads);
+	return rc;
+}
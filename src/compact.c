@@ -0,0 +1,272 @@
+#include <bina.h>
+#include <malloc.h>
+#include <string.h>
+
+/* Copy one block and its edge slices into the hot tables, which already
+ * have room for every block and edge. */
+void bina_compact_sync_block(struct bina_context *ctx, unsigned int index)
+{
+	struct bina_compact *c = ctx->compact;
+	struct bina_basic_block *block = &ctx->blocks[index];
+	struct bina_hot_block *hot = &c->blocks[index];
+	unsigned int n;
+
+	hot->offset = block->offset;
+	hot->first_instruction = block->instructions - ctx->instructions;
+	hot->nr_instructions = block->nr_instructions;
+	hot->first_successor = block->successors - ctx->successors;
+	hot->nr_successors = block->nr_successors;
+	hot->first_predecessor = block->predecessors - ctx->predecessors;
+	hot->nr_predecessors = block->nr_predecessors;
+
+	for (n = 0; n < block->nr_successors; n++) {
+		c->successors[hot->first_successor + n] = block->successors[n]->index;
+	}
+
+	for (n = 0; n < block->nr_predecessors; n++) {
+		c->predecessors[hot->first_predecessor + n] = block->predecessors[n]->index;
+	}
+
+	bina_for_each_hot_block_instruction(c, index, n) {
+		c->instructions[n].basic_block = index;
+	}
+}
+
+/* The hot tables get at least the same room as the context's own, so a
+ * patch can update them in place.  They come out of the compact arena,
+ * and are only replaced once they're outgrown, at twice the size, so
+ * detecting the blocks over and over doesn't keep taking more. */
+int bina_compact_sync_blocks(struct bina_context *ctx)
+{
+	struct bina_compact *c = ctx->compact;
+	unsigned int i, capacity;
+
+	c->nr_blocks = 0;
+	c->nr_edges = 0;
+
+	for (i = 0; i < c->nr_instructions; i++) {
+		c->instructions[i].basic_block = BINA_NO_INDEX;
+	}
+
+	if (!ctx->blocks)
+		return 0;
+
+	if (ctx->max_basic_blocks > c->max_blocks) {
+		struct bina_hot_block *blocks;
+
+		capacity = c->max_blocks * 2 > ctx->max_basic_blocks ? c->max_blocks * 2 : ctx->max_basic_blocks;
+		blocks = bina_arena_alloc(&ctx->compact_arena, capacity, sizeof(*blocks));
+		if (!blocks)
+			return -1;
+
+		c->blocks = blocks;
+		c->max_blocks = capacity;
+	}
+
+	if (ctx->max_edges > c->max_edges) {
+		unsigned int *successors, *predecessors;
+
+		capacity = c->max_edges * 2 > ctx->max_edges ? c->max_edges * 2 : ctx->max_edges;
+		successors = bina_arena_alloc(&ctx->compact_arena, capacity, sizeof(*successors));
+		predecessors = bina_arena_alloc(&ctx->compact_arena, capacity, sizeof(*predecessors));
+		if (!successors || !predecessors)
+			return -1;
+
+		c->successors = successors;
+		c->predecessors = predecessors;
+		c->max_edges = capacity;
+	}
+
+	c->nr_blocks = ctx->nr_basic_blocks;
+	c->nr_edges = ctx->nr_edges;
+
+	for (i = 0; i < ctx->nr_basic_blocks; i++) {
+		bina_compact_sync_block(ctx, i);
+	}
+
+	return 0;
+}
+
+int bina_build_compact(struct bina_context *ctx)
+{
+	struct bina_compact *c;
+	unsigned int i, nr_operands;
+
+	if (ctx->compact)
+		return 0;
+
+	c = bina_arena_alloc(&ctx->compact_arena, 1, sizeof(*c));
+	if (!c)
+		return -1;
+
+	ctx->compact = c;
+
+	c->nr_instructions = c->max_instructions = ctx->nr_instructions;
+	c->instructions = bina_arena_alloc(&ctx->compact_arena, ctx->nr_instructions, sizeof(*c->instructions));
+	c->operand_index = bina_arena_alloc(&ctx->compact_arena, ctx->nr_instructions + 1, sizeof(*c->operand_index));
+	if (!c->operand_index || (ctx->nr_instructions && !c->instructions))
+		goto fail;
+
+	/* Pass one: the hot fields, and a running count of operands. */
+	nr_operands = 0;
+	for (i = 0; i < ctx->nr_instructions; i++) {
+		struct bina_instruction *ins = &ctx->instructions[i];
+		struct bina_hot_instruction *hot = &c->instructions[i];
+		struct bina_instruction *target = ins->branch_target;
+
+		hot->offset = ins->offset;
+		hot->size = ins->size;
+		hot->type = ins->type;
+		hot->basic_block_leader = ins->basic_block_leader;
+		hot->nr_operands = ins->nr_operands;
+
+		/* Branch targets are resolved up front, so later passes never
+		 * need to go back to the offset index. */
+		if (!target && (ins->type == IT_CALL || ins->type == IT_U_BRANCH || ins->type == IT_C_BRANCH))
+			target = bina_instruction_at(ctx, ins->branch_target_offset);
+
+		hot->branch_target = target ? target->index : BINA_NO_INDEX;
+
+		c->operand_index[i] = nr_operands;
+		nr_operands += ins->nr_operands;
+	}
+
+	c->operand_index[ctx->nr_instructions] = nr_operands;
+
+	/* Pass two: copy the operands out into the side table. */
+	c->operands = bina_arena_alloc(&ctx->compact_arena, nr_operands, sizeof(*c->operands));
+	if (nr_operands && !c->operands)
+		goto fail;
+
+	for (i = 0; i < ctx->nr_instructions; i++) {
+		if (ctx->instructions[i].nr_operands)
+			memcpy(&c->operands[c->operand_index[i]], ctx->instructions[i].operands,
+				ctx->instructions[i].nr_operands * sizeof(*c->operands));
+	}
+
+	if (bina_compact_sync_blocks(ctx))
+		goto fail;
+
+	return 0;
+
+fail:
+	bina_destroy_compact(ctx);
+	return -1;
+}
+
+/* Everything in the compact view came out of its own arena, so it all
+ * goes back in one go. */
+void bina_destroy_compact(struct bina_context *ctx)
+{
+	ctx->compact = NULL;
+	bina_arena_reset(&ctx->compact_arena);
+}
+
+/* The section graph in the compact layout.  With a compact view its own
+ * arrays are used directly, otherwise the edges are copied out of the
+ * block pointers.  The walk starts at the first entry point's block. */
+int bina_get_section_graph(struct bina_context *ctx, struct bina_hot_graph *graph)
+{
+	struct bina_instruction *ins;
+	unsigned int b, e;
+
+	memset(graph, 0, sizeof(*graph));
+	graph->context = ctx;
+
+	if (!ctx->blocks && bina_detect_basic_blocks(ctx))
+		return -1;
+
+	graph->nr_blocks = ctx->nr_basic_blocks;
+	graph->nr_edges = ctx->nr_edges;
+
+	ins = ctx->nr_entries ? bina_instruction_at(ctx, ctx->entries[0]) : NULL;
+	if (ins && ins->basic_block)
+		graph->entry = ins->basic_block->index;
+
+	if (ctx->compact) {
+		graph->blocks = ctx->compact->blocks;
+		graph->successors = ctx->compact->successors;
+		graph->predecessors = ctx->compact->predecessors;
+		return 0;
+	}
+
+	graph->copied = 1;
+	graph->blocks = calloc(ctx->nr_basic_blocks + 1, sizeof(*graph->blocks));
+	graph->successors = calloc(ctx->nr_edges + 1, sizeof(*graph->successors));
+	graph->predecessors = calloc(ctx->nr_edges + 1, sizeof(*graph->predecessors));
+	if (!graph->blocks || !graph->successors || !graph->predecessors) {
+		bina_put_hot_graph(graph);
+		return -1;
+	}
+
+	for (b = 0; b < ctx->nr_basic_blocks; b++) {
+		struct bina_basic_block *block = &ctx->blocks[b];
+		struct bina_hot_block *hot = &graph->blocks[b];
+
+		hot->offset = block->offset;
+		hot->first_instruction = block->instructions->index;
+		hot->nr_instructions = block->nr_instructions;
+		hot->nr_successors = block->nr_successors;
+		hot->nr_predecessors = block->nr_predecessors;
+
+		if (block->nr_successors)
+			hot->first_successor = block->successors - ctx->successors;
+
+		if (block->nr_predecessors)
+			hot->first_predecessor = block->predecessors - ctx->predecessors;
+	}
+
+	for (e = 0; e < ctx->nr_edges; e++) {
+		graph->successors[e] = ctx->successors[e]->index;
+		graph->predecessors[e] = ctx->predecessors[e]->index;
+	}
+
+	return 0;
+}
+
+/* A function's graph, building it first if need be.  Its entry is the
+ * block starting at the function's offset. */
+int bina_get_function_graph(struct bina_function *fn, struct bina_hot_graph *graph)
+{
+	unsigned int low = 0, high;
+
+	memset(graph, 0, sizeof(*graph));
+	graph->context = fn->context;
+
+	if (bina_build_function(fn))
+		return -1;
+
+	graph->blocks = fn->blocks;
+	graph->nr_blocks = fn->nr_blocks;
+	graph->successors = fn->successors;
+	graph->predecessors = fn->predecessors;
+	graph->nr_edges = fn->nr_edges;
+
+	/* Blocks are in offset order. */
+	high = fn->nr_blocks;
+	while (low < high) {
+		unsigned int mid = low + (high - low) / 2;
+
+		if (fn->blocks[mid].offset < fn->offset)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	graph->entry = low;
+	return 0;
+}
+
+void bina_put_hot_graph(struct bina_hot_graph *graph)
+{
+	if (graph->copied) {
+		free(graph->blocks);
+		free(graph->successors);
+		free(graph->predecessors);
+	}
+
+	graph->blocks = NULL;
+	graph->successors = NULL;
+	graph->predecessors = NULL;
+	graph->copied = 0;
+}
@@ -0,0 +1,379 @@
+#include <bina.h>
+#include <malloc.h>
+#include <string.h>
+
+/* Set up a problem with nr_bits facts per block, all sets empty. */
+int bina_dataflow_init(struct bina_dataflow *df, struct bina_hot_graph *graph, unsigned int nr_bits, unsigned int flags)
+{
+	size_t nr;
+
+	memset(df, 0, sizeof(*df));
+	df->graph = graph;
+	df->flags = flags;
+	df->nr_bits = nr_bits;
+	df->nr_words = (nr_bits + BINA_BITS_PER_WORD - 1) / BINA_BITS_PER_WORD;
+
+	/* All four sets for every block in one allocation, so a solve walks
+	 * as little memory as possible. */
+	nr = (size_t)graph->nr_blocks * df->nr_words;
+	df->gen = calloc(4 * nr + 1, sizeof(*df->gen));
+	if (!df->gen)
+		return -1;
+
+	df->kill = df->gen + nr;
+	df->in = df->kill + nr;
+	df->out = df->in + nr;
+	return 0;
+}
+
+void bina_dataflow_destroy(struct bina_dataflow *df)
+{
+	free(df->gen);
+	df->gen = df->kill = df->in = df->out = NULL;
+}
+
+/* Blocks in depth first post order from the entry, then from anything
+ * it doesn't reach. */
+static int post_order(struct bina_hot_graph *g, unsigned int *order)
+{
+	unsigned int *stack, *next, nr = 0, nr_stack, k, r, b;
+	unsigned char *seen;
+
+	stack = malloc((g->nr_blocks + 1) * sizeof(*stack));
+	next = malloc((g->nr_blocks + 1) * sizeof(*next));
+	seen = calloc(g->nr_blocks + 1, sizeof(*seen));
+	if (!stack || !next || !seen) {
+		free(stack);
+		free(next);
+		free(seen);
+		return -1;
+	}
+
+	for (k = 0; k <= g->nr_blocks; k++) {
+		r = k ? k - 1 : g->entry;
+		if (r >= g->nr_blocks || seen[r])
+			continue;
+
+		seen[r] = 1;
+		next[r] = 0;
+		stack[0] = r;
+		nr_stack = 1;
+
+		while (nr_stack) {
+			struct bina_hot_block *block;
+
+			b = stack[nr_stack - 1];
+			block = &g->blocks[b];
+
+			if (next[b] < block->nr_successors) {
+				unsigned int s = g->successors[block->first_successor + next[b]++];
+
+				if (!seen[s]) {
+					seen[s] = 1;
+					next[s] = 0;
+					stack[nr_stack++] = s;
+				}
+
+				continue;
+			}
+
+			nr_stack--;
+			order[nr++] = b;
+		}
+	}
+
+	free(stack);
+	free(next);
+	free(seen);
+	return 0;
+}
+
+/* Meet the sets of the blocks facts flow from into in.  With none, this
+ * is a boundary block, which starts from nothing. */
+static void meet(struct bina_dataflow *df, unsigned long *in, unsigned long *after,
+	unsigned int *flow, unsigned int first, unsigned int nr)
+{
+	unsigned int words = df->nr_words, e, w;
+	unsigned long *src;
+
+	if (!nr) {
+		memset(in, 0, words * sizeof(*in));
+		return;
+	}
+
+	src = bina_dataflow_set(df, after, flow[first]);
+	memcpy(in, src, words * sizeof(*in));
+
+	for (e = first + 1; e < first + nr; e++) {
+		src = bina_dataflow_set(df, after, flow[e]);
+
+		if (df->flags & BINA_DATAFLOW_INTERSECT) {
+			for (w = 0; w < words; w++)
+				in[w] &= src[w];
+		} else {
+			for (w = 0; w < words; w++)
+				in[w] |= src[w];
+		}
+	}
+}
+
+/* out = gen | (in & ~kill), returning whether out changed. */
+static int transfer(struct bina_dataflow *df, unsigned int b, unsigned long *in, unsigned long *out)
+{
+	unsigned long *gen = bina_dataflow_set(df, df->gen, b);
+	unsigned long *kill = bina_dataflow_set(df, df->kill, b);
+	unsigned long changed = 0, set;
+	unsigned int w;
+
+	for (w = 0; w < df->nr_words; w++) {
+		set = gen[w] | (in[w] & ~kill[w]);
+		changed |= set ^ out[w];
+		out[w] = set;
+	}
+
+	return changed != 0;
+}
+
+/* Solve the problem with a worklist kept in iteration order: reverse
+ * post order going forwards, post order going backwards, so that facts
+ * mostly arrive before the blocks that need them.  Each sweep visits the
+ * pending blocks in that order, and only the blocks fed by a set that
+ * changed are pending again.  The result is the maximal fixed point. */
+int bina_dataflow_solve(struct bina_dataflow *df)
+{
+	struct bina_hot_graph *g = df->graph;
+	unsigned int n = g->nr_blocks, nr_pending = n / BINA_BITS_PER_WORD + 1;
+	unsigned int words = df->nr_words, i, w, e, b, pos;
+	int backward = df->flags & BINA_DATAFLOW_BACKWARD;
+	unsigned long *before, *after, *pending, tail;
+	unsigned int *order, *position;
+	int rc = -1, busy;
+
+	/* Facts arrive at one end of each block and leave from the other. */
+	before = backward ? df->out : df->in;
+	after = backward ? df->in : df->out;
+
+	order = malloc((n + 1) * sizeof(*order));
+	position = malloc((n + 1) * sizeof(*position));
+	pending = calloc(nr_pending, sizeof(*pending));
+	if (!order || !position || !pending || post_order(g, order))
+		goto out;
+
+	if (!backward) {
+		for (i = 0; i < n / 2; i++) {
+			b = order[i];
+			order[i] = order[n - 1 - i];
+			order[n - 1 - i] = b;
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		position[order[i]] = i;
+		bina_bit_set(pending, i);
+	}
+
+	/* An intersection starts from everything and works down. */
+	tail = (df->nr_bits % BINA_BITS_PER_WORD) ? (1UL << (df->nr_bits % BINA_BITS_PER_WORD)) - 1 : ~0UL;
+	for (b = 0; b < n && words; b++) {
+		unsigned long *set = bina_dataflow_set(df, after, b);
+
+		memset(set, (df->flags & BINA_DATAFLOW_INTERSECT) ? 0xff : 0, words * sizeof(*set));
+		set[words - 1] &= tail;
+	}
+
+	do {
+		for (w = 0; w < nr_pending; w++) {
+			while (pending[w]) {
+				struct bina_hot_block *block;
+
+				pos = w * BINA_BITS_PER_WORD + __builtin_ctzl(pending[w]);
+				pending[w] &= pending[w] - 1;
+
+				b = order[pos];
+				block = &g->blocks[b];
+
+				if (backward) {
+					meet(df, bina_dataflow_set(df, before, b), after, g->successors,
+						block->first_successor, block->nr_successors);
+				} else {
+					meet(df, bina_dataflow_set(df, before, b), after, g->predecessors,
+						block->first_predecessor, block->nr_predecessors);
+				}
+
+				if (!transfer(df, b, bina_dataflow_set(df, before, b), bina_dataflow_set(df, after, b)))
+					continue;
+
+				if (backward) {
+					bina_for_each_hot_predecessor(g, b, e)
+						bina_bit_set(pending, position[g->predecessors[e]]);
+				} else {
+					bina_for_each_hot_successor(g, b, e)
+						bina_bit_set(pending, position[g->successors[e]]);
+				}
+			}
+		}
+
+		/* Anything still pending sits behind the sweep, on a back edge. */
+		for (w = 0, busy = 0; w < nr_pending; w++) {
+			if (pending[w])
+				busy = 1;
+		}
+	} while (busy);
+
+	rc = 0;
+
+out:
+	free(order);
+	free(position);
+	free(pending);
+	return rc;
+}
+
+/* Every instruction's def/use sets, decoding operands where they haven't
+ * been already. */
+static int decode_registers(struct bina_hot_graph *g)
+{
+	struct bina_context *ctx = g->context;
+	unsigned int b, i;
+
+	for (b = 0; b < g->nr_blocks; b++) {
+		bina_for_each_hot_block_instruction(g, b, i) {
+			if (bina_decode_operands(&ctx->instructions[i]))
+				return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Registers live at each block's entry (in) and exit (out), one bit per
+ * register in the architecture's numbering. */
+int bina_liveness(struct bina_dataflow *df, struct bina_hot_graph *graph)
+{
+	struct bina_context *ctx = graph->context;
+	unsigned int b, i;
+
+	if (decode_registers(graph) ||
+			bina_dataflow_init(df, graph, ctx->arch->nr_registers, BINA_DATAFLOW_BACKWARD))
+		return -1;
+
+	/* A block generates the registers it reads before writing, and
+	 * kills the ones it writes. */
+	for (b = 0; b < graph->nr_blocks && df->nr_words; b++) {
+		unsigned long gen = 0, kill = 0;
+
+		bina_for_each_hot_block_instruction(graph, b, i) {
+			struct bina_instruction *ins = &ctx->instructions[i];
+
+			gen |= ins->uses & ~kill;
+			kill |= ins->defs;
+		}
+
+		*bina_dataflow_set(df, df->gen, b) = gen;
+		*bina_dataflow_set(df, df->kill, b) = kill;
+	}
+
+	if (bina_dataflow_solve(df)) {
+		bina_dataflow_destroy(df);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Definitions reaching each block's entry (in) and exit (out).  Every
+ * register an instruction writes is a definition, numbered in block
+ * order, and *definitions says which is which; the caller frees it.  A
+ * write to part of a register kills the earlier definitions like any
+ * other.  The sets are as wide as the number of definitions, so this is
+ * meant for function graphs rather than whole sections. */
+int bina_reaching_definitions(struct bina_dataflow *df, struct bina_hot_graph *graph,
+	struct bina_definition **definitions, unsigned int *nr_definitions)
+{
+	struct bina_context *ctx = graph->context;
+	unsigned int nr_registers = ctx->arch->nr_registers;
+	unsigned int b, i, r, w, nr = 0, *last = NULL;
+	struct bina_definition *defs = NULL;
+	unsigned long *defs_of = NULL;
+
+	if (decode_registers(graph))
+		return -1;
+
+	for (b = 0; b < graph->nr_blocks; b++) {
+		bina_for_each_hot_block_instruction(graph, b, i) {
+			nr += __builtin_popcount(ctx->instructions[i].defs);
+		}
+	}
+
+	if (bina_dataflow_init(df, graph, nr, 0))
+		return -1;
+
+	/* defs_of holds, per register, the set of its definitions. */
+	defs = malloc((nr + 1) * sizeof(*defs));
+	defs_of = calloc((size_t)nr_registers * df->nr_words + 1, sizeof(*defs_of));
+	last = malloc((nr_registers + 1) * sizeof(*last));
+	if (!defs || !defs_of || !last)
+		goto fail;
+
+	for (b = 0, nr = 0; b < graph->nr_blocks; b++) {
+		bina_for_each_hot_block_instruction(graph, b, i) {
+			for (r = 0; r < nr_registers; r++) {
+				if (!(ctx->instructions[i].defs & (1 << r)))
+					continue;
+
+				defs[nr].instruction = i;
+				defs[nr].reg = r;
+				bina_bit_set(&defs_of[r * df->nr_words], nr);
+				nr++;
+			}
+		}
+	}
+
+	/* A block generates the last definition of each register it writes,
+	 * and kills every other definition of those registers. */
+	for (b = 0, nr = 0; b < graph->nr_blocks; b++) {
+		unsigned long *gen = bina_dataflow_set(df, df->gen, b);
+		unsigned long *kill = bina_dataflow_set(df, df->kill, b);
+		unsigned int written = 0;
+
+		for (r = 0; r < nr_registers; r++) {
+			last[r] = BINA_NO_INDEX;
+		}
+
+		bina_for_each_hot_block_instruction(graph, b, i) {
+			for (r = 0; r < nr_registers; r++) {
+				if (ctx->instructions[i].defs & (1 << r))
+					last[r] = nr++;
+			}
+
+			written |= ctx->instructions[i].defs;
+		}
+
+		for (r = 0; r < nr_registers; r++) {
+			if (!(written & (1 << r)))
+				continue;
+
+			for (w = 0; w < df->nr_words; w++) {
+				kill[w] |= defs_of[r * df->nr_words + w];
+			}
+
+			bina_bit_set(gen, last[r]);
+		}
+	}
+
+	if (bina_dataflow_solve(df))
+		goto fail;
+
+	free(defs_of);
+	free(last);
+	*definitions = defs;
+	*nr_definitions = nr;
+	return 0;
+
+fail:
+	bina_dataflow_destroy(df);
+	free(defs);
+	free(defs_of);
+	free(last);
+	return -1;
+}
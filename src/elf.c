@@ -0,0 +1,315 @@
+#include <bina.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Everything here reads the mapped image in place.  Sections become
+ * contexts over their bytes in the mapping, and names point straight
+ * into the string tables, so nothing is copied out of the file. */
+
+static Elf32_Shdr *section_header(struct bina_elf *elf, unsigned int index)
+{
+	Elf32_Ehdr *ehdr = (Elf32_Ehdr *)elf->image;
+
+	if (index >= ehdr->e_shnum)
+		return NULL;
+
+	return (Elf32_Shdr *)(elf->image + ehdr->e_shoff + index * ehdr->e_shentsize);
+}
+
+/* Only accept a section whose contents lie inside the mapping. */
+static int section_in_image(struct bina_elf *elf, Elf32_Shdr *shdr)
+{
+	if (shdr->sh_type == SHT_NOBITS)
+		return 0;
+
+	return shdr->sh_offset <= elf->size && shdr->sh_size <= elf->size - shdr->sh_offset;
+}
+
+/* Look up a name in a string table, refusing anything that isn't
+ * terminated inside the table. */
+static const char *string_at(struct bina_elf *elf, Elf32_Shdr *strtab, unsigned int index)
+{
+	const char *table;
+
+	if (!strtab || !section_in_image(elf, strtab) || index >= strtab->sh_size)
+		return NULL;
+
+	table = elf->image + strtab->sh_offset;
+	if (!memchr(table + index, 0, strtab->sh_size - index))
+		return NULL;
+
+	return table + index;
+}
+
+static int check_header(struct bina_elf *elf)
+{
+	Elf32_Ehdr *ehdr = (Elf32_Ehdr *)elf->image;
+
+	if (elf->size < sizeof(*ehdr) || memcmp(ehdr->e_ident, ELFMAG, SELFMAG))
+		return -1;
+
+	/* Only 32-bit little-endian images, to match the decoders we have. */
+	if (ehdr->e_ident[EI_CLASS] != ELFCLASS32 || ehdr->e_ident[EI_DATA] != ELFDATA2LSB)
+		return -1;
+
+	if (ehdr->e_shentsize != sizeof(Elf32_Shdr))
+		return -1;
+
+	if (ehdr->e_shoff > elf->size ||
+			(size_t)ehdr->e_shnum * ehdr->e_shentsize > elf->size - ehdr->e_shoff)
+		return -1;
+
+	return 0;
+}
+
+static struct bina_elf_section *section_for_index(struct bina_elf *elf, unsigned int index)
+{
+	unsigned int i;
+
+	for (i = 0; i < elf->nr_sections; i++) {
+		if (elf->sections[i].index == index)
+			return &elf->sections[i];
+	}
+
+	return NULL;
+}
+
+static int compare_symbols(const void *a, const void *b)
+{
+	const struct bina_symbol *x = a, *y = b;
+
+	return (x->address > y->address) - (x->address < y->address);
+}
+
+/* Collect the function symbols that land in an executable section.  The
+ * full symbol table is preferred, falling back to the dynamic one for
+ * stripped binaries. */
+static int load_symbols(struct bina_elf *elf)
+{
+	Elf32_Ehdr *ehdr = (Elf32_Ehdr *)elf->image;
+	Elf32_Shdr *symtab = NULL, *strtab, *shdr;
+	unsigned int i, nr;
+
+	for (i = 0; i < ehdr->e_shnum; i++) {
+		shdr = section_header(elf, i);
+
+		if (shdr->sh_type == SHT_SYMTAB) {
+			symtab = shdr;
+			break;
+		}
+
+		if (shdr->sh_type == SHT_DYNSYM && !symtab)
+			symtab = shdr;
+	}
+
+	if (!symtab || !section_in_image(elf, symtab) || symtab->sh_entsize != sizeof(Elf32_Sym))
+		return 0;
+
+	strtab = section_header(elf, symtab->sh_link);
+	nr = symtab->sh_size / sizeof(Elf32_Sym);
+
+	elf->symbols = calloc(nr, sizeof(*elf->symbols));
+	if (nr && !elf->symbols)
+		return -1;
+
+	for (i = 0; i < nr; i++) {
+		Elf32_Sym *sym = (Elf32_Sym *)(elf->image + symtab->sh_offset) + i;
+		struct bina_elf_section *section;
+		struct bina_symbol *symbol;
+
+		if (ELF32_ST_TYPE(sym->st_info) != STT_FUNC)
+			continue;
+
+		section = section_for_index(elf, sym->st_shndx);
+		if (!section || sym->st_value < section->address ||
+				sym->st_value - section->address >= section->size)
+			continue;
+
+		symbol = &elf->symbols[elf->nr_symbols++];
+		symbol->name = string_at(elf, strtab, sym->st_name);
+		symbol->address = sym->st_value;
+		symbol->size = sym->st_size;
+		symbol->section = section;
+		symbol->offset = sym->st_value - section->address;
+	}
+
+	qsort(elf->symbols, elf->nr_symbols, sizeof(*elf->symbols), compare_symbols);
+	return 0;
+}
+
+static int load_sections(struct bina_elf *elf)
+{
+	Elf32_Ehdr *ehdr = (Elf32_Ehdr *)elf->image;
+	Elf32_Shdr *shstrtab = section_header(elf, ehdr->e_shstrndx);
+	unsigned int i, nr = 0;
+
+	for (i = 0; i < ehdr->e_shnum; i++) {
+		Elf32_Shdr *shdr = section_header(elf, i);
+
+		if ((shdr->sh_flags & SHF_EXECINSTR) && shdr->sh_size && section_in_image(elf, shdr))
+			nr++;
+	}
+
+	elf->sections = calloc(nr, sizeof(*elf->sections));
+	if (nr && !elf->sections)
+		return -1;
+
+	/* Every section that's loaded is somewhere the code might read
+	 * from, such as a jump table in read-only data. */
+	elf->regions = calloc(ehdr->e_shnum + 1, sizeof(*elf->regions));
+	if (!elf->regions)
+		return -1;
+
+	for (i = 0; i < ehdr->e_shnum; i++) {
+		Elf32_Shdr *shdr = section_header(elf, i);
+		struct bina_elf_section *section;
+
+		if ((shdr->sh_flags & SHF_ALLOC) && shdr->sh_size && section_in_image(elf, shdr)) {
+			struct bina_region *region = &elf->regions[elf->nr_regions++];
+
+			region->address = shdr->sh_addr;
+			region->base = elf->image + shdr->sh_offset;
+			region->size = shdr->sh_size;
+		}
+
+		if (!(shdr->sh_flags & SHF_EXECINSTR) || !shdr->sh_size || !section_in_image(elf, shdr))
+			continue;
+
+		section = &elf->sections[elf->nr_sections++];
+		section->name = string_at(elf, shstrtab, shdr->sh_name);
+		section->index = i;
+		section->address = shdr->sh_addr;
+		section->base = elf->image + shdr->sh_offset;
+		section->size = shdr->sh_size;
+	}
+
+	return 0;
+}
+
+/* Gather the entry points in a section: the ELF entry point and every
+ * function symbol inside it. */
+static unsigned int section_entries(struct bina_elf *elf, struct bina_elf_section *section, unsigned int *entries)
+{
+	unsigned int i, nr = 0;
+
+	if (elf->entry >= section->address && elf->entry - section->address < section->size)
+		entries[nr++] = elf->entry - section->address;
+
+	for (i = 0; i < elf->nr_symbols; i++) {
+		if (elf->symbols[i].section == section)
+			entries[nr++] = elf->symbols[i].offset;
+	}
+
+	return nr;
+}
+
+static int create_contexts(struct bina_elf *elf, const struct bina_arch *arch, unsigned int flags)
+{
+	unsigned int *entries, i, nr;
+
+	entries = calloc(elf->nr_symbols + 1, sizeof(*entries));
+	if (!entries)
+		return -1;
+
+	for (i = 0; i < elf->nr_sections; i++) {
+		struct bina_elf_section *section = &elf->sections[i];
+
+		nr = section_entries(elf, section, entries);
+
+		if (flags & BINA_RECURSIVE) {
+			section->ctx = bina_create_recursive(arch, section->base, section->size, flags, entries, nr);
+		} else {
+			/* The entries still seed function discovery. */
+			section->ctx = bina_create_flags(arch, section->base, section->size, flags);
+			if (section->ctx && bina_set_entries(section->ctx, entries, nr)) {
+				bina_destroy(section->ctx);
+				section->ctx = NULL;
+			}
+		}
+
+		if (!section->ctx) {
+			free(entries);
+			return -1;
+		}
+
+		section->ctx->load_address = section->address;
+		section->ctx->regions = elf->regions;
+		section->ctx->nr_regions = elf->nr_regions;
+	}
+
+	free(entries);
+	return 0;
+}
+
+struct bina_elf *bina_open_elf(const struct bina_arch *arch, const char *path, unsigned int flags)
+{
+	struct bina_elf *elf;
+	struct stat st;
+	int fd;
+
+	if (!arch || !path)
+		return NULL;
+
+	elf = calloc(1, sizeof(*elf));
+	if (!elf)
+		return NULL;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		free(elf);
+		return NULL;
+	}
+
+	if (fstat(fd, &st) || !st.st_size) {
+		close(fd);
+		free(elf);
+		return NULL;
+	}
+
+	/* Writable but private, so sections can be patched in place without
+	 * the edits reaching the file. */
+	elf->size = st.st_size;
+	elf->image = mmap(NULL, elf->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (elf->image == MAP_FAILED) {
+		free(elf);
+		return NULL;
+	}
+
+	if (check_header(elf))
+		goto fail;
+
+	elf->entry = ((Elf32_Ehdr *)elf->image)->e_entry;
+
+	if (load_sections(elf) || load_symbols(elf) || create_contexts(elf, arch, flags))
+		goto fail;
+
+	return elf;
+
+fail:
+	bina_close_elf(elf);
+	return NULL;
+}
+
+void bina_close_elf(struct bina_elf *elf)
+{
+	unsigned int i;
+
+	for (i = 0; i < elf->nr_sections; i++) {
+		if (elf->sections[i].ctx)
+			bina_destroy(elf->sections[i].ctx);
+	}
+
+	free(elf->sections);
+	free(elf->symbols);
+	free(elf->regions);
+	munmap(elf->image, elf->size);
+	free(elf);
+}
@@ -0,0 +1,551 @@
+#include <bina.h>
+#include <malloc.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int compare_offsets(const void *a, const void *b)
+{
+	unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Function entries are the context's entry points, such as symbols,
+ * plus the target of every direct call.  Only the instructions
+ * themselves are scanned; no blocks are built here. */
+int bina_discover_functions(struct bina_context *ctx)
+{
+	unsigned int *offsets, nr = 0, i, n;
+
+	if (ctx->functions)
+		return 0;
+
+	/* Function graphs follow jump tables, and can be built on several
+	 * threads at once, so find the tables now. */
+	if (bina_resolve_jump_tables(ctx))
+		return -1;
+
+	offsets = malloc((ctx->nr_entries + ctx->nr_instructions) * sizeof(*offsets));
+	if (!offsets && (ctx->nr_entries + ctx->nr_instructions))
+		return -1;
+
+	for (i = 0; i < ctx->nr_entries; i++) {
+		if (bina_instruction_at(ctx, ctx->entries[i]))
+			offsets[nr++] = ctx->entries[i];
+	}
+
+	for (i = 0; i < ctx->nr_instructions; i++) {
+		struct bina_instruction *ins = &ctx->instructions[i];
+
+		if (ins->type == IT_CALL && bina_instruction_at(ctx, ins->branch_target_offset))
+			offsets[nr++] = ins->branch_target_offset;
+	}
+
+	qsort(offsets, nr, sizeof(*offsets), compare_offsets);
+
+	/* Drop the duplicates. */
+	for (i = 0, n = 0; i < nr; i++) {
+		if (n == 0 || offsets[i] != offsets[n - 1])
+			offsets[n++] = offsets[i];
+	}
+
+	ctx->functions = bina_arena_alloc(&ctx->function_arena, n, sizeof(*ctx->functions));
+	if (!ctx->functions && n) {
+		free(offsets);
+		return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		ctx->functions[i].context = ctx;
+		ctx->functions[i].index = i;
+		ctx->functions[i].offset = offsets[i];
+	}
+
+	ctx->nr_functions = n;
+	free(offsets);
+	return 0;
+}
+
+struct bina_function *bina_function_at(struct bina_context *ctx, unsigned int offset)
+{
+	unsigned int low = 0, high = ctx->nr_functions;
+
+	while (low < high) {
+		unsigned int mid = low + (high - low) / 2;
+
+		if (ctx->functions[mid].offset == offset)
+			return &ctx->functions[mid];
+
+		if (ctx->functions[mid].offset < offset)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return NULL;
+}
+
+/* Scratch state for building one function.  Everything here is sized by
+ * the function, not the section. */
+struct function_build {
+	struct bina_function *fn;
+	struct bina_context *ctx;
+
+	/* Open addressing set of the instruction indices reached so far,
+	 * holding index + 1 so that zero means empty. */
+	unsigned int *seen;
+	unsigned int seen_mask, nr_seen;
+
+	/* The same indices, in the order they were reached, then sorted. */
+	unsigned int *reached;
+	unsigned int nr_reached, max_reached;
+
+	unsigned int *stack;
+	unsigned int nr_stack, max_stack;
+
+	unsigned int *calls;
+	unsigned int nr_calls, max_calls;
+};
+
+static int append(unsigned int **array, unsigned int *nr, unsigned int *max, unsigned int value)
+{
+	if (*nr == *max) {
+		unsigned int capacity = *max ? *max * 2 : 64;
+		unsigned int *grown = realloc(*array, capacity * sizeof(*grown));
+
+		if (!grown)
+			return -1;
+
+		*array = grown;
+		*max = capacity;
+	}
+
+	(*array)[(*nr)++] = value;
+	return 0;
+}
+
+static inline unsigned int hash_index(unsigned int index)
+{
+	return index * 2654435761u;
+}
+
+static int grow_seen(struct function_build *build)
+{
+	unsigned int mask = build->seen_mask ? build->seen_mask * 2 + 1 : 255;
+	unsigned int *seen = calloc(mask + 1, sizeof(*seen));
+	unsigned int i, slot;
+
+	if (!seen)
+		return -1;
+
+	for (i = 0; i < build->nr_reached; i++) {
+		slot = hash_index(build->reached[i]) & mask;
+		while (seen[slot])
+			slot = (slot + 1) & mask;
+
+		seen[slot] = build->reached[i] + 1;
+	}
+
+	free(build->seen);
+	build->seen = seen;
+	build->seen_mask = mask;
+	return 0;
+}
+
+/* Returns one if the index is new, zero if it was already reached. */
+static int reach(struct function_build *build, unsigned int index)
+{
+	unsigned int slot;
+
+	if ((build->nr_seen + 1) * 2 > build->seen_mask + 1 && grow_seen(build))
+		return -1;
+
+	slot = hash_index(index) & build->seen_mask;
+	while (build->seen[slot]) {
+		if (build->seen[slot] == index + 1)
+			return 0;
+
+		slot = (slot + 1) & build->seen_mask;
+	}
+
+	if (append(&build->reached, &build->nr_reached, &build->max_reached, index))
+		return -1;
+
+	build->seen[slot] = index + 1;
+	build->nr_seen++;
+	return 1;
+}
+
+/* The instruction a branch lands on, if it's inside this function.  A
+ * branch to some other function's entry is a tail call, not an edge. */
+static struct bina_instruction *local_target(struct function_build *build, struct bina_instruction *ins)
+{
+	struct bina_instruction *target = bina_instruction_at(build->ctx, ins->branch_target_offset);
+
+	if (!target || (target->offset != build->fn->offset && bina_function_at(build->ctx, target->offset)))
+		return NULL;
+
+	return target;
+}
+
+/* Likewise for entry n of a jump table. */
+static struct bina_instruction *table_target(struct function_build *build, struct bina_jump_table *table, unsigned int n)
+{
+	struct bina_instruction *target = bina_instruction_at(build->ctx, table->targets[n]);
+
+	if (target->offset != build->fn->offset && bina_function_at(build->ctx, target->offset))
+		return NULL;
+
+	return target;
+}
+
+static int falls_through(struct bina_instruction *ins)
+{
+	return ins->type != IT_RETURN && ins->type != IT_U_BRANCH;
+}
+
+/* Does ins run straight on into the next instruction in the array? */
+static struct bina_instruction *adjacent_next(struct bina_instruction *ins)
+{
+	struct bina_instruction *next = ins->next;
+
+	if (!next || ins->offset + ins->size != next->offset)
+		return NULL;
+
+	return next;
+}
+
+/* Walk everything reachable from the entry without following calls.
+ * Calls are recorded, and don't end the walk. */
+static int explore(struct function_build *build)
+{
+	struct bina_context *ctx = build->ctx;
+	struct bina_instruction *ins, *target;
+	unsigned int n;
+	int rc;
+
+	ins = bina_instruction_at(ctx, build->fn->offset);
+	if (!ins || append(&build->stack, &build->nr_stack, &build->max_stack, ins->index))
+		return -1;
+
+	while (build->nr_stack) {
+		ins = &ctx->instructions[build->stack[--build->nr_stack]];
+
+		while (ins) {
+			rc = reach(build, ins->index);
+			if (rc < 0)
+				return -1;
+
+			if (!rc)
+				break;
+
+			switch (ins->type) {
+			case IT_CALL:
+				if (append(&build->calls, &build->nr_calls, &build->max_calls, ins->index))
+					return -1;
+				break;
+			case IT_U_BRANCH:
+			case IT_C_BRANCH:
+				target = local_target(build, ins);
+				if (target && append(&build->stack, &build->nr_stack, &build->max_stack, target->index))
+					return -1;
+
+				for (n = 0; ins->jump_table && n < ins->jump_table->nr_targets; n++) {
+					target = table_target(build, ins->jump_table, n);
+					if (target && append(&build->stack, &build->nr_stack, &build->max_stack, target->index))
+						return -1;
+				}
+				break;
+			default:
+				break;
+			}
+
+			if (!falls_through(ins))
+				break;
+
+			/* Running into another function's entry ends this one. */
+			ins = adjacent_next(ins);
+			if (ins && bina_function_at(ctx, ins->offset))
+				break;
+		}
+	}
+
+	qsort(build->reached, build->nr_reached, sizeof(*build->reached), compare_offsets);
+	return 0;
+}
+
+/* The position of an instruction index in the sorted reached list. */
+static unsigned int position_of(struct function_build *build, unsigned int index)
+{
+	unsigned int low = 0, high = build->nr_reached;
+
+	while (low < high) {
+		unsigned int mid = low + (high - low) / 2;
+
+		if (build->reached[mid] < index)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return (low < build->nr_reached && build->reached[low] == index) ? low : BINA_NO_INDEX;
+}
+
+/* Fill in targets and kinds for the edges leaving block b, returning how
+ * many there are.  Taken edges come first, as in the section graph. */
+static unsigned int function_block_edges(struct function_build *build, unsigned int *block_of, struct bina_hot_block *block,
+	unsigned int *targets, unsigned char *kinds)
+{
+	struct bina_context *ctx = build->ctx;
+	unsigned int last_index = block->first_instruction + block->nr_instructions - 1;
+	struct bina_instruction *last = &ctx->instructions[last_index];
+	struct bina_instruction *target, *next;
+	unsigned int pos, n, nr = 0;
+
+	if (last->type == IT_U_BRANCH || last->type == IT_C_BRANCH) {
+		target = local_target(build, last);
+		pos = target ? position_of(build, target->index) : BINA_NO_INDEX;
+
+		if (pos != BINA_NO_INDEX) {
+			targets[nr] = block_of[pos];
+			kinds[nr] = EK_TAKEN;
+			nr++;
+		}
+	}
+
+	for (n = 0; last->jump_table && n < last->jump_table->nr_targets; n++) {
+		target = table_target(build, last->jump_table, n);
+		pos = target ? position_of(build, target->index) : BINA_NO_INDEX;
+
+		if (pos != BINA_NO_INDEX) {
+			targets[nr] = block_of[pos];
+			kinds[nr] = EK_TAKEN;
+			nr++;
+		}
+	}
+
+	if (falls_through(last)) {
+		next = adjacent_next(last);
+		pos = next ? position_of(build, next->index) : BINA_NO_INDEX;
+
+		if (pos != BINA_NO_INDEX) {
+			targets[nr] = block_of[pos];
+			kinds[nr] = EK_FALLTHROUGH;
+			nr++;
+		}
+	}
+
+	return nr;
+}
+
+/* Split the reached instructions into blocks and link them up.  Calls
+ * don't end blocks here, since they return to the next instruction. */
+static int build_graph(struct function_build *build, struct bina_function *out)
+{
+	struct bina_context *ctx = build->ctx;
+	unsigned int *block_of, *nr_preds;
+	unsigned char *leader, *kinds;
+	unsigned int *targets, i, n, nr, b, succ_pos, pred_pos, max_edges = 2;
+	int rc = -1;
+
+	for (i = 0; i < ctx->nr_jump_tables; i++) {
+		if (ctx->jump_tables[i].nr_targets + 2 > max_edges)
+			max_edges = ctx->jump_tables[i].nr_targets + 2;
+	}
+
+	block_of = calloc(build->nr_reached, sizeof(*block_of));
+	leader = calloc(build->nr_reached, sizeof(*leader));
+	targets = malloc(max_edges * sizeof(*targets));
+	kinds = malloc(max_edges * sizeof(*kinds));
+	if (!block_of || !leader || !targets || !kinds)
+		goto out;
+
+	leader[0] = 1;
+	for (i = 0; i < build->nr_reached; i++) {
+		struct bina_instruction *ins = &ctx->instructions[build->reached[i]];
+		struct bina_instruction *target;
+		unsigned int pos;
+
+		/* Something not reached by running on from the instruction
+		 * before it starts a block. */
+		if (i > 0 && (build->reached[i - 1] + 1 != build->reached[i] ||
+				!adjacent_next(&ctx->instructions[build->reached[i - 1]])))
+			leader[i] = 1;
+
+		if (ins->offset == build->fn->offset)
+			leader[i] = 1;
+
+		if (ins->type == IT_U_BRANCH || ins->type == IT_C_BRANCH || ins->type == IT_RETURN) {
+			if (i + 1 < build->nr_reached)
+				leader[i + 1] = 1;
+
+			target = (ins->type != IT_RETURN) ? local_target(build, ins) : NULL;
+			pos = target ? position_of(build, target->index) : BINA_NO_INDEX;
+			if (pos != BINA_NO_INDEX)
+				leader[pos] = 1;
+
+			for (n = 0; ins->jump_table && n < ins->jump_table->nr_targets; n++) {
+				target = table_target(build, ins->jump_table, n);
+				pos = target ? position_of(build, target->index) : BINA_NO_INDEX;
+				if (pos != BINA_NO_INDEX)
+					leader[pos] = 1;
+			}
+		}
+	}
+
+	for (i = 0; i < build->nr_reached; i++) {
+		if (leader[i])
+			out->nr_blocks++;
+	}
+
+	out->blocks = calloc(out->nr_blocks, sizeof(*out->blocks));
+	if (!out->blocks)
+		goto out;
+
+	for (i = 0, b = 0; i < build->nr_reached; i++) {
+		struct bina_instruction *ins = &ctx->instructions[build->reached[i]];
+
+		if (leader[i]) {
+			b++;
+			out->blocks[b - 1].offset = ins->offset;
+			out->blocks[b - 1].first_instruction = ins->index;
+		}
+
+		out->blocks[b - 1].nr_instructions++;
+		block_of[i] = b - 1;
+	}
+
+	/* Pass one counts the edges in each direction, pass two fills them
+	 * in, as for the section graph. */
+	nr_preds = calloc(out->nr_blocks, sizeof(*nr_preds));
+	if (!nr_preds)
+		goto out;
+
+	for (b = 0; b < out->nr_blocks; b++) {
+		nr = function_block_edges(build, block_of, &out->blocks[b], targets, kinds);
+		for (n = 0; n < nr; n++) {
+			nr_preds[targets[n]]++;
+		}
+
+		out->nr_edges += nr;
+	}
+
+	out->successors = calloc(out->nr_edges + 1, sizeof(*out->successors));
+	out->successor_kinds = calloc(out->nr_edges + 1, sizeof(*out->successor_kinds));
+	out->predecessors = calloc(out->nr_edges + 1, sizeof(*out->predecessors));
+	out->predecessor_kinds = calloc(out->nr_edges + 1, sizeof(*out->predecessor_kinds));
+	if (!out->successors || !out->successor_kinds || !out->predecessors || !out->predecessor_kinds) {
+		free(nr_preds);
+		goto out;
+	}
+
+	pred_pos = 0;
+	for (b = 0; b < out->nr_blocks; b++) {
+		out->blocks[b].first_predecessor = pred_pos;
+		pred_pos += nr_preds[b];
+	}
+
+	succ_pos = 0;
+	for (b = 0; b < out->nr_blocks; b++) {
+		struct bina_hot_block *block = &out->blocks[b];
+
+		nr = function_block_edges(build, block_of, block, targets, kinds);
+
+		block->first_successor = succ_pos;
+		block->nr_successors = nr;
+
+		for (n = 0; n < nr; n++) {
+			struct bina_hot_block *target = &out->blocks[targets[n]];
+			unsigned int e = target->first_predecessor + target->nr_predecessors++;
+
+			out->successors[succ_pos + n] = targets[n];
+			out->successor_kinds[succ_pos + n] = kinds[n];
+			out->predecessors[e] = b;
+			out->predecessor_kinds[e] = kinds[n];
+		}
+
+		succ_pos += nr;
+	}
+
+	free(nr_preds);
+	rc = 0;
+
+out:
+	free(block_of);
+	free(leader);
+	free(targets);
+	free(kinds);
+	return rc;
+}
+
+static void free_graph(struct bina_function *out)
+{
+	free(out->blocks);
+	free(out->successors);
+	free(out->successor_kinds);
+	free(out->predecessors);
+	free(out->predecessor_kinds);
+}
+
+static void *publish(struct bina_context *ctx, void *data, unsigned int nr, size_t size)
+{
+	void *copy = bina_arena_alloc(&ctx->function_arena, nr, size);
+
+	if (copy && nr)
+		memcpy(copy, data, nr * size);
+
+	return copy;
+}
+
+/* Build a function's blocks and edges, if that hasn't been done already.
+ * Different functions can be built at the same time on different
+ * threads; all the work happens on private scratch memory, and only the
+ * final copy into the context takes its lock. */
+int bina_build_function(struct bina_function *fn)
+{
+	struct bina_context *ctx = fn->context;
+	struct function_build build = { .fn = fn, .ctx = ctx };
+	struct bina_function out;
+	int rc = -1;
+
+	if (__atomic_load_n(&fn->built, __ATOMIC_ACQUIRE))
+		return 0;
+
+	memset(&out, 0, sizeof(out));
+
+	if (explore(&build) || build_graph(&build, &out))
+		goto out;
+
+	pthread_mutex_lock(&ctx->lock);
+
+	if (__atomic_load_n(&fn->built, __ATOMIC_RELAXED)) {
+		rc = 0;
+	} else {
+		fn->blocks = publish(ctx, out.blocks, out.nr_blocks, sizeof(*out.blocks));
+		fn->successors = publish(ctx, out.successors, out.nr_edges, sizeof(*out.successors));
+		fn->successor_kinds = publish(ctx, out.successor_kinds, out.nr_edges, sizeof(*out.successor_kinds));
+		fn->predecessors = publish(ctx, out.predecessors, out.nr_edges, sizeof(*out.predecessors));
+		fn->predecessor_kinds = publish(ctx, out.predecessor_kinds, out.nr_edges, sizeof(*out.predecessor_kinds));
+		fn->calls = publish(ctx, build.calls, build.nr_calls, sizeof(*build.calls));
+
+		if (fn->blocks && fn->successors && fn->successor_kinds && fn->predecessors &&
+				fn->predecessor_kinds && fn->calls) {
+			fn->nr_blocks = out.nr_blocks;
+			fn->nr_edges = out.nr_edges;
+			fn->nr_calls = build.nr_calls;
+
+			__atomic_store_n(&fn->built, 1, __ATOMIC_RELEASE);
+			rc = 0;
+		}
+	}
+
+	pthread_mutex_unlock(&ctx->lock);
+
+out:
+	free_graph(&out);
+	free(build.seen);
+	free(build.reached);
+	free(build.stack);
+	free(build.calls);
+	return rc;
+}
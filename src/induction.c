@@ -0,0 +1,467 @@
+#include <bina.h>
+#include <malloc.h>
+#include <string.h>
+
+/* How far back from a loop's entry to look for the induction variable's
+ * starting value, following blocks with a single predecessor. */
+#define MAX_INIT_BLOCKS		8
+
+struct trip_work {
+	struct bina_context *ctx;
+	struct bina_loop_forest *forest;
+
+	/* Per block: how many of the current loop's back edges it
+	 * dominates the source of, valid where stamp is the loop plus one. */
+	unsigned int *stamp;
+	unsigned int *hits;
+};
+
+static int in_loop(struct bina_loop_forest *forest, unsigned int l, unsigned int b)
+{
+	unsigned int x;
+
+	for (x = forest->block_loops[b]; x != BINA_NO_INDEX; x = forest->loops[x].parent) {
+		if (x == l)
+			return 1;
+	}
+
+	return 0;
+}
+
+static int same_value(struct bina_value *a, struct bina_value *b)
+{
+	if (a->kind != b->kind)
+		return 0;
+
+	switch (a->kind) {
+	case VK_CONSTANT:
+		return a->constant == b->constant;
+	case VK_REGISTER:
+		return a->reg == b->reg;
+	case VK_MEMORY:
+		return a->reg == b->reg && a->constant == b->constant;
+	default:
+		return 0;
+	}
+}
+
+/* Might the instruction change v?  A word in memory also changes, as
+ * far as we can tell, when the register addressing it does.  Stores
+ * through other addresses are assumed not to alias it. */
+static int writes(struct bina_instruction *ins, struct bina_value *v)
+{
+	struct bina_arithmetic *a = &ins->arithmetic;
+
+	switch (v->kind) {
+	case VK_REGISTER:
+		return (ins->defs >> v->reg) & 1;
+	case VK_MEMORY:
+		if ((ins->defs >> v->reg) & 1)
+			return 1;
+
+		return a->operation != OP_COMPARE && same_value(&a->dst, v);
+	default:
+		return 0;
+	}
+}
+
+#define for_each_loop_instruction(w, loop, k, ins, n) \
+	for ((k) = (loop)->first_block; (k) < (loop)->first_block + (loop)->nr_blocks; (k)++) \
+		for ((n) = 0, (ins) = (w)->ctx->blocks[(w)->forest->blocks[k]].instructions; \
+			(n) < (w)->ctx->blocks[(w)->forest->blocks[k]].nr_instructions; (n)++, (ins)++)
+
+/* The only instruction in the loop that writes v, if there's exactly
+ * one, NULL otherwise. */
+static struct bina_instruction *only_write(struct trip_work *w, struct bina_loop *loop, struct bina_value *v)
+{
+	struct bina_instruction *ins, *found = NULL;
+	unsigned int k, n;
+
+	for_each_loop_instruction(w, loop, k, ins, n) {
+		if (!writes(ins, v))
+			continue;
+
+		if (found)
+			return NULL;
+
+		found = ins;
+	}
+
+	return found;
+}
+
+static int invariant(struct trip_work *w, struct bina_loop *loop, struct bina_value *v)
+{
+	struct bina_instruction *ins;
+	unsigned int k, n;
+
+	if (v->kind == VK_CONSTANT)
+		return 1;
+
+	if (v->kind == VK_NONE)
+		return 0;
+
+	for_each_loop_instruction(w, loop, k, ins, n) {
+		if (writes(ins, v))
+			return 0;
+	}
+
+	return 1;
+}
+
+/* Count, for every block, the back edges of loop l whose source it
+ * dominates.  Those dominating them all run on every iteration. */
+static void mark_every_iteration(struct trip_work *w, unsigned int l)
+{
+	struct bina_loop_forest *forest = w->forest;
+	struct bina_loop *loop = &forest->loops[l];
+	unsigned int e, x;
+
+	for (e = loop->first_back_edge; e < loop->first_back_edge + loop->nr_back_edges; e++) {
+		for (x = forest->back_edges[e].source; x != BINA_NO_INDEX; x = forest->dominators[x]) {
+			if (w->stamp[x] != l + 1) {
+				w->stamp[x] = l + 1;
+				w->hits[x] = 0;
+			}
+
+			w->hits[x]++;
+			if (x == loop->header)
+				break;
+		}
+	}
+}
+
+static int every_iteration(struct trip_work *w, unsigned int l, unsigned int b)
+{
+	return w->forest->block_loops[b] == l && w->stamp[b] == l + 1 &&
+		w->hits[b] == w->forest->loops[l].nr_back_edges;
+}
+
+static int decode_loop(struct trip_work *w, struct bina_loop *loop)
+{
+	struct bina_instruction *ins;
+	unsigned int k, n;
+
+	for_each_loop_instruction(w, loop, k, ins, n) {
+		if (bina_decode_operands(ins))
+			return -1;
+	}
+
+	return 0;
+}
+
+/* The opposite condition is the other one of its encoding pair. */
+static enum bina_condition negate(enum bina_condition c)
+{
+	return c == CC_NONE ? CC_NONE : ((c - CC_O) ^ 1) + CC_O;
+}
+
+/* The condition with the operands of the compare the other way round. */
+static enum bina_condition swap(enum bina_condition c)
+{
+	switch (c) {
+	case CC_E:	return CC_E;
+	case CC_NE:	return CC_NE;
+	case CC_B:	return CC_A;
+	case CC_AE:	return CC_BE;
+	case CC_BE:	return CC_AE;
+	case CC_A:	return CC_B;
+	case CC_L:	return CC_G;
+	case CC_GE:	return CC_LE;
+	case CC_LE:	return CC_GE;
+	case CC_G:	return CC_L;
+	default:	return CC_NONE;
+	}
+}
+
+/* Find where the variable starts: the last move into it before the loop,
+ * walking back from the single block that enters it. */
+static int find_init(struct trip_work *w, unsigned int l, struct bina_trip_count *tc)
+{
+	struct bina_context *ctx = w->ctx;
+	struct bina_basic_block *block = &ctx->blocks[w->forest->loops[l].header];
+	struct bina_basic_block *entry = NULL;
+	struct bina_instruction *ins;
+	unsigned int i, n;
+
+	tc->init = tc->variable;
+
+	for (i = 0; i < block->nr_predecessors; i++) {
+		if (in_loop(w->forest, l, block->predecessors[i]->index))
+			continue;
+
+		if (entry)
+			return 0;
+
+		entry = block->predecessors[i];
+	}
+
+	for (n = 0; entry && n < MAX_INIT_BLOCKS; n++) {
+		for (i = entry->nr_instructions; i-- > 0;) {
+			ins = &entry->instructions[i];
+
+			if (bina_decode_operands(ins))
+				return -1;
+
+			if (!writes(ins, &tc->variable))
+				continue;
+
+			if (ins->arithmetic.operation == OP_MOVE && same_value(&ins->arithmetic.dst, &tc->variable) &&
+					ins->arithmetic.src.kind != VK_NONE)
+				tc->init = ins->arithmetic.src;
+
+			return 0;
+		}
+
+		entry = entry->nr_predecessors == 1 ? entry->predecessors[0] : NULL;
+	}
+
+	return 0;
+}
+
+/* Work out how many times the variable is stepped, where init and bound
+ * are constants.  The test on iteration k sees x = a + step * k, and the
+ * loop leaves at the first k where the condition fails.  Conditions the
+ * variable would have to wrap around to fail give up. */
+static int count_trips(struct bina_trip_count *tc)
+{
+	long long a, bound, step = tc->step, limit, k;
+	int is_unsigned = 0;
+
+	switch (tc->condition) {
+	case CC_B:
+	case CC_AE:
+	case CC_BE:
+	case CC_A:
+		is_unsigned = 1;
+		break;
+	default:
+		break;
+	}
+
+	a = is_unsigned ? (long long)(unsigned int)tc->init.constant : tc->init.constant;
+	bound = is_unsigned ? (long long)(unsigned int)tc->bound.constant : tc->bound.constant;
+	a += step * tc->adjust;
+
+	switch (tc->condition) {
+	case CC_B:
+	case CC_L:
+		limit = bound;
+		goto below;
+	case CC_BE:
+	case CC_LE:
+		limit = bound + 1;
+below:
+		if (a >= limit)
+			k = 0;
+		else if (step > 0)
+			k = (limit - a + step - 1) / step;
+		else
+			return -1;
+		break;
+	case CC_A:
+	case CC_G:
+		limit = bound;
+		goto above;
+	case CC_AE:
+	case CC_GE:
+		limit = bound - 1;
+above:
+		if (a <= limit)
+			k = 0;
+		else if (step < 0)
+			k = (a - limit - step - 1) / -step;
+		else
+			return -1;
+		break;
+	case CC_NE:
+		if ((bound - a) % step || (bound - a) / step < 0)
+			return -1;
+
+		k = (bound - a) / step;
+		break;
+	case CC_E:
+		k = a == bound;
+		break;
+	default:
+		return -1;
+	}
+
+	/* Where the step comes before the test, the leaving iteration
+	 * steps too. */
+	tc->count = k + tc->adjust;
+	return 0;
+}
+
+/* Does the test compare a basic induction variable of loop l with
+ * something invariant?  update is the instruction setting the flags
+ * when the test reads them straight from the step. */
+static int try_variable(struct trip_work *w, unsigned int l, struct bina_trip_count *tc,
+	struct bina_value *variable, struct bina_value *bound, enum bina_condition condition,
+	struct bina_instruction *test, struct bina_instruction *compare, int from_update)
+{
+	struct bina_loop_forest *forest = w->forest;
+	struct bina_loop *loop = &forest->loops[l];
+	struct bina_instruction *update;
+	struct bina_arithmetic *a;
+	unsigned int x, b;
+
+	if (condition == CC_NONE || (variable->kind != VK_REGISTER && variable->kind != VK_MEMORY))
+		return 0;
+
+	update = only_write(w, loop, variable);
+	if (!update || (from_update && update != compare))
+		return 0;
+
+	a = &update->arithmetic;
+	if ((a->operation != OP_ADD && a->operation != OP_SUB) || !same_value(&a->dst, variable) ||
+			a->src.kind != VK_CONSTANT || !a->src.constant)
+		return 0;
+
+	b = update->basic_block->index;
+	if (!every_iteration(w, l, b) || !invariant(w, loop, bound))
+		return 0;
+
+	memset(tc, 0, sizeof(*tc));
+	tc->variable = *variable;
+	tc->bound = *bound;
+	tc->step = a->operation == OP_ADD ? a->src.constant : -a->src.constant;
+	tc->condition = condition;
+	tc->update = update->index;
+	tc->test = test->index;
+
+	/* Both run on every iteration, so one dominates the other. */
+	if (b == compare->basic_block->index) {
+		tc->adjust = update->index <= compare->index;
+	} else {
+		for (x = compare->basic_block->index; x != loop->header && x != b; x = forest->dominators[x])
+			;
+
+		tc->adjust = x == b;
+	}
+
+	if (find_init(w, l, tc))
+		return -1;
+
+	if (tc->init.kind != VK_CONSTANT || tc->bound.kind != VK_CONSTANT)
+		tc->kind = TK_SYMBOLIC;
+	else if (!count_trips(tc))
+		tc->kind = TK_CONSTANT;
+
+	return 1;
+}
+
+/* Try each conditional exit that's taken on every iteration, keeping a
+ * constant estimate over a symbolic one. */
+static int estimate_loop(struct trip_work *w, unsigned int l)
+{
+	struct bina_context *ctx = w->ctx;
+	struct bina_loop_forest *forest = w->forest;
+	struct bina_loop *loop = &forest->loops[l];
+	struct bina_trip_count *best = &forest->trip_counts[l], tc;
+	unsigned int e, i, flags = 1 << ctx->arch->flags_register;
+	int found = 0, rc;
+
+	if (decode_loop(w, loop))
+		return -1;
+
+	mark_every_iteration(w, l);
+
+	for (e = loop->first_exit; e < loop->first_exit + loop->nr_exits; e++) {
+		struct bina_basic_block *block = &ctx->blocks[forest->exits[e].source];
+		struct bina_basic_block *target = &ctx->blocks[forest->exits[e].target];
+		struct bina_instruction *test, *compare = NULL;
+		struct bina_arithmetic *a;
+		enum bina_condition condition;
+
+		if (!every_iteration(w, l, block->index))
+			continue;
+
+		test = &block->instructions[block->nr_instructions - 1];
+		if (test->type != IT_C_BRANCH || test->condition == CC_NONE ||
+				test->branch_target_offset == test->offset + test->size)
+			continue;
+
+		/* The loop carries on along the other edge. */
+		condition = target->offset == test->branch_target_offset ? negate(test->condition) : test->condition;
+
+		for (i = block->nr_instructions - 1; i-- > 0;) {
+			if (block->instructions[i].defs & flags) {
+				compare = &block->instructions[i];
+				break;
+			}
+		}
+
+		if (!compare)
+			continue;
+
+		a = &compare->arithmetic;
+		if (a->operation == OP_COMPARE) {
+			rc = try_variable(w, l, &tc, &a->dst, &a->src, condition, test, compare, 0);
+			if (!rc)
+				rc = try_variable(w, l, &tc, &a->src, &a->dst, swap(condition), test, compare, 0);
+		} else if ((a->operation == OP_ADD || a->operation == OP_SUB) &&
+				(condition == CC_E || condition == CC_NE)) {
+			/* dec %ecx; jnz, testing the stepped value against zero. */
+			struct bina_value zero = { .kind = VK_CONSTANT, .constant = 0 };
+
+			rc = try_variable(w, l, &tc, &a->dst, &zero, condition, test, compare, 1);
+		} else {
+			continue;
+		}
+
+		if (rc < 0)
+			return -1;
+
+		if (rc && (!found || tc.kind == TK_CONSTANT || (tc.kind == TK_SYMBOLIC && best->kind == TK_UNKNOWN))) {
+			*best = tc;
+			found = 1;
+		}
+
+		if (best->kind == TK_CONSTANT)
+			break;
+	}
+
+	return 0;
+}
+
+/* Estimate a trip count for every loop in the forest, analysing the
+ * loops first if need be.  Operands are decoded for the loops' code and
+ * the blocks leading into them.  Loops with no basic induction variable
+ * tested on every iteration are left TK_UNKNOWN. */
+int bina_estimate_trip_counts(struct bina_context *ctx)
+{
+	struct trip_work work = { .ctx = ctx };
+	struct bina_loop_forest *forest;
+	unsigned int l;
+	int rc = -1;
+
+	if (bina_analyse_loops(ctx))
+		return -1;
+
+	forest = ctx->loops;
+	if (forest->trip_counts)
+		return 0;
+
+	work.forest = forest;
+	work.stamp = calloc(ctx->nr_basic_blocks + 1, sizeof(*work.stamp));
+	work.hits = calloc(ctx->nr_basic_blocks + 1, sizeof(*work.hits));
+	forest->trip_counts = bina_arena_alloc(&ctx->loop_arena, forest->nr_loops, sizeof(*forest->trip_counts));
+	if (!work.stamp || !work.hits || !forest->trip_counts)
+		goto out;
+
+	for (l = 0; l < forest->nr_loops; l++) {
+		if (estimate_loop(&work, l))
+			goto out;
+	}
+
+	rc = 0;
+
+out:
+	if (rc)
+		forest->trip_counts = NULL;
+
+	free(work.stamp);
+	free(work.hits);
+	return rc;
+}
@@ -0,0 +1,175 @@
+#include <bina.h>
+#include <malloc.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Anything claiming more entries than this is taken to be a misread. */
+#define MAX_JUMP_TABLE_ENTRIES	65536
+
+/* Read a 32-bit little-endian word from the target's address space,
+ * looking in the context's own bytes first, then the rest of the image. */
+static int read_word(struct bina_context *ctx, unsigned long address, unsigned int *value)
+{
+	const unsigned char *p = NULL;
+	unsigned int i;
+
+	if (address >= ctx->load_address && ctx->size >= 4 && address - ctx->load_address <= ctx->size - 4)
+		p = (const unsigned char *)ctx->base + (address - ctx->load_address);
+
+	for (i = 0; !p && i < ctx->nr_regions; i++) {
+		const struct bina_region *region = &ctx->regions[i];
+
+		if (address >= region->address && region->size >= 4 && address - region->address <= region->size - 4)
+			p = (const unsigned char *)region->base + (address - region->address);
+	}
+
+	if (!p)
+		return -1;
+
+	*value = p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+	return 0;
+}
+
+static int compare_offsets(const void *a, const void *b)
+{
+	unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Read a table's entries into targets, sorted with the duplicates
+ * dropped.  The whole table is refused if any entry isn't the start of
+ * a decoded instruction, since then it's probably not a table at all. */
+static int read_table(struct bina_context *ctx, unsigned long address, unsigned int nr_entries,
+	unsigned int *targets, unsigned int *nr_targets)
+{
+	unsigned int i, n, value;
+
+	for (i = 0; i < nr_entries; i++) {
+		if (read_word(ctx, address + i * 4, &value) || value < ctx->load_address ||
+				value - ctx->load_address >= ctx->size)
+			return -1;
+
+		targets[i] = value - ctx->load_address;
+		if (!bina_instruction_at(ctx, targets[i]))
+			return -1;
+	}
+
+	qsort(targets, nr_entries, sizeof(*targets), compare_offsets);
+
+	for (i = 0, n = 0; i < nr_entries; i++) {
+		if (n == 0 || targets[i] != targets[n - 1])
+			targets[n++] = targets[i];
+	}
+
+	*nr_targets = n;
+	return 0;
+}
+
+/* A table found while scanning, with its targets kept as a position in
+ * the scratch array, which may still move. */
+struct found_table {
+	unsigned int instruction;
+	unsigned long address;
+	unsigned int nr_entries;
+	unsigned int first_target;
+	unsigned int nr_targets;
+};
+
+/* Find the indirect jumps that go through a jump table the architecture
+ * recognises, and read their targets out of the image.  Only jumps with
+ * no direct target are looked at.  This runs before the blocks or a
+ * function's graph are built, so switch statements get their real
+ * successors rather than none.  The tables live in their own arena, and
+ * are found again after a patch. */
+int bina_resolve_jump_tables(struct bina_context *ctx)
+{
+	struct found_table *found = NULL, *grown;
+	unsigned int *targets = NULL, *grown_targets, nr_found = 0, max_found = 0;
+	unsigned int nr_targets = 0, max_targets = 0, nr_entries, i, n;
+	unsigned long address;
+	int rc = -1;
+
+	if (ctx->jump_tables_resolved)
+		return 0;
+
+	for (i = 0; ctx->arch->jump_table && i < ctx->nr_instructions; i++) {
+		struct bina_instruction *ins = &ctx->instructions[i];
+
+		ins->jump_table = NULL;
+
+		if (ins->type != IT_U_BRANCH || bina_instruction_at(ctx, ins->branch_target_offset))
+			continue;
+
+		if (ctx->arch->jump_table(ins, &address, &nr_entries) || !nr_entries ||
+				nr_entries > MAX_JUMP_TABLE_ENTRIES)
+			continue;
+
+		if (nr_targets + nr_entries > max_targets) {
+			unsigned int capacity = max_targets ? max_targets * 2 : 1024;
+
+			while (capacity < nr_targets + nr_entries)
+				capacity *= 2;
+
+			grown_targets = realloc(targets, capacity * sizeof(*targets));
+			if (!grown_targets)
+				goto out;
+
+			targets = grown_targets;
+			max_targets = capacity;
+		}
+
+		if (read_table(ctx, address, nr_entries, &targets[nr_targets], &n))
+			continue;
+
+		if (nr_found == max_found) {
+			unsigned int capacity = max_found ? max_found * 2 : 64;
+
+			grown = realloc(found, capacity * sizeof(*grown));
+			if (!grown)
+				goto out;
+
+			found = grown;
+			max_found = capacity;
+		}
+
+		found[nr_found].instruction = i;
+		found[nr_found].address = address;
+		found[nr_found].nr_entries = nr_entries;
+		found[nr_found].first_target = nr_targets;
+		found[nr_found].nr_targets = n;
+		nr_found++;
+		nr_targets += n;
+	}
+
+	ctx->jump_tables = bina_arena_alloc(&ctx->jump_table_arena, nr_found, sizeof(*ctx->jump_tables));
+	grown_targets = bina_arena_alloc(&ctx->jump_table_arena, nr_targets, sizeof(*targets));
+	if (!ctx->jump_tables || !grown_targets) {
+		ctx->jump_tables = NULL;
+		goto out;
+	}
+
+	if (nr_targets)
+		memcpy(grown_targets, targets, nr_targets * sizeof(*targets));
+
+	for (i = 0; i < nr_found; i++) {
+		struct bina_jump_table *table = &ctx->jump_tables[i];
+
+		table->instruction = found[i].instruction;
+		table->address = found[i].address;
+		table->nr_entries = found[i].nr_entries;
+		table->targets = grown_targets + found[i].first_target;
+		table->nr_targets = found[i].nr_targets;
+
+		ctx->instructions[table->instruction].jump_table = table;
+	}
+
+	ctx->nr_jump_tables = nr_found;
+	ctx->jump_tables_resolved = 1;
+	rc = 0;
+
+out:
+	free(found);
+	free(targets);
+	return rc;
+}
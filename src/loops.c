@@ -1,63 +1,649 @@
 #include <bina.h>
-#include <stdio.h>
-
-static int process_for_loop(struct bina_basic_block *start, struct bina_basic_block *body, struct bina_basic_block *condition)
-{
-	struct bina_instruction *cmp = condition->instructions;
-	
-	printf("loop start block: %d\n", start->index);
-	printf("loop body block: %d\n", body->index);
-	printf("loop test block: %d\n", condition->index);
-	bina_print_instruction(cmp);
-	printf("\n");
-	//bina_print_instruction(cmp->next);
-	//printf("\n");
-	
-	if (cmp->type != IT_COMPARE) {
-		printf("loop test isn't a comparison - rejecting premise\n");
+#include <malloc.h>
+#include <string.h>
+
+struct loop_work {
+	struct bina_context *ctx;
+	struct bina_hot_graph *graph;
+	struct bina_loop_forest *forest;
+	unsigned int n;
+
+	/* Blocks the depth first walk starts from, before any others. */
+	unsigned int *roots;
+	unsigned int nr_roots;
+
+	/* Depth first numbering of the blocks.  Preorder numbers start at
+	 * one, leaving zero for the virtual root that every tree of the walk
+	 * hangs off, and by_pre and parent are indexed by them. */
+	unsigned int *pre, *post, *by_pre, *parent;
+	unsigned char *is_root;
+
+	/* Immediate dominators by preorder number, then the dominator tree's
+	 * own depth first numbering for constant time queries. */
+	unsigned int *idom;
+	unsigned int *dom_pre, *dom_post;
+
+	/* Scratch shared by the passes that need a stack or a count. */
+	unsigned int *stack, *next;
+};
+
+/* Walk the graph depth first from the roots, then from anything left
+ * over, so every block ends up numbered. */
+static void depth_first(struct loop_work *w)
+{
+	struct bina_hot_graph *g = w->graph;
+	unsigned int pre = 0, post = 0, nr_stack, k, r, b;
+
+	for (k = 0; k < w->nr_roots + g->nr_blocks; k++) {
+		r = k < w->nr_roots ? w->roots[k] : k - w->nr_roots;
+		if (w->pre[r])
+			continue;
+
+		w->is_root[r] = 1;
+		w->pre[r] = ++pre;
+		w->by_pre[pre] = r;
+		w->parent[pre] = 0;
+		w->next[r] = 0;
+		w->stack[0] = r;
+		nr_stack = 1;
+
+		while (nr_stack) {
+			struct bina_hot_block *block;
+
+			b = w->stack[nr_stack - 1];
+			block = &g->blocks[b];
+
+			if (w->next[b] < block->nr_successors) {
+				unsigned int s = g->successors[block->first_successor + w->next[b]++];
+
+				if (!w->pre[s]) {
+					w->pre[s] = ++pre;
+					w->by_pre[pre] = s;
+					w->parent[pre] = w->pre[b];
+					w->next[s] = 0;
+					w->stack[nr_stack++] = s;
+				}
+
+				continue;
+			}
+
+			nr_stack--;
+			w->post[b] = post++;
+		}
+	}
+}
+
+/* Path compression for eval(), without recursion since the paths can be
+ * as long as the graph.  The path is gathered first, then compressed
+ * from the top down. */
+static void compress(unsigned int *ancestor, unsigned int *label, unsigned int *semi, unsigned int *path, unsigned int v)
+{
+	unsigned int nr = 0, x, a;
+
+	for (x = v; ancestor[ancestor[x]] != BINA_NO_INDEX; x = ancestor[x])
+		path[nr++] = x;
+
+	while (nr) {
+		x = path[--nr];
+		a = ancestor[x];
+
+		if (semi[label[a]] < semi[label[x]])
+			label[x] = label[a];
+
+		ancestor[x] = ancestor[a];
+	}
+}
+
+static unsigned int eval(unsigned int *ancestor, unsigned int *label, unsigned int *semi, unsigned int *path, unsigned int v)
+{
+	if (ancestor[v] == BINA_NO_INDEX)
+		return v;
+
+	compress(ancestor, label, semi, path, v);
+	return label[v];
+}
+
+/* Lengauer and Tarjan's dominator algorithm, the simple version with
+ * path compression, over preorder numbers.  It's O(E log N) whatever
+ * the graph's shape, where the iterative algorithms can go quadratic on
+ * deep nests like generated code has. */
+static int find_dominators(struct loop_work *w)
+{
+	struct bina_hot_graph *g = w->graph;
+	unsigned int n = w->n, i, v, e, u, p, *semi, *ancestor, *label, *bucket, *bucket_next, *path;
+	int rc = -1;
+
+	semi = malloc((n + 1) * sizeof(*semi));
+	ancestor = malloc((n + 1) * sizeof(*ancestor));
+	label = malloc((n + 1) * sizeof(*label));
+	bucket = malloc((n + 1) * sizeof(*bucket));
+	bucket_next = malloc((n + 1) * sizeof(*bucket_next));
+	path = malloc((n + 1) * sizeof(*path));
+	if (!semi || !ancestor || !label || !bucket || !bucket_next || !path)
+		goto out;
+
+	for (i = 0; i <= n; i++) {
+		semi[i] = label[i] = i;
+		ancestor[i] = bucket[i] = BINA_NO_INDEX;
+		w->idom[i] = 0;
+	}
+
+	for (i = n; i >= 1; i--) {
+		unsigned int block = w->by_pre[i];
+
+		/* The virtual root is a predecessor of every tree root. */
+		if (w->is_root[block])
+			semi[i] = 0;
+
+		bina_for_each_hot_predecessor(g, block, e) {
+			u = eval(ancestor, label, semi, path, w->pre[g->predecessors[e]]);
+			if (semi[u] < semi[i])
+				semi[i] = semi[u];
+		}
+
+		bucket_next[i] = bucket[semi[i]];
+		bucket[semi[i]] = i;
+
+		p = w->parent[i];
+		ancestor[i] = p;
+
+		for (v = bucket[p]; v != BINA_NO_INDEX; v = bucket_next[v]) {
+			u = eval(ancestor, label, semi, path, v);
+			w->idom[v] = semi[u] < semi[v] ? u : p;
+		}
+
+		bucket[p] = BINA_NO_INDEX;
+	}
+
+	for (i = 1; i <= n; i++) {
+		if (w->idom[i] != semi[i])
+			w->idom[i] = w->idom[w->idom[i]];
+	}
+
+	rc = 0;
+
+out:
+	free(semi);
+	free(ancestor);
+	free(label);
+	free(bucket);
+	free(bucket_next);
+	free(path);
+	return rc;
+}
+
+/* Number the dominator tree depth first, so that dominance between any
+ * two blocks is an interval check. */
+static int number_dominator_tree(struct loop_work *w)
+{
+	unsigned int n = w->n, i, nr_stack, pre = 0, post = 0, *first, *children;
+
+	first = calloc(n + 2, sizeof(*first));
+	children = calloc(n + 1, sizeof(*children));
+	if (!first || !children) {
+		free(first);
+		free(children);
 		return -1;
 	}
-	
-	printf("%d %d\n", cmp->operands[0].type, cmp->operands[1].type);
-	printf("so, the upper bound might be: %d\n", cmp->operands[1].value.u32);
-	
+
+	for (i = 1; i <= n; i++) {
+		first[w->idom[i] + 1]++;
+	}
+
+	for (i = 0; i <= n; i++) {
+		first[i + 1] += first[i];
+		w->next[i] = 0;
+	}
+
+	for (i = 1; i <= n; i++) {
+		children[first[w->idom[i]] + w->next[w->idom[i]]++] = i;
+	}
+
+	for (i = 0; i <= n; i++) {
+		w->next[i] = 0;
+	}
+
+	w->stack[0] = 0;
+	nr_stack = 1;
+	w->dom_pre[0] = pre++;
+
+	while (nr_stack) {
+		unsigned int x = w->stack[nr_stack - 1];
+
+		if (first[x] + w->next[x] < first[x + 1]) {
+			unsigned int c = children[first[x] + w->next[x]++];
+
+			w->dom_pre[c] = pre++;
+			w->stack[nr_stack++] = c;
+			continue;
+		}
+
+		nr_stack--;
+		w->dom_post[x] = post++;
+	}
+
+	free(first);
+	free(children);
 	return 0;
 }
 
-static int find_for_loops(struct bina_context *ctx)
+static int dominates(struct loop_work *w, unsigned int a, unsigned int b)
 {
-	int i;
-	
-	for (i = 0; i < ctx->nr_basic_blocks; i++) {
-		struct bina_basic_block *block = &ctx->blocks[i];
-		
-		/* Not interested in conditional jumps. */
-		if (block->nr_successors != 1)
-			continue;
-		
-		/* Not interested in contigous blocks. */
-		if (block->successors[0] == block->next)
+	unsigned int x = w->pre[a], y = w->pre[b];
+
+	return w->dom_pre[x] <= w->dom_pre[y] && w->dom_post[y] <= w->dom_post[x];
+}
+
+/* Is a an ancestor of b in the depth first spanning tree?  An edge into
+ * an ancestor is a retreating edge. */
+static int ancestor(struct loop_work *w, unsigned int a, unsigned int b)
+{
+	return w->pre[a] <= w->pre[b] && w->post[b] <= w->post[a];
+}
+
+static unsigned int find(unsigned int *rep, unsigned int x)
+{
+	unsigned int root = x, next;
+
+	while (rep[root] != root)
+		root = rep[root];
+
+	while (rep[x] != root) {
+		next = rep[x];
+		rep[x] = root;
+		x = next;
+	}
+
+	return root;
+}
+
+/* Identify the loops, innermost first.  Headers are taken in decreasing
+ * preorder, so any loop nested in one is already done by the time it's
+ * reached.  Walking backwards from the back edges collects the body, and
+ * a finished inner loop is stepped over in one go by union-find through
+ * its header, so each block joins exactly one loop as its innermost and
+ * the whole forest costs about one pass over the edges.  back_edges and
+ * irreducible_edges have room for every edge. */
+static int find_loops(struct loop_work *w, struct bina_loop **loops, unsigned int *nr_loops,
+	struct bina_block_edge *back_edges, unsigned int *nr_back_edges,
+	struct bina_block_edge *irreducible_edges, unsigned int *nr_irreducible_edges)
+{
+	struct bina_hot_graph *g = w->graph;
+	struct bina_loop_forest *forest = w->forest;
+	unsigned int n = w->n, *rep, *stamp, *header_loop, *queue;
+	unsigned int k, b, h, e, u, x, nr_queue, max_loops = 0;
+	int rc = -1;
+
+	rep = malloc((n + 1) * sizeof(*rep));
+	stamp = calloc(n + 1, sizeof(*stamp));
+	header_loop = malloc((n + 1) * sizeof(*header_loop));
+	queue = malloc((n + 1) * sizeof(*queue));
+	if (!rep || !stamp || !header_loop || !queue)
+		goto out;
+
+	for (b = 0; b < n; b++) {
+		rep[b] = b;
+		header_loop[b] = BINA_NO_INDEX;
+		forest->block_loops[b] = BINA_NO_INDEX;
+	}
+
+	for (k = n; k >= 1; k--) {
+		struct bina_loop *loop;
+		unsigned int first_back_edge = *nr_back_edges, l;
+
+		h = w->by_pre[k];
+		nr_queue = 0;
+
+		bina_for_each_hot_predecessor(g, h, e) {
+			u = g->predecessors[e];
+
+			if (!ancestor(w, h, u))
+				continue;
+
+			if (!dominates(w, h, u)) {
+				irreducible_edges[*nr_irreducible_edges].source = u;
+				irreducible_edges[(*nr_irreducible_edges)++].target = h;
+				continue;
+			}
+
+			back_edges[*nr_back_edges].source = u;
+			back_edges[(*nr_back_edges)++].target = h;
+		}
+
+		if (*nr_back_edges == first_back_edge)
 			continue;
-		
-		/* Okay, we've got an interesting block. Check to see if the
-		 * successive block's successor is this block's next
-		 * block. :-O */
-		 
-		 /* No successor?  Not interested. */
-		 if (block->successors[0]->nr_successors == 0) {
-			 continue;
-		 }
-		 
-		 if (block->successors[0]->successors[0] == block->next) {
-			 printf("i think we've found a for-loop\n");
-			 process_for_loop(block, block->next, block->successors[0]);
-		 }
-	}
-	
+
+		if (*nr_loops == max_loops) {
+			unsigned int capacity = max_loops ? max_loops * 2 : 64;
+
+			loop = realloc(*loops, capacity * sizeof(*loop));
+			if (!loop)
+				goto out;
+
+			*loops = loop;
+			max_loops = capacity;
+		}
+
+		l = (*nr_loops)++;
+		loop = &(*loops)[l];
+		memset(loop, 0, sizeof(*loop));
+		loop->header = h;
+		loop->parent = BINA_NO_INDEX;
+		loop->first_back_edge = first_back_edge;
+		loop->nr_back_edges = *nr_back_edges - first_back_edge;
+
+		header_loop[h] = l;
+		forest->block_loops[h] = l;
+		stamp[h] = l + 1;
+
+		for (e = first_back_edge; e < *nr_back_edges; e++) {
+			x = find(rep, back_edges[e].source);
+
+			if (stamp[x] != l + 1) {
+				stamp[x] = l + 1;
+				queue[nr_queue++] = x;
+			}
+		}
+
+		while (nr_queue) {
+			x = queue[--nr_queue];
+			rep[x] = h;
+
+			if (header_loop[x] != BINA_NO_INDEX)
+				(*loops)[header_loop[x]].parent = l;
+			else
+				forest->block_loops[x] = l;
+
+			bina_for_each_hot_predecessor(g, x, e) {
+				u = find(rep, g->predecessors[e]);
+
+				if (stamp[u] != l + 1) {
+					stamp[u] = l + 1;
+					queue[nr_queue++] = u;
+				}
+			}
+		}
+	}
+
+	rc = 0;
+
+out:
+	free(rep);
+	free(stamp);
+	free(header_loop);
+	free(queue);
+	return rc;
+}
+
+/* Lay the loops' blocks out so that each loop is one slice: its header,
+ * then the rest of its own blocks, then its children's slices.  Children
+ * are numbered before their parents, so sizes add up going forwards and
+ * slices are handed out going backwards.  pos receives each block's
+ * place in the layout, for containment tests. */
+static int layout_loops(struct loop_work *w, struct bina_loop *loops, unsigned int nr_loops, unsigned int *pos)
+{
+	struct bina_loop_forest *forest = w->forest;
+	unsigned int *own, *children, l, b, nr_blocks = 0;
+
+	own = calloc(nr_loops + 1, sizeof(*own));
+	children = calloc(nr_loops + 1, sizeof(*children));
+	if (!own || !children) {
+		free(own);
+		free(children);
+		return -1;
+	}
+
+	for (b = 0; b < w->n; b++) {
+		if (forest->block_loops[b] != BINA_NO_INDEX)
+			own[forest->block_loops[b]]++;
+	}
+
+	for (l = 0; l < nr_loops; l++) {
+		loops[l].nr_blocks += own[l];
+
+		if (loops[l].parent != BINA_NO_INDEX)
+			loops[loops[l].parent].nr_blocks += loops[l].nr_blocks;
+		else
+			nr_blocks += loops[l].nr_blocks;
+	}
+
+	forest->blocks = bina_arena_alloc(&w->ctx->loop_arena, nr_blocks, sizeof(*forest->blocks));
+	if (!forest->blocks) {
+		free(own);
+		free(children);
+		return -1;
+	}
+
+	nr_blocks = 0;
+	for (l = nr_loops; l-- > 0;) {
+		struct bina_loop *loop = &loops[l];
+
+		if (loop->parent == BINA_NO_INDEX) {
+			loop->first_block = nr_blocks;
+			nr_blocks += loop->nr_blocks;
+			loop->depth = 1;
+		} else {
+			loop->first_block = children[loop->parent];
+			children[loop->parent] += loop->nr_blocks;
+			loop->depth = loops[loop->parent].depth + 1;
+		}
+
+		forest->blocks[loop->first_block] = loop->header;
+		pos[loop->header] = loop->first_block;
+
+		children[l] = loop->first_block + own[l];
+		own[l] = loop->first_block + 1;
+	}
+
+	for (b = 0; b < w->n; b++) {
+		l = forest->block_loops[b];
+
+		if (l == BINA_NO_INDEX) {
+			pos[b] = BINA_NO_INDEX;
+		} else if (loops[l].header != b) {
+			pos[b] = own[l]++;
+			forest->blocks[pos[b]] = b;
+		}
+	}
+
+	free(own);
+	free(children);
 	return 0;
 }
 
+static int contains(struct bina_loop *loop, unsigned int *pos, unsigned int b)
+{
+	return pos[b] != BINA_NO_INDEX && pos[b] - loop->first_block < loop->nr_blocks;
+}
+
+/* An edge is an exit from every loop around its source that doesn't
+ * hold its target too.  The first pass counts them, the second fills
+ * them in. */
+static int find_exits(struct loop_work *w, struct bina_loop *loops, unsigned int nr_loops, unsigned int *pos)
+{
+	struct bina_hot_graph *g = w->graph;
+	struct bina_loop_forest *forest = w->forest;
+	unsigned int pass, b, e, l, t, nr_exits = 0;
+
+	for (pass = 0; pass < 2; pass++) {
+		for (b = 0; b < w->n; b++) {
+			bina_for_each_hot_successor(g, b, e) {
+				t = g->successors[e];
+
+				for (l = forest->block_loops[b]; l != BINA_NO_INDEX && !contains(&loops[l], pos, t); l = loops[l].parent) {
+					if (pass) {
+						forest->exits[loops[l].first_exit + loops[l].nr_exits].source = b;
+						forest->exits[loops[l].first_exit + loops[l].nr_exits].target = t;
+					}
+
+					loops[l].nr_exits++;
+				}
+			}
+		}
+
+		if (pass)
+			break;
+
+		for (l = 0; l < nr_loops; l++) {
+			loops[l].first_exit = nr_exits;
+			nr_exits += loops[l].nr_exits;
+			loops[l].nr_exits = 0;
+		}
+
+		forest->exits = bina_arena_alloc(&w->ctx->loop_arena, nr_exits, sizeof(*forest->exits));
+		if (!forest->exits)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Flag the innermost loop holding each irreducible edge, if there is one. */
+static void flag_irreducible(struct loop_work *w, struct bina_loop *loops, unsigned int *pos)
+{
+	struct bina_loop_forest *forest = w->forest;
+	unsigned int k, l;
+
+	for (k = 0; k < forest->nr_irreducible_edges; k++) {
+		struct bina_block_edge *edge = &forest->irreducible_edges[k];
+
+		l = forest->block_loops[edge->source];
+		while (l != BINA_NO_INDEX && !contains(&loops[l], pos, edge->target))
+			l = loops[l].parent;
+
+		if (l != BINA_NO_INDEX)
+			loops[l].irreducible = 1;
+	}
+}
+
+static void *copy_out(struct bina_context *ctx, void *data, unsigned int nr, size_t size)
+{
+	void *copy = bina_arena_alloc(&ctx->loop_arena, nr, size);
+
+	if (copy && nr)
+		memcpy(copy, data, nr * size);
+
+	return copy;
+}
+
+static int analyse(struct loop_work *w)
+{
+	struct bina_loop_forest *forest = w->forest;
+	struct bina_block_edge *back_edges, *irreducible_edges;
+	struct bina_loop *loops = NULL;
+	unsigned int n = w->n, nr_loops = 0, nr_back_edges = 0, b, d, *pos;
+	int rc = -1;
+
+	w->pre = calloc(n + 1, sizeof(*w->pre));
+	w->post = calloc(n + 1, sizeof(*w->post));
+	w->by_pre = calloc(n + 1, sizeof(*w->by_pre));
+	w->parent = calloc(n + 1, sizeof(*w->parent));
+	w->is_root = calloc(n + 1, sizeof(*w->is_root));
+	w->idom = calloc(n + 1, sizeof(*w->idom));
+	w->dom_pre = calloc(n + 1, sizeof(*w->dom_pre));
+	w->dom_post = calloc(n + 1, sizeof(*w->dom_post));
+	w->stack = calloc(n + 1, sizeof(*w->stack));
+	w->next = calloc(n + 1, sizeof(*w->next));
+	pos = calloc(n + 1, sizeof(*pos));
+	back_edges = calloc(w->graph->nr_edges + 1, sizeof(*back_edges));
+	irreducible_edges = calloc(w->graph->nr_edges + 1, sizeof(*irreducible_edges));
+
+	forest->dominators = bina_arena_alloc(&w->ctx->loop_arena, n, sizeof(*forest->dominators));
+	forest->block_loops = bina_arena_alloc(&w->ctx->loop_arena, n, sizeof(*forest->block_loops));
+
+	if (!w->pre || !w->post || !w->by_pre || !w->parent || !w->is_root || !w->idom || !w->dom_pre ||
+			!w->dom_post || !w->stack || !w->next || !pos || !back_edges || !irreducible_edges ||
+			!forest->dominators || !forest->block_loops)
+		goto out;
+
+	depth_first(w);
+	if (find_dominators(w))
+		goto out;
+
+	for (b = 0; b < n; b++) {
+		d = w->idom[w->pre[b]];
+		forest->dominators[b] = d ? w->by_pre[d] : BINA_NO_INDEX;
+	}
+
+	if (number_dominator_tree(w))
+		goto out;
+
+	if (find_loops(w, &loops, &nr_loops, back_edges, &nr_back_edges, irreducible_edges, &forest->nr_irreducible_edges))
+		goto out;
+
+	if (layout_loops(w, loops, nr_loops, pos) || find_exits(w, loops, nr_loops, pos))
+		goto out;
+
+	forest->irreducible_edges = copy_out(w->ctx, irreducible_edges, forest->nr_irreducible_edges, sizeof(*irreducible_edges));
+	if (!forest->irreducible_edges)
+		goto out;
+
+	flag_irreducible(w, loops, pos);
+
+	forest->loops = copy_out(w->ctx, loops, nr_loops, sizeof(*loops));
+	forest->back_edges = copy_out(w->ctx, back_edges, nr_back_edges, sizeof(*back_edges));
+	if (!forest->loops || !forest->back_edges)
+		goto out;
+
+	forest->nr_loops = nr_loops;
+	rc = 0;
+
+out:
+	free(w->pre);
+	free(w->post);
+	free(w->by_pre);
+	free(w->parent);
+	free(w->is_root);
+	free(w->idom);
+	free(w->dom_pre);
+	free(w->dom_post);
+	free(w->stack);
+	free(w->next);
+	free(pos);
+	free(back_edges);
+	free(irreducible_edges);
+	free(loops);
+	return rc;
+}
+
+/* Work out the dominator tree and the loop nesting forest of the section
+ * graph, detecting the basic blocks first if need be.  The depth first
+ * walk starts at the entry points, and the results live in the loop
+ * arena, which goes when the blocks are next torn down or patched. */
 int bina_analyse_loops(struct bina_context *ctx)
 {
-	return find_for_loops(ctx);
+	struct bina_hot_graph graph;
+	struct loop_work work = { .ctx = ctx, .graph = &graph };
+	unsigned int i;
+	int rc = -1;
+
+	if (ctx->loops)
+		return 0;
+
+	if (bina_get_section_graph(ctx, &graph))
+		return -1;
+
+	work.n = graph.nr_blocks;
+	work.roots = calloc(ctx->nr_entries + 1, sizeof(*work.roots));
+	work.forest = bina_arena_alloc(&ctx->loop_arena, 1, sizeof(*work.forest));
+	if (!work.roots || !work.forest)
+		goto out;
+
+	for (i = 0; i < ctx->nr_entries; i++) {
+		struct bina_instruction *ins = bina_instruction_at(ctx, ctx->entries[i]);
+
+		if (ins && ins->basic_block)
+			work.roots[work.nr_roots++] = ins->basic_block->index;
+	}
+
+	if (analyse(&work))
+		goto out;
+
+	ctx->loops = work.forest;
+	rc = 0;
+
+out:
+	bina_put_hot_graph(&graph);
+	free(work.roots);
+	return rc;
 }
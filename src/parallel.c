@@ -0,0 +1,233 @@
+#include <bina.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <unistd.h>
+
+/* Sections smaller than this aren't worth splitting up. */
+#define MIN_CHUNK_SIZE		(64 * 1024)
+
+/* More chunks than threads, so a chunk full of slow encodings doesn't
+ * hold everything else up. */
+#define CHUNKS_PER_THREAD	4
+
+struct sweep_insn {
+	unsigned int offset;
+	unsigned int branch_target_offset;
+	unsigned char size;
+	unsigned char type;
+};
+
+struct sweep_chunk {
+	unsigned int start, end;
+
+	/* Where the worker's decode actually stopped, which may be past the
+	 * end of the chunk if the last instruction straddles it. */
+	unsigned int stop;
+
+	struct sweep_insn *insns;
+	unsigned int nr_insns, max_insns;
+	int failed;
+};
+
+struct sweep {
+	struct bina_context *ctx;
+	struct sweep_chunk *chunks;
+	unsigned int nr_chunks;
+	unsigned int next_chunk;
+};
+
+static int push_insn(struct sweep_chunk *chunk, unsigned int offset, struct bina_instruction *decoded)
+{
+	struct sweep_insn *insn;
+
+	if (chunk->nr_insns == chunk->max_insns) {
+		unsigned int capacity = chunk->max_insns ? chunk->max_insns * 2 : (chunk->end - chunk->start) / 4 + 16;
+
+		insn = realloc(chunk->insns, capacity * sizeof(*insn));
+		if (!insn)
+			return -1;
+
+		chunk->insns = insn;
+		chunk->max_insns = capacity;
+	}
+
+	insn = &chunk->insns[chunk->nr_insns++];
+	insn->offset = offset;
+	insn->size = decoded->size;
+	insn->type = decoded->type;
+	insn->branch_target_offset = decoded->branch_target_offset;
+
+	return 0;
+}
+
+static void decode_chunk(struct bina_context *ctx, struct sweep_chunk *chunk)
+{
+	unsigned int offset = chunk->start, length;
+
+	/* The chunk start is a guess at an instruction boundary.  If it's
+	 * wrong, the stitching pass resynchronises. */
+	while (offset < chunk->end) {
+		struct bina_instruction decoded;
+
+		length = ctx->arch->decode_instruction(ctx->base, ctx->size, offset, &decoded);
+		if (!length) {
+			offset++;
+			continue;
+		}
+
+		if (push_insn(chunk, offset, &decoded)) {
+			chunk->failed = 1;
+			return;
+		}
+
+		offset += length;
+	}
+
+	chunk->stop = offset;
+}
+
+static void *sweep_worker(void *arg)
+{
+	struct sweep *sweep = arg;
+	unsigned int index;
+
+	while ((index = __sync_fetch_and_add(&sweep->next_chunk, 1)) < sweep->nr_chunks) {
+		decode_chunk(sweep->ctx, &sweep->chunks[index]);
+	}
+
+	return NULL;
+}
+
+static int emit(struct bina_context *ctx, unsigned int offset, unsigned int size, unsigned char type, unsigned int target)
+{
+	struct bina_instruction *ins = bina_new_instruction(ctx);
+
+	if (!ins)
+		return -1;
+
+	ins->offset = offset;
+	ins->base = ctx->base + offset;
+	ins->size = size;
+	ins->type = type;
+	ins->branch_target_offset = target;
+
+	return 0;
+}
+
+/* Join the chunks into one instruction stream.  The real decode enters
+ * each chunk at pos, which only matches the worker's starting guess
+ * when the previous chunk ended cleanly.  Otherwise decode serially from
+ * pos until we land on an instruction the worker also found; x86
+ * resynchronises within a few instructions, so this is cheap. */
+static int stitch(struct sweep *sweep)
+{
+	struct bina_context *ctx = sweep->ctx;
+	unsigned int k, j, pos = 0, length;
+
+	for (k = 0; k < sweep->nr_chunks; k++) {
+		struct sweep_chunk *chunk = &sweep->chunks[k];
+		int synced = 0;
+
+		j = 0;
+		while (pos < chunk->end) {
+			struct bina_instruction decoded;
+
+			while (j < chunk->nr_insns && chunk->insns[j].offset < pos)
+				j++;
+
+			if (j < chunk->nr_insns && chunk->insns[j].offset == pos) {
+				synced = 1;
+				break;
+			}
+
+			length = ctx->arch->decode_instruction(ctx->base, ctx->size, pos, &decoded);
+			if (!length) {
+				pos++;
+				continue;
+			}
+
+			if (emit(ctx, pos, length, decoded.type, decoded.branch_target_offset))
+				return -1;
+
+			pos += length;
+		}
+
+		if (!synced)
+			continue;
+
+		for (; j < chunk->nr_insns; j++) {
+			struct sweep_insn *insn = &chunk->insns[j];
+
+			if (emit(ctx, insn->offset, insn->size, insn->type, insn->branch_target_offset))
+				return -1;
+		}
+
+		pos = chunk->stop;
+	}
+
+	return 0;
+}
+
+int bina_parallel_sweep(struct bina_context *ctx)
+{
+	struct sweep sweep = { .ctx = ctx };
+	pthread_t *threads;
+	long nr_threads;
+	unsigned int i, chunk_size, started;
+	int rc = -1;
+
+	nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nr_threads < 1)
+		nr_threads = 1;
+
+	sweep.nr_chunks = nr_threads * CHUNKS_PER_THREAD;
+	if (sweep.nr_chunks > ctx->size / MIN_CHUNK_SIZE)
+		sweep.nr_chunks = ctx->size / MIN_CHUNK_SIZE;
+
+	if (nr_threads == 1 || sweep.nr_chunks < 2)
+		return bina_linear_sweep(ctx);
+
+	sweep.chunks = calloc(sweep.nr_chunks, sizeof(*sweep.chunks));
+	threads = calloc(nr_threads, sizeof(*threads));
+	if (!sweep.chunks || !threads)
+		goto out;
+
+	chunk_size = ctx->size / sweep.nr_chunks;
+	for (i = 0; i < sweep.nr_chunks; i++) {
+		sweep.chunks[i].start = i * chunk_size;
+		sweep.chunks[i].end = (i + 1 == sweep.nr_chunks) ? ctx->size : (i + 1) * chunk_size;
+	}
+
+	for (started = 0; started < nr_threads; started++) {
+		if (pthread_create(&threads[started], NULL, sweep_worker, &sweep))
+			break;
+	}
+
+	/* Whatever threads did start will still drain every chunk. */
+	if (!started)
+		sweep_worker(&sweep);
+
+	for (i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	for (i = 0; i < sweep.nr_chunks; i++) {
+		if (sweep.chunks[i].failed)
+			goto out;
+	}
+
+	rc = stitch(&sweep);
+	if (!rc)
+		bina_finish_instructions(ctx);
+
+out:
+	if (sweep.chunks) {
+		for (i = 0; i < sweep.nr_chunks; i++) {
+			free(sweep.chunks[i].insns);
+		}
+	}
+
+	free(sweep.chunks);
+	free(threads);
+	return rc;
+}
@@ -0,0 +1,1885 @@
+#include <bina.h>
+#include <malloc.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct patch_insn {
+	unsigned int offset;
+	unsigned int branch_target_offset;
+	unsigned char size;
+	unsigned char type;
+};
+
+struct patch {
+	struct bina_context *ctx;
+
+	/* The old instructions [first, last) are replaced by the ones decoded
+	 * from the bytes [start, stop). */
+	unsigned int first, last;
+	unsigned int start, stop;
+
+	struct patch_insn *insns;
+	unsigned int nr_insns, max_insns;
+
+	/* Set once the new instructions are in place. */
+	int spliced;
+};
+
+static int push_insn(struct patch *patch, unsigned int offset, unsigned int length, struct bina_instruction *decoded)
+{
+	struct patch_insn *insn;
+
+	if (patch->nr_insns == patch->max_insns) {
+		unsigned int capacity = patch->max_insns ? patch->max_insns * 2 : 64;
+
+		insn = realloc(patch->insns, capacity * sizeof(*insn));
+		if (!insn)
+			return -1;
+
+		patch->insns = insn;
+		patch->max_insns = capacity;
+	}
+
+	insn = &patch->insns[patch->nr_insns++];
+	insn->offset = offset;
+	insn->size = length;
+	insn->type = decoded->type;
+	insn->branch_target_offset = decoded->branch_target_offset;
+
+	return 0;
+}
+
+/* The index of the first instruction at or after offset. */
+static unsigned int first_instruction_from(struct bina_context *ctx, unsigned int offset)
+{
+	unsigned int low = 0, high = ctx->nr_instructions;
+
+	while (low < high) {
+		unsigned int mid = low + (high - low) / 2;
+
+		if (ctx->instructions[mid].offset < offset)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return low;
+}
+
+/* Re-run the linear sweep over the patched bytes.  Any decode that
+ * started within an instruction's length before the patch could have
+ * read patched bytes, so the sweep picks up from the boundary covering
+ * that point.  It stops once it's past the patch and lands somewhere the
+ * old sweep also was: an old instruction boundary, or an undecodable
+ * byte the old sweep stepped over.  From there on nothing can differ. */
+static int redecode(struct patch *patch, unsigned int offset, unsigned int length)
+{
+	struct bina_context *ctx = patch->ctx;
+	const struct bina_arch *arch = ctx->arch;
+	struct bina_instruction *covering;
+	unsigned int pos, end, j;
+
+	pos = offset >= arch->max_instruction_size ? offset - arch->max_instruction_size + 1 : 0;
+	covering = bina_instruction_covering(ctx, pos);
+	if (covering)
+		pos = covering->offset;
+
+	end = offset + length;
+	patch->start = pos;
+	patch->first = j = first_instruction_from(ctx, pos);
+
+	while (pos < ctx->size) {
+		struct bina_instruction decoded;
+
+		if (pos >= end) {
+			while (j < ctx->nr_instructions && ctx->instructions[j].offset < pos)
+				j++;
+
+			if (j < ctx->nr_instructions && ctx->instructions[j].offset == pos)
+				break;
+
+			if (!bina_instruction_covering(ctx, pos))
+				break;
+		}
+
+		length = arch->decode_instruction(ctx->base, ctx->size, pos, &decoded);
+		if (!length) {
+			pos++;
+			continue;
+		}
+
+		if (push_insn(patch, pos, length, &decoded))
+			return -1;
+
+		pos += length;
+	}
+
+	while (j < ctx->nr_instructions && ctx->instructions[j].offset < pos)
+		j++;
+
+	patch->stop = pos;
+	patch->last = j;
+	return 0;
+}
+
+/* Is there an instruction at offset once the patch is in?  In the
+ * patched bytes that's one of the new ones, elsewhere an old one. */
+static int decodes_at(struct patch *patch, unsigned int offset)
+{
+	unsigned int k;
+
+	if (offset < patch->start || offset >= patch->stop)
+		return bina_instruction_at(patch->ctx, offset) != NULL;
+
+	for (k = 0; k < patch->nr_insns; k++) {
+		if (patch->insns[k].offset == offset)
+			return 1;
+	}
+
+	return 0;
+}
+
+/* The bounds check of a table jump is at most this many instructions
+ * before it, see the architecture's jump_table hook. */
+#define JUMP_TABLE_REACH	8
+
+/* Could the patch change a jump table or make a new one?  It could if it
+ * touches a table jump or the code leading up to it, the table itself,
+ * or the instructions at any of its targets, or if it adds an indirect
+ * jump, or changes what comes before one that has no table yet. */
+static int touches_jump_tables(struct patch *patch)
+{
+	struct bina_context *ctx = patch->ctx;
+	unsigned int i, n, end;
+
+	if (!ctx->arch->jump_table)
+		return 0;
+
+	for (i = 0; i < ctx->nr_jump_tables; i++) {
+		struct bina_jump_table *table = &ctx->jump_tables[i];
+		unsigned long start = ctx->load_address + patch->start;
+		unsigned long stop = ctx->load_address + patch->stop;
+
+		if (table->instruction >= patch->first && table->instruction < patch->last + JUMP_TABLE_REACH)
+			return 1;
+
+		if (table->address < stop && table->address + table->nr_entries * 4 > start)
+			return 1;
+
+		for (n = 0; n < table->nr_targets; n++) {
+			if (table->targets[n] >= patch->start && table->targets[n] < patch->stop)
+				return 1;
+		}
+	}
+
+	for (n = 0; n < patch->nr_insns; n++) {
+		struct patch_insn *insn = &patch->insns[n];
+
+		if (insn->type == IT_U_BRANCH && !decodes_at(patch, insn->branch_target_offset))
+			return 1;
+	}
+
+	end = patch->last + JUMP_TABLE_REACH;
+	for (i = patch->last; i < end && i < ctx->nr_instructions; i++) {
+		struct bina_instruction *ins = &ctx->instructions[i];
+
+		if (ins->type == IT_U_BRANCH && !decodes_at(patch, ins->branch_target_offset))
+			return 1;
+	}
+
+	return 0;
+}
+
+/* Does the patch leave every boundary, type and branch target as it was,
+ * and every jump table too?  If so, the blocks and edges are still right. */
+static int same_skeleton(struct patch *patch)
+{
+	struct bina_context *ctx = patch->ctx;
+	unsigned int k;
+
+	if (patch->nr_insns != patch->last - patch->first || touches_jump_tables(patch))
+		return 0;
+
+	for (k = 0; k < patch->nr_insns; k++) {
+		struct bina_instruction *ins = &ctx->instructions[patch->first + k];
+		struct patch_insn *insn = &patch->insns[k];
+
+		if (ins->offset != insn->offset || ins->size != insn->size ||
+				ins->type != insn->type || ins->branch_target_offset != insn->branch_target_offset)
+			return 0;
+	}
+
+	return 1;
+}
+
+static void set_instruction(struct bina_context *ctx, struct bina_instruction *ins, struct patch_insn *insn)
+{
+	ins->offset = insn->offset;
+	ins->base = ctx->base + insn->offset;
+	ins->size = insn->size;
+	ins->type = insn->type;
+	ins->branch_target_offset = insn->branch_target_offset;
+	ins->jump_table = NULL;
+
+	/* The old operands have been given back, see splice(); these decode
+	 * again on demand. */
+	ins->operands = NULL;
+	ins->nr_operands = 0;
+	ins->defs = ins->uses = 0;
+	memset(&ins->arithmetic, 0, sizeof(ins->arithmetic));
+	ins->condition = CC_NONE;
+	ins->operands_decoded = 0;
+}
+
+/* Make the same change to the hot instructions, in place while there's
+ * room.  The replaced instructions' operands come out of the side table,
+ * and the new ones start with none, so that only ever closes up. */
+static int splice_compact(struct patch *patch)
+{
+	struct bina_context *ctx = patch->ctx;
+	struct bina_compact *c = ctx->compact;
+	struct bina_hot_instruction *instructions = c->instructions;
+	unsigned int *operand_index = c->operand_index;
+	unsigned int old_count = patch->last - patch->first, tail = c->nr_instructions - patch->last;
+	unsigned int nr = c->nr_instructions - old_count + patch->nr_insns;
+	unsigned int start = c->operand_index[patch->first];
+	unsigned int removed = c->operand_index[patch->last] - start;
+	unsigned int i;
+
+	if (nr > c->max_instructions) {
+		unsigned int capacity = nr + nr / 8 + 64;
+
+		instructions = bina_arena_alloc(&ctx->compact_arena, capacity, sizeof(*instructions));
+		operand_index = bina_arena_alloc(&ctx->compact_arena, capacity + 1, sizeof(*operand_index));
+		if (!instructions || !operand_index)
+			return -1;
+
+		memcpy(instructions, c->instructions, patch->first * sizeof(*instructions));
+		memcpy(operand_index, c->operand_index, patch->first * sizeof(*operand_index));
+		c->max_instructions = capacity;
+	}
+
+	if (instructions != c->instructions || patch->nr_insns != old_count) {
+		memmove(&instructions[patch->first + patch->nr_insns], &c->instructions[patch->last],
+			tail * sizeof(*instructions));
+		memmove(&operand_index[patch->first + patch->nr_insns], &c->operand_index[patch->last],
+			(tail + 1) * sizeof(*operand_index));
+
+		/* The blocks are worked out again around the new ones. */
+		for (i = patch->first; i < patch->first + patch->nr_insns; i++) {
+			memset(&instructions[i], 0, sizeof(instructions[i]));
+			instructions[i].basic_block = BINA_NO_INDEX;
+		}
+	}
+
+	if (removed) {
+		memmove(&c->operands[start], &c->operands[start + removed],
+			(operand_index[nr] - start - removed) * sizeof(*c->operands));
+
+		for (i = patch->first + patch->nr_insns; i <= nr; i++) {
+			operand_index[i] -= removed;
+		}
+	}
+
+	for (i = patch->first; i < patch->first + patch->nr_insns; i++) {
+		operand_index[i] = start;
+	}
+
+	c->instructions = instructions;
+	c->operand_index = operand_index;
+	c->nr_instructions = nr;
+	return 0;
+}
+
+/* Point the instructions from first on at their neighbours, and their
+ * operands back at them, once they've moved. */
+static void relink(struct bina_context *ctx, unsigned int first)
+{
+	unsigned int i, n;
+
+	for (i = first; i < ctx->nr_instructions; i++) {
+		struct bina_instruction *ins = &ctx->instructions[i];
+
+		ins->prev = i ? &ctx->instructions[i - 1] : NULL;
+		ins->next = i + 1 < ctx->nr_instructions ? &ctx->instructions[i + 1] : NULL;
+
+		for (n = 0; n < ins->nr_operands; n++) {
+			ins->operands[n].ins = ins;
+		}
+	}
+}
+
+/* Replace the old instructions with the new ones.  With the same count
+ * they're overwritten where they are, otherwise the tail of the array
+ * moves and everything after the patch is renumbered.  The array keeps
+ * some room to spare, so it only moves as a whole once in a while, and
+ * the hot copy goes the same way, or is dropped to be built again if it
+ * can't grow. */
+static int splice(struct patch *patch)
+{
+	struct bina_context *ctx = patch->ctx;
+	struct bina_instruction *old_instructions = ctx->instructions;
+	unsigned int old_count = patch->last - patch->first;
+	unsigned int nr, i, k, n;
+
+	nr = ctx->nr_instructions - old_count + patch->nr_insns;
+
+	if (nr > ctx->max_instructions) {
+		unsigned int capacity = nr + nr / 8 + 64;
+		struct bina_instruction *grown = realloc(ctx->instructions, capacity * sizeof(*grown));
+
+		if (!grown)
+			return -1;
+
+		ctx->instructions = grown;
+		ctx->max_instructions = capacity;
+	}
+
+	if (ctx->compact && splice_compact(patch))
+		bina_destroy_compact(ctx);
+
+	for (i = patch->first; i < patch->last; i++) {
+		bina_free_operands(ctx, ctx->instructions[i].operands, ctx->instructions[i].nr_operands);
+	}
+
+	if (patch->nr_insns != old_count) {
+		memmove(&ctx->instructions[patch->first + patch->nr_insns], &ctx->instructions[patch->last],
+			(ctx->nr_instructions - patch->last) * sizeof(*ctx->instructions));
+
+		for (i = patch->first; i < patch->first + patch->nr_insns; i++) {
+			memset(&ctx->instructions[i], 0, sizeof(ctx->instructions[i]));
+			ctx->instructions[i].context = ctx;
+		}
+
+		ctx->nr_instructions = nr;
+		for (i = patch->first; i < nr; i++) {
+			ctx->instructions[i].index = i;
+		}
+	}
+
+	for (k = 0; k < patch->nr_insns; k++) {
+		set_instruction(ctx, &ctx->instructions[patch->first + k], &patch->insns[k]);
+	}
+
+	/* Bytes in the patched range map to the new instructions, and with a
+	 * different count every later instruction has a new index too. */
+	memset(&ctx->offset_index[patch->start], 0, (patch->stop - patch->start) * sizeof(*ctx->offset_index));
+
+	n = (patch->nr_insns != old_count) ? ctx->nr_instructions : patch->first + patch->nr_insns;
+	for (i = patch->first; i < n; i++) {
+		struct bina_instruction *ins = &ctx->instructions[i];
+		unsigned int b;
+
+		for (b = 0; b < ins->size && ins->offset + b < ctx->size; b++) {
+			ctx->offset_index[ins->offset + b] = i + 1;
+		}
+	}
+
+	if (ctx->instructions != old_instructions)
+		relink(ctx, 0);
+	else if (patch->nr_insns != old_count)
+		relink(ctx, patch->first ? patch->first - 1 : 0);
+
+	if (!(ctx->flags & BINA_LAZY_OPERANDS)) {
+		for (k = 0; k < patch->nr_insns; k++) {
+			if (bina_decode_operands(&ctx->instructions[patch->first + k]))
+				return -1;
+		}
+	}
+
+	patch->spliced = 1;
+	return 0;
+}
+
+static int is_branch(unsigned int type)
+{
+	return type == IT_CALL || type == IT_U_BRANCH || type == IT_C_BRANCH;
+}
+
+static struct bina_instruction *resolve_target(struct bina_context *ctx, struct bina_instruction *ins)
+{
+	if (is_branch(ins->type))
+		return bina_instruction_at(ctx, ins->branch_target_offset);
+
+	return NULL;
+}
+
+/* Refresh the hot copies of the patched instructions. */
+static void update_compact(struct patch *patch)
+{
+	struct bina_context *ctx = patch->ctx;
+	struct bina_compact *c = ctx->compact;
+	unsigned int i;
+
+	for (i = patch->first; i < patch->first + patch->nr_insns; i++) {
+		struct bina_instruction *ins = &ctx->instructions[i];
+		struct bina_hot_instruction *hot = &c->instructions[i];
+		struct bina_instruction *target = resolve_target(ctx, ins);
+
+		hot->offset = ins->offset;
+		hot->size = ins->size;
+		hot->type = ins->type;
+		hot->branch_target = target ? target->index : BINA_NO_INDEX;
+
+		/* Operands for these are no longer in the side table. */
+		hot->nr_operands = 0;
+	}
+}
+
+/* Instructions anywhere may branch into the patch, so look up every hot
+ * branch target again. */
+static void retarget_compact(struct bina_context *ctx)
+{
+	struct bina_compact *c = ctx->compact;
+	unsigned int i;
+
+	bina_for_each_hot_instruction(c, i) {
+		struct bina_instruction *target = resolve_target(ctx, &ctx->instructions[i]);
+
+		c->instructions[i].branch_target = target ? target->index : BINA_NO_INDEX;
+	}
+}
+
+/* The tables are read again along with the blocks. */
+static void forget_jump_tables(struct bina_context *ctx)
+{
+	ctx->jump_tables = NULL;
+	ctx->nr_jump_tables = 0;
+	ctx->jump_tables_resolved = 0;
+	bina_arena_reset(&ctx->jump_table_arena);
+}
+
+static int compare_refs(const void *a, const void *b)
+{
+	const struct bina_branch_ref *x = a, *y = b;
+
+	if (x->target != y->target)
+		return (x->target > y->target) - (x->target < y->target);
+
+	return (x->source > y->source) - (x->source < y->source);
+}
+
+static int push_ref(struct bina_context *ctx, unsigned int target, unsigned int source)
+{
+	struct bina_branch_ref *ref;
+
+	if (ctx->nr_branch_refs == ctx->max_branch_refs) {
+		unsigned int capacity = ctx->max_branch_refs ? ctx->max_branch_refs * 2 : 1024;
+
+		ref = realloc(ctx->branch_refs, capacity * sizeof(*ref));
+		if (!ref)
+			return -1;
+
+		ctx->branch_refs = ref;
+		ctx->max_branch_refs = capacity;
+	}
+
+	ref = &ctx->branch_refs[ctx->nr_branch_refs++];
+	ref->target = target;
+	ref->source = source;
+	return 0;
+}
+
+static int build_refs(struct bina_context *ctx)
+{
+	unsigned int i, n;
+
+	for (i = 0; i < ctx->nr_instructions; i++) {
+		struct bina_instruction *ins = &ctx->instructions[i];
+
+		if (is_branch(ins->type) && ins->branch_target_offset < ctx->size &&
+				push_ref(ctx, ins->branch_target_offset, ins->offset))
+			return -1;
+	}
+
+	for (i = 0; i < ctx->nr_jump_tables; i++) {
+		struct bina_jump_table *table = &ctx->jump_tables[i];
+
+		for (n = 0; n < table->nr_targets; n++) {
+			if (push_ref(ctx, table->targets[n], ctx->instructions[table->instruction].offset))
+				return -1;
+		}
+	}
+
+	qsort(ctx->branch_refs, ctx->nr_branch_refs, sizeof(*ctx->branch_refs), compare_refs);
+	return 0;
+}
+
+static void forget_refs(struct bina_context *ctx)
+{
+	free(ctx->branch_refs);
+	ctx->branch_refs = NULL;
+	ctx->nr_branch_refs = ctx->max_branch_refs = 0;
+}
+
+/* Where the reference from source to target is, or would go. */
+static unsigned int find_ref(struct bina_context *ctx, unsigned int target, unsigned int source)
+{
+	struct bina_branch_ref key = { .target = target, .source = source };
+	unsigned int low = 0, high = ctx->nr_branch_refs;
+
+	while (low < high) {
+		unsigned int mid = low + (high - low) / 2;
+
+		if (compare_refs(&ctx->branch_refs[mid], &key) < 0)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return low;
+}
+
+static int has_ref(struct bina_context *ctx, unsigned int target)
+{
+	unsigned int i = find_ref(ctx, target, 0);
+
+	return i < ctx->nr_branch_refs && ctx->branch_refs[i].target == target;
+}
+
+static int insert_ref(struct bina_context *ctx, unsigned int target, unsigned int source)
+{
+	unsigned int i = find_ref(ctx, target, source);
+
+	if (push_ref(ctx, target, source))
+		return -1;
+
+	memmove(&ctx->branch_refs[i + 1], &ctx->branch_refs[i],
+		(ctx->nr_branch_refs - 1 - i) * sizeof(*ctx->branch_refs));
+	ctx->branch_refs[i].target = target;
+	ctx->branch_refs[i].source = source;
+	return 0;
+}
+
+static void remove_ref(struct bina_context *ctx, unsigned int target, unsigned int source)
+{
+	unsigned int i = find_ref(ctx, target, source);
+
+	if (i == ctx->nr_branch_refs || ctx->branch_refs[i].target != target || ctx->branch_refs[i].source != source)
+		return;
+
+	ctx->nr_branch_refs--;
+	memmove(&ctx->branch_refs[i], &ctx->branch_refs[i + 1], (ctx->nr_branch_refs - i) * sizeof(*ctx->branch_refs));
+}
+
+/* A growable list of block indices. */
+struct index_list {
+	unsigned int *items;
+	unsigned int nr, max;
+};
+
+static int push_index(struct index_list *list, unsigned int item)
+{
+	unsigned int *items;
+
+	if (list->nr == list->max) {
+		unsigned int capacity = list->max ? list->max * 2 : 64;
+
+		items = realloc(list->items, capacity * sizeof(*items));
+		if (!items)
+			return -1;
+
+		list->items = items;
+		list->max = capacity;
+	}
+
+	list->items[list->nr++] = item;
+	return 0;
+}
+
+static int compare_indices(const void *a, const void *b)
+{
+	unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Sort the list and drop the duplicates. */
+static void sort_indices(struct index_list *list)
+{
+	unsigned int i, n;
+
+	qsort(list->items, list->nr, sizeof(*list->items), compare_indices);
+
+	for (i = 0, n = 0; i < list->nr; i++) {
+		if (n == 0 || list->items[i] != list->items[n - 1])
+			list->items[n++] = list->items[i];
+	}
+
+	list->nr = n;
+}
+
+static int find_index(struct index_list *list, unsigned int item)
+{
+	return bsearch(&item, list->items, list->nr, sizeof(*list->items), compare_indices) != NULL;
+}
+
+/* A run of old blocks whose leaders may have changed, and the blocks that
+ * replace it. */
+struct run {
+	unsigned int first_block, last_block;
+
+	/* Where the old blocks' edge slices were. */
+	unsigned int first_successor, nr_successors;
+	unsigned int first_predecessor, nr_predecessors;
+
+	/* The instructions [first, end), renumbered once they've moved. */
+	unsigned int first, end;
+
+	unsigned int new_first_block, nr_blocks;
+};
+
+/* A stretch of a table that's rewritten, covering nr_blocks blocks from
+ * first_block once they're in place. */
+struct group {
+	unsigned int first_block, nr_blocks;
+	unsigned int start, length;
+	unsigned int new_start, new_length;
+};
+
+/* A stretch of a table that's kept as it is, but may move. */
+struct segment {
+	unsigned int from, to, length;
+};
+
+/* An edge from a block whose successors are worked out again. */
+struct new_edge {
+	unsigned int target;
+	unsigned int source;
+	unsigned int position;
+};
+
+/* The blocks and edges around a patch, worked out again in place. */
+struct regraph {
+	struct patch *patch;
+	struct bina_context *ctx;
+
+	/* In block order, and never touching or overlapping. */
+	struct run *runs;
+	unsigned int nr_runs, max_runs;
+
+	/* Blocks outside the runs whose successors or predecessors change,
+	 * by old index until the blocks have moved, and new index after. */
+	struct index_list sources, sinks;
+
+	/* Every block whose successors are worked out again, in order, and
+	 * the new ones of block changed.items[k] from succ_first[k] up to
+	 * succ_first[k + 1].  Likewise for predecessors and reached. */
+	struct index_list changed;
+	struct bina_basic_block **succ;
+	unsigned char *succ_kinds;
+	unsigned int *succ_first;
+	struct new_edge *edges;
+
+	struct index_list reached;
+	struct bina_basic_block **pred;
+	unsigned char *pred_kinds;
+	unsigned int *pred_first;
+
+	/* Blocks whose edges were pointed at moved blocks, by new index. */
+	struct index_list relinked;
+
+	/* How many more instructions there are than before. */
+	int delta;
+
+	struct bina_basic_block *old_blocks;
+	int moved_blocks, moved_edges, grown_blocks, grown_edges;
+};
+
+static int add_run(struct regraph *g, unsigned int lo, unsigned int hi)
+{
+	struct bina_context *ctx = g->ctx;
+	struct run *run;
+
+	if (g->nr_runs == g->max_runs) {
+		unsigned int capacity = g->max_runs ? g->max_runs * 2 : 16;
+
+		run = realloc(g->runs, capacity * sizeof(*run));
+		if (!run)
+			return -1;
+
+		g->runs = run;
+		g->max_runs = capacity;
+	}
+
+	run = &g->runs[g->nr_runs++];
+	memset(run, 0, sizeof(*run));
+	run->first_block = ctx->instructions[lo].basic_block->index;
+	run->last_block = ctx->instructions[hi].basic_block->index;
+	return 0;
+}
+
+/* A branch from the patch, old or new, can make or unmake a leader at its
+ * target, which splits or joins the blocks either side of it. */
+static int add_target_run(struct regraph *g, unsigned int type, unsigned int target)
+{
+	struct patch *patch = g->patch;
+	struct bina_instruction *ins;
+
+	if (!is_branch(type) || (target >= patch->start && target < patch->stop))
+		return 0;
+
+	ins = bina_instruction_at(g->ctx, target);
+	if (!ins)
+		return 0;
+
+	return add_run(g, ins->index ? ins->index - 1 : 0, ins->index);
+}
+
+static int compare_runs(const void *a, const void *b)
+{
+	const struct run *x = a, *y = b;
+
+	return (x->first_block > y->first_block) - (x->first_block < y->first_block);
+}
+
+/* The run holding an old block, if any. */
+static struct run *find_run(struct regraph *g, unsigned int block)
+{
+	unsigned int low = 0, high = g->nr_runs;
+
+	while (low < high) {
+		unsigned int mid = low + (high - low) / 2;
+
+		if (g->runs[mid].last_block < block)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	if (low < g->nr_runs && g->runs[low].first_block <= block)
+		return &g->runs[low];
+
+	return NULL;
+}
+
+/* The run that a block now belongs to, if any. */
+static struct run *find_new_run(struct regraph *g, unsigned int block)
+{
+	unsigned int low = 0, high = g->nr_runs;
+
+	while (low < high) {
+		unsigned int mid = low + (high - low) / 2;
+
+		if (g->runs[mid].new_first_block + g->runs[mid].nr_blocks <= block)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	if (low < g->nr_runs && g->runs[low].new_first_block <= block)
+		return &g->runs[low];
+
+	return NULL;
+}
+
+/* Where an old block outside the runs ends up. */
+static unsigned int new_block_index(struct regraph *g, unsigned int block)
+{
+	unsigned int low = 0, high = g->nr_runs;
+	struct run *run;
+
+	while (low < high) {
+		unsigned int mid = low + (high - low) / 2;
+
+		if (g->runs[mid].first_block <= block)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	if (!low)
+		return block;
+
+	run = &g->runs[low - 1];
+	if (block <= run->last_block)
+		return BINA_NO_INDEX;
+
+	return block - run->last_block - 1 + run->new_first_block + run->nr_blocks;
+}
+
+static struct bina_basic_block *moved_block(struct regraph *g, struct bina_basic_block *block)
+{
+	unsigned int index;
+
+	if (!block)
+		return NULL;
+
+	index = new_block_index(g, block - g->old_blocks);
+	return index == BINA_NO_INDEX ? NULL : &g->ctx->blocks[index];
+}
+
+/* Find the old blocks whose leaders may change: the ones around the
+ * patched instructions, and the ones around the targets of branches in
+ * the patch.  Overlapping and neighbouring runs are merged. */
+static int find_runs(struct regraph *g)
+{
+	struct bina_context *ctx = g->ctx;
+	struct patch *patch = g->patch;
+	unsigned int i, n;
+
+	/* The instruction before the patch may join up with it, and the one
+	 * after it may stop or start being a leader. */
+	if (add_run(g, patch->first ? patch->first - 1 : 0,
+			patch->last < ctx->nr_instructions ? patch->last : ctx->nr_instructions - 1))
+		return -1;
+
+	for (i = patch->first; i < patch->last; i++) {
+		if (add_target_run(g, ctx->instructions[i].type, ctx->instructions[i].branch_target_offset))
+			return -1;
+	}
+
+	for (i = 0; i < patch->nr_insns; i++) {
+		if (add_target_run(g, patch->insns[i].type, patch->insns[i].branch_target_offset))
+			return -1;
+	}
+
+	qsort(g->runs, g->nr_runs, sizeof(*g->runs), compare_runs);
+
+	for (i = 1, n = 0; i < g->nr_runs; i++) {
+		if (g->runs[i].first_block <= g->runs[n].last_block + 1) {
+			if (g->runs[i].last_block > g->runs[n].last_block)
+				g->runs[n].last_block = g->runs[i].last_block;
+		} else {
+			g->runs[++n] = g->runs[i];
+		}
+	}
+
+	g->nr_runs = n + 1;
+
+	for (i = 0; i < g->nr_runs; i++) {
+		struct run *run = &g->runs[i];
+		struct bina_basic_block *first = &ctx->blocks[run->first_block];
+		struct bina_basic_block *last = &ctx->blocks[run->last_block];
+
+		run->first = first->instructions->index;
+		run->end = last->instructions->index + last->nr_instructions;
+		run->first_successor = first->successors - ctx->successors;
+		run->nr_successors = last->successors + last->nr_successors - first->successors;
+		run->first_predecessor = first->predecessors - ctx->predecessors;
+		run->nr_predecessors = last->predecessors + last->nr_predecessors - first->predecessors;
+	}
+
+	return 0;
+}
+
+/* The blocks outside the runs whose successors change are the ones with
+ * an edge into a run, and the ones branching into the patched bytes.  The
+ * ones whose predecessors change are those these and the runs reach. */
+static int find_sources(struct regraph *g)
+{
+	struct bina_context *ctx = g->ctx;
+	struct patch *patch = g->patch;
+	unsigned int i, b, n;
+
+	for (i = 0; i < g->nr_runs; i++) {
+		for (b = g->runs[i].first_block; b <= g->runs[i].last_block; b++) {
+			struct bina_basic_block *block = &ctx->blocks[b];
+
+			for (n = 0; n < block->nr_predecessors; n++) {
+				if (!find_run(g, block->predecessors[n]->index) &&
+						push_index(&g->sources, block->predecessors[n]->index))
+					return -1;
+			}
+
+			for (n = 0; n < block->nr_successors; n++) {
+				if (!find_run(g, block->successors[n]->index) &&
+						push_index(&g->sinks, block->successors[n]->index))
+					return -1;
+			}
+		}
+	}
+
+	for (i = find_ref(ctx, patch->start, 0); i < ctx->nr_branch_refs && ctx->branch_refs[i].target < patch->stop; i++) {
+		b = bina_instruction_at(ctx, ctx->branch_refs[i].source)->basic_block->index;
+
+		if (!find_run(g, b) && push_index(&g->sources, b))
+			return -1;
+	}
+
+	sort_indices(&g->sources);
+
+	for (i = 0; i < g->sources.nr; i++) {
+		struct bina_basic_block *block = &ctx->blocks[g->sources.items[i]];
+
+		for (n = 0; n < block->nr_successors; n++) {
+			if (!find_run(g, block->successors[n]->index) &&
+					push_index(&g->sinks, block->successors[n]->index))
+				return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Swap the references from the patched instructions for the new ones. */
+static int update_refs(struct regraph *g)
+{
+	struct bina_context *ctx = g->ctx;
+	struct patch *patch = g->patch;
+	unsigned int i;
+
+	for (i = patch->first; i < patch->last; i++) {
+		struct bina_instruction *ins = &ctx->instructions[i];
+
+		if (is_branch(ins->type) && ins->branch_target_offset < ctx->size)
+			remove_ref(ctx, ins->branch_target_offset, ins->offset);
+	}
+
+	for (i = 0; i < patch->nr_insns; i++) {
+		struct patch_insn *insn = &patch->insns[i];
+
+		if (is_branch(insn->type) && insn->branch_target_offset < ctx->size &&
+				insert_ref(ctx, insn->branch_target_offset, insn->offset))
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Move a block's instructions along with the patch, unless it's in a run
+ * and about to be laid out again anyway. */
+static void rebase_block(struct regraph *g, unsigned int block, struct bina_instruction *old_instructions)
+{
+	struct bina_context *ctx = g->ctx;
+	unsigned int index = ctx->blocks[block].instructions - old_instructions;
+
+	if (!find_run(g, block))
+		ctx->blocks[block].instructions = &ctx->instructions[index >= g->patch->last ? index + g->delta : index];
+}
+
+/* Once the instructions have been spliced, point everything that refers
+ * to them by address at where they are now, and look up the targets of
+ * the branches into the patch again.  Unless the whole array has moved,
+ * that's only the blocks from the first run on, and the branches into
+ * the tail, which the references find. */
+static void retarget(struct regraph *g, struct bina_instruction *old_instructions)
+{
+	struct bina_context *ctx = g->ctx;
+	struct patch *patch = g->patch;
+	unsigned int i, low, high;
+
+	if (ctx->instructions != old_instructions) {
+		for (i = 0; i < ctx->nr_basic_blocks; i++) {
+			rebase_block(g, i, old_instructions);
+		}
+
+		for (i = 0; i < ctx->nr_instructions; i++) {
+			struct bina_instruction *ins = &ctx->instructions[i];
+			unsigned int index;
+
+			if (!ins->branch_target)
+				continue;
+
+			index = ins->branch_target - old_instructions;
+			if (index >= patch->last)
+				ins->branch_target = &ctx->instructions[index + g->delta];
+			else if (index >= patch->first)
+				ins->branch_target = NULL;
+			else
+				ins->branch_target = &ctx->instructions[index];
+		}
+	} else if (g->delta) {
+		for (i = g->runs[0].first_block; i < ctx->nr_basic_blocks; i++) {
+			rebase_block(g, i, old_instructions);
+		}
+	}
+
+	if (g->delta) {
+		for (i = find_ref(ctx, patch->stop, 0); i < ctx->nr_branch_refs; i++) {
+			struct bina_instruction *source = bina_instruction_at(ctx, ctx->branch_refs[i].source);
+			struct bina_instruction *target = resolve_target(ctx, source);
+
+			if (source->branch_target)
+				source->branch_target = target;
+			if (ctx->compact)
+				ctx->compact->instructions[source->index].branch_target = target ? target->index : BINA_NO_INDEX;
+		}
+
+		/* The tables are in instruction order. */
+		low = 0;
+		high = ctx->nr_jump_tables;
+		while (low < high) {
+			unsigned int mid = low + (high - low) / 2;
+
+			if (ctx->jump_tables[mid].instruction < patch->last)
+				low = mid + 1;
+			else
+				high = mid;
+		}
+
+		for (i = low; i < ctx->nr_jump_tables; i++) {
+			ctx->jump_tables[i].instruction += g->delta;
+		}
+	}
+
+	for (i = patch->first; i < patch->first + patch->nr_insns; i++) {
+		ctx->instructions[i].branch_target = resolve_target(ctx, &ctx->instructions[i]);
+	}
+
+	for (i = find_ref(ctx, patch->start, 0); i < ctx->nr_branch_refs && ctx->branch_refs[i].target < patch->stop; i++) {
+		struct bina_instruction *source = bina_instruction_at(ctx, ctx->branch_refs[i].source);
+		struct bina_instruction *target = resolve_target(ctx, source);
+
+		source->branch_target = target;
+		if (ctx->compact)
+			ctx->compact->instructions[source->index].branch_target = target ? target->index : BINA_NO_INDEX;
+	}
+
+	for (i = 0; i < g->nr_runs; i++) {
+		struct run *run = &g->runs[i];
+
+		if (run->first > patch->first)
+			run->first += g->delta;
+		if (run->end >= patch->last)
+			run->end += g->delta;
+	}
+}
+
+/* The same rules as mark_leaders(), with the branches to an instruction
+ * looked up in the references. */
+static int starts_block(struct bina_context *ctx, struct bina_instruction *ins)
+{
+	struct bina_instruction *prev = ins->prev;
+
+	if (!prev || prev->offset + prev->size != ins->offset)
+		return 1;
+
+	if (is_branch(prev->type) || prev->type == IT_RETURN)
+		return 1;
+
+	return has_ref(ctx, ins->offset);
+}
+
+/* The first instruction of a run stays a leader, since the block before
+ * it is kept and ends where it did. */
+static void mark_run_leaders(struct regraph *g)
+{
+	struct bina_context *ctx = g->ctx;
+	unsigned int i, n;
+
+	for (i = 0; i < g->nr_runs; i++) {
+		struct run *run = &g->runs[i];
+
+		run->nr_blocks = 0;
+		for (n = run->first; n < run->end; n++) {
+			struct bina_instruction *ins = &ctx->instructions[n];
+
+			ins->basic_block_leader = n == run->first || starts_block(ctx, ins);
+			if (ctx->compact)
+				ctx->compact->instructions[n].basic_block_leader = ins->basic_block_leader;
+
+			run->nr_blocks += ins->basic_block_leader;
+		}
+	}
+}
+
+/* Work out where everything in a table goes when the groups in it change
+ * length.  The groups are in order, and segments gets the stretches kept
+ * around them, one more than there are groups.  Returns the new length
+ * of the table. */
+static unsigned int plan_groups(struct group *groups, unsigned int nr, unsigned int total,
+	struct segment *segments, int *moved)
+{
+	unsigned int i, pos = 0;
+	int shift = 0;
+
+	*moved = 0;
+	for (i = 0; i < nr; i++) {
+		segments[i].from = pos;
+		segments[i].to = pos + shift;
+		segments[i].length = groups[i].start - pos;
+
+		groups[i].new_start = groups[i].start + shift;
+		shift += (int)groups[i].new_length - (int)groups[i].length;
+		pos = groups[i].start + groups[i].length;
+
+		if (groups[i].new_length != groups[i].length)
+			*moved = 1;
+	}
+
+	segments[nr].from = pos;
+	segments[nr].to = pos + shift;
+	segments[nr].length = total - pos;
+
+	return total + shift;
+}
+
+/* Move the kept stretches of a table into place in to, which may be the
+ * table itself.  The stretches are in order and so are their new places,
+ * so within one table those moving down go first, from the front, and
+ * then those moving up, from the back. */
+static void move_segments(void *to, void *from, size_t size, struct segment *segments, unsigned int nr)
+{
+	char *dst = to, *src = from;
+	unsigned int i;
+
+	if (dst != src) {
+		for (i = 0; i < nr; i++) {
+			if (segments[i].length)
+				memcpy(dst + segments[i].to * size, src + segments[i].from * size, segments[i].length * size);
+		}
+
+		return;
+	}
+
+	for (i = 0; i < nr; i++) {
+		if (segments[i].to < segments[i].from)
+			memmove(dst + segments[i].to * size, src + segments[i].from * size, segments[i].length * size);
+	}
+
+	for (i = nr; i-- > 0;) {
+		if (segments[i].to > segments[i].from)
+			memmove(dst + segments[i].to * size, src + segments[i].from * size, segments[i].length * size);
+	}
+}
+
+static int push_relinked(struct regraph *g, unsigned int block)
+{
+	unsigned int index = new_block_index(g, block);
+
+	return index != BINA_NO_INDEX && push_index(&g->relinked, index);
+}
+
+/* When the blocks move along in place, the only edges pointing at moved
+ * blocks are in the slices of the blocks after the first run, of their
+ * neighbours, and of the blocks with edges into the runs.  Find those
+ * before anything moves, by where they're going to be. */
+static int find_relinked(struct regraph *g)
+{
+	struct bina_context *ctx = g->ctx;
+	unsigned int i, b, n;
+
+	for (b = g->runs[0].first_block; b < ctx->nr_basic_blocks; b++) {
+		struct bina_basic_block *block = &ctx->blocks[b];
+
+		if (find_run(g, b))
+			continue;
+
+		if (push_relinked(g, b))
+			return -1;
+
+		for (n = 0; n < block->nr_successors; n++) {
+			if (push_relinked(g, block->successors[n]->index))
+				return -1;
+		}
+
+		for (n = 0; n < block->nr_predecessors; n++) {
+			if (push_relinked(g, block->predecessors[n]->index))
+				return -1;
+		}
+	}
+
+	for (i = 0; i < g->sources.nr; i++) {
+		if (push_relinked(g, g->sources.items[i]))
+			return -1;
+	}
+
+	for (i = 0; i < g->sinks.nr; i++) {
+		if (push_relinked(g, g->sinks.items[i]))
+			return -1;
+	}
+
+	sort_indices(&g->relinked);
+	return 0;
+}
+
+static void relink_edges(struct regraph *g, struct bina_basic_block *block)
+{
+	unsigned int n;
+
+	for (n = 0; n < block->nr_successors; n++) {
+		block->successors[n] = moved_block(g, block->successors[n]);
+	}
+
+	for (n = 0; n < block->nr_predecessors; n++) {
+		block->predecessors[n] = moved_block(g, block->predecessors[n]);
+	}
+}
+
+static void link_blocks(struct bina_context *ctx, unsigned int from, unsigned int to)
+{
+	unsigned int i;
+
+	for (i = from; i < to && i < ctx->nr_basic_blocks; i++) {
+		ctx->blocks[i].prev = i ? &ctx->blocks[i - 1] : NULL;
+		ctx->blocks[i].next = i + 1 < ctx->nr_basic_blocks ? &ctx->blocks[i + 1] : NULL;
+	}
+}
+
+/* Replace each run's blocks with new ones.  If the number of blocks
+ * changes, the ones after it move along, and everything pointing at them
+ * is pointed at where they are now.  Nothing before the first run moves,
+ * unless the blocks no longer fit and all of them do. */
+static int lay_out_blocks(struct regraph *g)
+{
+	struct bina_context *ctx = g->ctx;
+	struct bina_basic_block *blocks = ctx->blocks;
+	struct segment *segments;
+	struct group *groups;
+	unsigned int i, n, nr, first;
+	int rc = -1;
+
+	groups = malloc(g->nr_runs * sizeof(*groups));
+	segments = malloc((g->nr_runs + 1) * sizeof(*segments));
+	if (!groups || !segments)
+		goto out;
+
+	for (i = 0; i < g->nr_runs; i++) {
+		groups[i].start = g->runs[i].first_block;
+		groups[i].length = g->runs[i].last_block - g->runs[i].first_block + 1;
+		groups[i].new_length = g->runs[i].nr_blocks;
+	}
+
+	nr = plan_groups(groups, g->nr_runs, ctx->nr_basic_blocks, segments, &g->moved_blocks);
+
+	for (i = 0; i < g->nr_runs; i++) {
+		g->runs[i].new_first_block = groups[i].new_start;
+	}
+
+	g->old_blocks = ctx->blocks;
+
+	if (g->moved_blocks) {
+		if (find_relinked(g))
+			goto out;
+
+		if (nr > ctx->max_basic_blocks) {
+			unsigned int capacity = nr + nr / 8 + 16;
+
+			blocks = bina_arena_alloc(&ctx->block_arena, capacity, sizeof(*blocks));
+			if (!blocks)
+				goto out;
+
+			ctx->max_basic_blocks = capacity;
+			g->grown_blocks = 1;
+		}
+
+		move_segments(blocks, ctx->blocks, sizeof(*blocks), segments, g->nr_runs + 1);
+		ctx->blocks = blocks;
+		ctx->nr_basic_blocks = nr;
+
+		if (g->grown_blocks) {
+			for (i = 0; i < ctx->nr_edges; i++) {
+				ctx->successors[i] = moved_block(g, ctx->successors[i]);
+				ctx->predecessors[i] = moved_block(g, ctx->predecessors[i]);
+			}
+		} else {
+			for (i = 0; i < g->relinked.nr; i++) {
+				relink_edges(g, &ctx->blocks[g->relinked.items[i]]);
+			}
+		}
+
+		first = g->grown_blocks ? 0 : g->runs[0].first;
+		for (i = first; i < ctx->nr_instructions; i++) {
+			ctx->instructions[i].basic_block = moved_block(g, ctx->instructions[i].basic_block);
+		}
+
+		first = g->grown_blocks ? 0 : g->runs[0].new_first_block;
+		for (i = first; i < nr; i++) {
+			blocks[i].index = i;
+		}
+	}
+
+	for (i = 0; i < g->nr_runs; i++) {
+		struct run *run = &g->runs[i];
+		struct bina_basic_block *block = NULL;
+		unsigned int b = run->new_first_block;
+
+		for (n = run->first; n < run->end; n++) {
+			struct bina_instruction *ins = &ctx->instructions[n];
+
+			if (ins->basic_block_leader) {
+				block = &ctx->blocks[b];
+				memset(block, 0, sizeof(*block));
+				block->index = b++;
+				block->offset = ins->offset;
+				block->base = ins->base;
+				block->instructions = ins;
+			}
+
+			ins->basic_block = block;
+			block->nr_instructions++;
+			block->size += ins->size;
+		}
+
+		if (!g->moved_blocks)
+			link_blocks(ctx, run->new_first_block ? run->new_first_block - 1 : 0,
+				run->new_first_block + run->nr_blocks + 1);
+	}
+
+	if (g->moved_blocks) {
+		first = g->grown_blocks || !g->runs[0].new_first_block ? 0 : g->runs[0].new_first_block - 1;
+		link_blocks(ctx, first, ctx->nr_basic_blocks);
+	}
+
+	for (i = 0; i < g->sources.nr; i++) {
+		g->sources.items[i] = new_block_index(g, g->sources.items[i]);
+	}
+
+	for (i = 0; i < g->sinks.nr; i++) {
+		g->sinks.items[i] = new_block_index(g, g->sinks.items[i]);
+	}
+
+	rc = 0;
+
+out:
+	free(groups);
+	free(segments);
+	return rc;
+}
+
+static int compare_edges(const void *a, const void *b)
+{
+	const struct new_edge *x = a, *y = b;
+
+	if (x->target != y->target)
+		return (x->target > y->target) - (x->target < y->target);
+
+	return (x->position > y->position) - (x->position < y->position);
+}
+
+/* The first of the new edges into block, or where it would be. */
+static unsigned int find_edges_into(struct regraph *g, unsigned int block)
+{
+	unsigned int low = 0, high = g->succ_first[g->changed.nr];
+
+	while (low < high) {
+		unsigned int mid = low + (high - low) / 2;
+
+		if (g->edges[mid].target < block)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return low;
+}
+
+/* Lay out the predecessors of block, or only count them if pred is NULL.
+ * The ones outside changed are kept, and merged in block order with the
+ * new edges from blocks in it, so they come out as bina_detect_basic_blocks()
+ * would lay them out. */
+static unsigned int block_predecessors(struct regraph *g, unsigned int index,
+	struct bina_basic_block **pred, unsigned char *pred_kinds)
+{
+	struct bina_context *ctx = g->ctx;
+	struct bina_basic_block *block = &ctx->blocks[index];
+	unsigned int e = find_edges_into(g, index), end = g->succ_first[g->changed.nr];
+	unsigned int n = 0, nr = 0, nr_old = find_new_run(g, index) ? 0 : block->nr_predecessors;
+
+	for (;;) {
+		struct bina_basic_block *old = NULL;
+		int from_new;
+
+		while (n < nr_old) {
+			old = block->predecessors[n];
+			if (old && !find_index(&g->changed, old->index))
+				break;
+
+			old = NULL;
+			n++;
+		}
+
+		from_new = e < end && g->edges[e].target == index;
+		if (!old && !from_new)
+			break;
+
+		if (from_new && (!old || g->edges[e].source < old->index)) {
+			if (pred) {
+				pred[nr] = &ctx->blocks[g->edges[e].source];
+				pred_kinds[nr] = g->succ_kinds[g->edges[e].position];
+			}
+
+			e++;
+		} else {
+			if (pred) {
+				pred[nr] = old;
+				pred_kinds[nr] = block->predecessor_kinds[n];
+			}
+
+			n++;
+		}
+
+		nr++;
+	}
+
+	return nr;
+}
+
+/* Work out the successors of every block in a run and of every source,
+ * and then the predecessors of every block they reach, or used to. */
+static int find_edges(struct regraph *g)
+{
+	struct bina_context *ctx = g->ctx;
+	struct bina_basic_block **targets;
+	unsigned char *kinds;
+	unsigned int i, k, n, nr, max_edges = bina_max_block_edges(ctx);
+	int rc = -1;
+
+	targets = malloc(max_edges * sizeof(*targets));
+	kinds = malloc(max_edges * sizeof(*kinds));
+	if (!targets || !kinds)
+		goto out;
+
+	for (i = 0; i < g->nr_runs; i++) {
+		for (n = 0; n < g->runs[i].nr_blocks; n++) {
+			if (push_index(&g->changed, g->runs[i].new_first_block + n) ||
+					push_index(&g->reached, g->runs[i].new_first_block + n))
+				goto out;
+		}
+	}
+
+	for (i = 0; i < g->sources.nr; i++) {
+		if (push_index(&g->changed, g->sources.items[i]))
+			goto out;
+	}
+
+	for (i = 0; i < g->sinks.nr; i++) {
+		if (push_index(&g->reached, g->sinks.items[i]))
+			goto out;
+	}
+
+	sort_indices(&g->changed);
+
+	/* Count the new successors, then fill them in. */
+	g->succ_first = malloc((g->changed.nr + 1) * sizeof(*g->succ_first));
+	if (!g->succ_first)
+		goto out;
+
+	for (k = 0, nr = 0; k < g->changed.nr; k++) {
+		g->succ_first[k] = nr;
+		nr += bina_block_edges(&ctx->blocks[g->changed.items[k]], targets, kinds);
+	}
+
+	g->succ_first[k] = nr;
+
+	g->succ = malloc(nr * sizeof(*g->succ));
+	g->succ_kinds = malloc(nr * sizeof(*g->succ_kinds));
+	g->edges = malloc(nr * sizeof(*g->edges));
+	if (nr && (!g->succ || !g->succ_kinds || !g->edges))
+		goto out;
+
+	for (k = 0; k < g->changed.nr; k++) {
+		unsigned int pos = g->succ_first[k];
+
+		nr = bina_block_edges(&ctx->blocks[g->changed.items[k]], targets, kinds);
+		for (n = 0; n < nr; n++) {
+			g->succ[pos + n] = targets[n];
+			g->succ_kinds[pos + n] = kinds[n];
+			g->edges[pos + n].target = targets[n]->index;
+			g->edges[pos + n].source = g->changed.items[k];
+			g->edges[pos + n].position = pos + n;
+
+			if (push_index(&g->reached, targets[n]->index))
+				goto out;
+		}
+	}
+
+	qsort(g->edges, g->succ_first[g->changed.nr], sizeof(*g->edges), compare_edges);
+	sort_indices(&g->reached);
+
+	/* The same again for the predecessors. */
+	g->pred_first = malloc((g->reached.nr + 1) * sizeof(*g->pred_first));
+	if (!g->pred_first)
+		goto out;
+
+	for (k = 0, nr = 0; k < g->reached.nr; k++) {
+		g->pred_first[k] = nr;
+		nr += block_predecessors(g, g->reached.items[k], NULL, NULL);
+	}
+
+	g->pred_first[k] = nr;
+
+	g->pred = malloc(nr * sizeof(*g->pred));
+	g->pred_kinds = malloc(nr * sizeof(*g->pred_kinds));
+	if (nr && (!g->pred || !g->pred_kinds))
+		goto out;
+
+	for (k = 0; k < g->reached.nr; k++) {
+		block_predecessors(g, g->reached.items[k], &g->pred[g->pred_first[k]], &g->pred_kinds[g->pred_first[k]]);
+	}
+
+	rc = 0;
+
+out:
+	free(targets);
+	free(kinds);
+	return rc;
+}
+
+/* Group the blocks in a list for laying out one direction of their edges:
+ * a run's blocks all together, standing in for the old run's slices, and
+ * any other block by itself. */
+static unsigned int group_edges(struct regraph *g, struct index_list *list, unsigned int *first,
+	int successors, struct group *groups)
+{
+	struct bina_context *ctx = g->ctx;
+	unsigned int k, nr = 0;
+
+	for (k = 0; k < list->nr; k += groups[nr++].nr_blocks) {
+		struct group *group = &groups[nr];
+		struct bina_basic_block *block = &ctx->blocks[list->items[k]];
+		struct run *run = find_new_run(g, list->items[k]);
+
+		group->first_block = list->items[k];
+		if (run) {
+			group->nr_blocks = run->nr_blocks;
+			group->start = successors ? run->first_successor : run->first_predecessor;
+			group->length = successors ? run->nr_successors : run->nr_predecessors;
+		} else {
+			group->nr_blocks = 1;
+			group->start = successors ? block->successors - ctx->successors : block->predecessors - ctx->predecessors;
+			group->length = successors ? block->nr_successors : block->nr_predecessors;
+		}
+
+		group->new_length = first[k + group->nr_blocks] - first[k];
+	}
+
+	return nr;
+}
+
+static void set_slice(struct bina_context *ctx, struct bina_basic_block *block, int successors,
+	unsigned int start, unsigned int nr)
+{
+	if (successors) {
+		block->successors = &ctx->successors[start];
+		block->successor_kinds = &ctx->successor_kinds[start];
+		block->nr_successors = nr;
+	} else {
+		block->predecessors = &ctx->predecessors[start];
+		block->predecessor_kinds = &ctx->predecessor_kinds[start];
+		block->nr_predecessors = nr;
+	}
+}
+
+/* Put one direction's edges in place, in the tables already in ctx.  The
+ * slices of blocks outside the groups are kept, and moved along if the
+ * groups before them have changed length.  Only slices from the first
+ * group on move, unless the tables themselves have. */
+static void place_edges(struct regraph *g, struct group *groups, unsigned int nr_groups, int successors,
+	struct bina_basic_block **old_edges, int moved)
+{
+	struct bina_context *ctx = g->ctx;
+	struct index_list *list = successors ? &g->changed : &g->reached;
+	struct bina_basic_block **edges = successors ? g->succ : g->pred;
+	unsigned char *kinds = successors ? g->succ_kinds : g->pred_kinds;
+	unsigned int *first = successors ? g->succ_first : g->pred_first;
+	unsigned int i, k, b, gi = 0;
+	int shift = 0;
+
+	if (moved) {
+		i = g->grown_edges || !nr_groups ? 0 : groups[0].first_block;
+		for (; i < ctx->nr_basic_blocks; i++) {
+			struct bina_basic_block *block = &ctx->blocks[i];
+
+			if (gi < nr_groups && i == groups[gi].first_block) {
+				i += groups[gi].nr_blocks - 1;
+				shift = (int)(groups[gi].new_start + groups[gi].new_length) -
+					(int)(groups[gi].start + groups[gi].length);
+				gi++;
+				continue;
+			}
+
+			if (successors)
+				set_slice(ctx, block, 1, block->successors - old_edges + shift, block->nr_successors);
+			else
+				set_slice(ctx, block, 0, block->predecessors - old_edges + shift, block->nr_predecessors);
+		}
+	}
+
+	for (i = 0, k = 0; i < nr_groups; i++) {
+		unsigned int pos = groups[i].new_start;
+
+		for (b = 0; b < groups[i].nr_blocks; b++, k++) {
+			unsigned int nr = first[k + 1] - first[k];
+
+			set_slice(ctx, &ctx->blocks[list->items[k]], successors, pos, nr);
+			memcpy(successors ? &ctx->successors[pos] : &ctx->predecessors[pos], &edges[first[k]], nr * sizeof(*edges));
+			memcpy(successors ? &ctx->successor_kinds[pos] : &ctx->predecessor_kinds[pos], &kinds[first[k]], nr);
+			pos += nr;
+		}
+	}
+}
+
+/* Write the new edges into the shared tables.  Any that change length
+ * move the rest along, and if they no longer fit the tables are grown,
+ * with some room to spare for the next patch. */
+static int lay_out_edges(struct regraph *g)
+{
+	struct bina_context *ctx = g->ctx;
+	struct bina_basic_block **successors = ctx->successors, **predecessors = ctx->predecessors;
+	unsigned char *successor_kinds = ctx->successor_kinds, *predecessor_kinds = ctx->predecessor_kinds;
+	struct group *succ_groups, *pred_groups;
+	struct segment *succ_segments, *pred_segments;
+	unsigned int nr_succ, nr_pred, nr;
+	int moved_succ, moved_pred, rc = -1;
+
+	succ_groups = malloc(g->changed.nr * sizeof(*succ_groups));
+	pred_groups = malloc(g->reached.nr * sizeof(*pred_groups));
+	succ_segments = malloc((g->changed.nr + 1) * sizeof(*succ_segments));
+	pred_segments = malloc((g->reached.nr + 1) * sizeof(*pred_segments));
+	if ((g->changed.nr && !succ_groups) || (g->reached.nr && !pred_groups) || !succ_segments || !pred_segments)
+		goto out;
+
+	nr_succ = group_edges(g, &g->changed, g->succ_first, 1, succ_groups);
+	nr_pred = group_edges(g, &g->reached, g->pred_first, 0, pred_groups);
+
+	nr = plan_groups(succ_groups, nr_succ, ctx->nr_edges, succ_segments, &moved_succ);
+	plan_groups(pred_groups, nr_pred, ctx->nr_edges, pred_segments, &moved_pred);
+
+	if (nr > ctx->max_edges) {
+		unsigned int capacity = nr + nr / 8 + 64;
+
+		successors = bina_arena_alloc(&ctx->block_arena, capacity, sizeof(*successors));
+		successor_kinds = bina_arena_alloc(&ctx->block_arena, capacity, sizeof(*successor_kinds));
+		predecessors = bina_arena_alloc(&ctx->block_arena, capacity, sizeof(*predecessors));
+		predecessor_kinds = bina_arena_alloc(&ctx->block_arena, capacity, sizeof(*predecessor_kinds));
+		if (!successors || !successor_kinds || !predecessors || !predecessor_kinds)
+			goto out;
+
+		ctx->max_edges = capacity;
+		moved_succ = moved_pred = g->grown_edges = 1;
+	}
+
+	if (moved_succ) {
+		move_segments(successors, ctx->successors, sizeof(*successors), succ_segments, nr_succ + 1);
+		move_segments(successor_kinds, ctx->successor_kinds, sizeof(*successor_kinds), succ_segments, nr_succ + 1);
+	}
+
+	if (moved_pred) {
+		move_segments(predecessors, ctx->predecessors, sizeof(*predecessors), pred_segments, nr_pred + 1);
+		move_segments(predecessor_kinds, ctx->predecessor_kinds, sizeof(*predecessor_kinds), pred_segments, nr_pred + 1);
+	}
+
+	{
+		struct bina_basic_block **old_successors = ctx->successors, **old_predecessors = ctx->predecessors;
+
+		ctx->successors = successors;
+		ctx->successor_kinds = successor_kinds;
+		ctx->predecessors = predecessors;
+		ctx->predecessor_kinds = predecessor_kinds;
+		ctx->nr_edges = nr;
+
+		place_edges(g, succ_groups, nr_succ, 1, old_successors, moved_succ);
+		place_edges(g, pred_groups, nr_pred, 0, old_predecessors, moved_pred);
+	}
+
+	g->moved_edges = moved_succ || moved_pred;
+	rc = 0;
+
+out:
+	free(succ_groups);
+	free(pred_groups);
+	free(succ_segments);
+	free(pred_segments);
+	return rc;
+}
+
+static void sync_blocks_below(struct bina_context *ctx, struct index_list *list, unsigned int end)
+{
+	unsigned int i;
+
+	for (i = 0; i < list->nr && list->items[i] < end; i++) {
+		bina_compact_sync_block(ctx, list->items[i]);
+	}
+}
+
+/* Bring the compact view's blocks along: the ones that changed, and if
+ * anything moved, every one from the first of those on, and the ones
+ * with edges to moved blocks.  Only if the hot tables are outgrown are
+ * they all laid out again. */
+static int sync_compact(struct regraph *g)
+{
+	struct bina_context *ctx = g->ctx;
+	struct bina_compact *c = ctx->compact;
+	unsigned int i, first = ctx->nr_basic_blocks;
+
+	if (ctx->max_basic_blocks > c->max_blocks || ctx->max_edges > c->max_edges)
+		return bina_compact_sync_blocks(ctx);
+
+	c->nr_blocks = ctx->nr_basic_blocks;
+	c->nr_edges = ctx->nr_edges;
+
+	if (g->moved_blocks || g->moved_edges || g->delta) {
+		if (g->changed.nr)
+			first = g->changed.items[0];
+		if (g->reached.nr && g->reached.items[0] < first)
+			first = g->reached.items[0];
+
+		for (i = first; i < ctx->nr_basic_blocks; i++) {
+			bina_compact_sync_block(ctx, i);
+		}
+	}
+
+	sync_blocks_below(ctx, &g->changed, first);
+	sync_blocks_below(ctx, &g->reached, first);
+	sync_blocks_below(ctx, &g->relinked, first);
+	return 0;
+}
+
+/* Work out the blocks and edges again around the patch only, and splice
+ * them in.  The leaders can only change next to the patched instructions
+ * and at the targets of branches in the patch, and the edges only of the
+ * blocks there, of those with edges into them, and of those branching
+ * into the patched bytes.  Those last are found through the branch
+ * references, built the first time round.  When the number of blocks or
+ * edges changes, the ones after are moved along and renumbered, which is
+ * a copy rather than any analysis. */
+static int update_blocks(struct patch *patch)
+{
+	struct bina_context *ctx = patch->ctx;
+	struct bina_instruction *old_instructions = ctx->instructions;
+	struct regraph g = { .patch = patch, .ctx = ctx };
+	int rc = -1;
+
+	g.delta = (int)patch->nr_insns - (int)(patch->last - patch->first);
+
+	/* Nothing left to keep. */
+	if (ctx->nr_instructions - (patch->last - patch->first) + patch->nr_insns == 0)
+		return -1;
+
+	if (!ctx->branch_refs && build_refs(ctx))
+		goto out;
+
+	if (find_runs(&g) || find_sources(&g) || update_refs(&g))
+		goto out;
+
+	if (splice(patch))
+		goto out;
+
+	retarget(&g, old_instructions);
+	if (ctx->compact)
+		update_compact(patch);
+
+	mark_run_leaders(&g);
+
+	if (lay_out_blocks(&g) || find_edges(&g) || lay_out_edges(&g))
+		goto out;
+
+	if (ctx->compact && sync_compact(&g))
+		goto out;
+
+	/* The loops are found again on request. */
+	ctx->loops = NULL;
+	bina_arena_reset(&ctx->loop_arena);
+	rc = 0;
+
+out:
+	free(g.runs);
+	free(g.sources.items);
+	free(g.sinks.items);
+	free(g.changed.items);
+	free(g.succ);
+	free(g.succ_kinds);
+	free(g.succ_first);
+	free(g.edges);
+	free(g.reached.items);
+	free(g.pred);
+	free(g.pred_kinds);
+	free(g.pred_first);
+	free(g.relinked.items);
+	return rc;
+}
+
+/* Bring the context up to date after the bytes [offset, offset + length)
+ * have been changed in place.  Only the instructions around the patch are
+ * decoded again.  If the patch leaves the control flow skeleton alone,
+ * the blocks and edges are kept as they are.  Otherwise only the blocks
+ * and edges around it are worked out again, unless it touches a jump
+ * table, in which case the tables are read again and the blocks detected
+ * again from scratch.  Recursive contexts are decoded again from their
+ * entry points, since a patch can change what's reachable anywhere. */
+int bina_patch_range(struct bina_context *ctx, unsigned int offset, unsigned int length)
+{
+	struct patch patch = { .ctx = ctx };
+	int had_blocks = ctx->blocks != NULL;
+	int had_compact = ctx->compact != NULL;
+	int rc = -1;
+	unsigned int i;
+
+	if (!ctx->arch->decode_instruction || offset >= ctx->size || !length)
+		return -1;
+
+	if (length > ctx->size - offset)
+		length = ctx->size - offset;
+
+	/* Any rendered text is stale now. */
+	free(ctx->text);
+	free(ctx->text_offsets);
+	ctx->text = NULL;
+	ctx->text_offsets = NULL;
+	
+	/* So are the function boundaries.  They're found again on request. */
+	ctx->functions = NULL;
+	ctx->nr_functions = 0;
+	ctx->call_graph = NULL;
+	bina_arena_reset(&ctx->function_arena);
+
+	if (ctx->flags & BINA_RECURSIVE) {
+		forget_jump_tables(ctx);
+		forget_refs(ctx);
+		bina_destroy_compact(ctx);
+		if (had_blocks)
+			bina_destroy_basic_blocks(ctx);
+
+		for (i = 0; i < ctx->nr_instructions; i++) {
+			bina_free_operands(ctx, ctx->instructions[i].operands, ctx->instructions[i].nr_operands);
+		}
+
+		free(ctx->instructions);
+		ctx->instructions = NULL;
+		ctx->nr_instructions = ctx->max_instructions = 0;
+
+		if (bina_recursive_sweep(ctx) || bina_build_offset_index(ctx))
+			return -1;
+
+		goto rebuild;
+	}
+
+	if (redecode(&patch, offset, length))
+		goto out;
+
+	if (same_skeleton(&patch)) {
+		rc = splice(&patch);
+		if (!rc && ctx->compact)
+			update_compact(&patch);
+
+		goto out;
+	}
+
+	if (had_blocks && !touches_jump_tables(&patch) && !update_blocks(&patch))
+		goto rebuild;
+
+	forget_jump_tables(ctx);
+	forget_refs(ctx);
+
+	/* The blocks have to be torn down before the instructions move
+	 * underneath them. */
+	if (ctx->blocks)
+		bina_destroy_basic_blocks(ctx);
+
+	if (!patch.spliced && splice(&patch))
+		goto out;
+
+	/* Branch targets are resolved again along with the leaders. */
+	for (i = 0; i < ctx->nr_instructions; i++) {
+		ctx->instructions[i].branch_target = NULL;
+	}
+
+	if (ctx->compact) {
+		update_compact(&patch);
+		retarget_compact(ctx);
+	}
+
+rebuild:
+	rc = 0;
+	if (had_compact && !ctx->compact)
+		rc = bina_build_compact(ctx);
+
+	if (!rc && had_blocks && !ctx->blocks)
+		rc = bina_detect_basic_blocks(ctx);
+
+out:
+	free(patch.insns);
+	return rc;
+}
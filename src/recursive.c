@@ -0,0 +1,186 @@
+#include <bina.h>
+#include <malloc.h>
+#include <stdlib.h>
+
+struct walk_insn {
+	unsigned int offset;
+	unsigned int branch_target_offset;
+	unsigned char size;
+	unsigned char type;
+};
+
+struct walk {
+	struct bina_context *ctx;
+
+	/* One bit per byte for bytes already claimed by an instruction. */
+	unsigned char *covered;
+
+	unsigned int *stack;
+	unsigned int nr_stack, max_stack;
+
+	struct walk_insn *insns;
+	unsigned int nr_insns, max_insns;
+};
+
+static inline int is_covered(struct walk *walk, unsigned int offset)
+{
+	return walk->covered[offset >> 3] & (1 << (offset & 7));
+}
+
+static inline void set_covered(struct walk *walk, unsigned int offset)
+{
+	walk->covered[offset >> 3] |= 1 << (offset & 7);
+}
+
+static int push(struct walk *walk, unsigned int offset)
+{
+	if (offset >= walk->ctx->size || is_covered(walk, offset))
+		return 0;
+
+	if (walk->nr_stack == walk->max_stack) {
+		unsigned int capacity = walk->max_stack ? walk->max_stack * 2 : 1024;
+		unsigned int *stack = realloc(walk->stack, capacity * sizeof(*stack));
+
+		if (!stack)
+			return -1;
+
+		walk->stack = stack;
+		walk->max_stack = capacity;
+	}
+
+	walk->stack[walk->nr_stack++] = offset;
+	return 0;
+}
+
+static struct walk_insn *new_insn(struct walk *walk)
+{
+	if (walk->nr_insns == walk->max_insns) {
+		unsigned int capacity = walk->max_insns ? walk->max_insns * 2 : 4096;
+		struct walk_insn *insns = realloc(walk->insns, capacity * sizeof(*insns));
+
+		if (!insns)
+			return NULL;
+
+		walk->insns = insns;
+		walk->max_insns = capacity;
+	}
+
+	return &walk->insns[walk->nr_insns++];
+}
+
+/* Decode one straight-line run, from offset up to the first instruction
+ * that doesn't fall through, queueing branch targets as we go.  The run
+ * also stops on reaching code that's already been decoded.  That includes
+ * a jump into the middle of an existing instruction, which is left
+ * undecoded rather than creating overlapping instructions. */
+static int walk_run(struct walk *walk, unsigned int offset)
+{
+	struct bina_context *ctx = walk->ctx;
+
+	while (offset < ctx->size && !is_covered(walk, offset)) {
+		struct bina_instruction decoded;
+		struct walk_insn *insn;
+		unsigned int length, n;
+
+		length = ctx->arch->decode_instruction(ctx->base, ctx->size, offset, &decoded);
+		if (!length)
+			return 0;
+
+		for (n = 1; n < length; n++) {
+			if (is_covered(walk, offset + n))
+				return 0;
+		}
+
+		for (n = 0; n < length; n++) {
+			set_covered(walk, offset + n);
+		}
+
+		insn = new_insn(walk);
+		if (!insn)
+			return -1;
+
+		insn->offset = offset;
+		insn->size = length;
+		insn->type = decoded.type;
+		insn->branch_target_offset = decoded.branch_target_offset;
+
+		offset += length;
+
+		switch (decoded.type) {
+		case IT_CALL:
+		case IT_C_BRANCH:
+			if (push(walk, decoded.branch_target_offset))
+				return -1;
+			break;
+		case IT_U_BRANCH:
+			return push(walk, decoded.branch_target_offset);
+		case IT_RETURN:
+			return 0;
+		default:
+			break;
+		}
+	}
+
+	return 0;
+}
+
+static int compare_insns(const void *a, const void *b)
+{
+	const struct walk_insn *x = a, *y = b;
+
+	return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+int bina_recursive_sweep(struct bina_context *ctx)
+{
+	struct walk walk = { .ctx = ctx };
+	unsigned int i, entry = 0;
+	int rc = -1;
+
+	walk.covered = calloc(ctx->size / 8 + 1, 1);
+	if (!walk.covered)
+		return -1;
+
+	/* With no entry points, the start of the section is the only one. */
+	if (!ctx->nr_entries) {
+		if (push(&walk, 0))
+			goto out;
+	}
+
+	for (i = 0; i < ctx->nr_entries; i++) {
+		if (push(&walk, ctx->entries[i]))
+			goto out;
+	}
+
+	while (walk.nr_stack) {
+		entry = walk.stack[--walk.nr_stack];
+
+		if (walk_run(&walk, entry))
+			goto out;
+	}
+
+	/* The rest of the library expects instructions in address order. */
+	qsort(walk.insns, walk.nr_insns, sizeof(*walk.insns), compare_insns);
+
+	for (i = 0; i < walk.nr_insns; i++) {
+		struct bina_instruction *ins = bina_new_instruction(ctx);
+
+		if (!ins)
+			goto out;
+
+		ins->offset = walk.insns[i].offset;
+		ins->base = ctx->base + ins->offset;
+		ins->size = walk.insns[i].size;
+		ins->type = walk.insns[i].type;
+		ins->branch_target_offset = walk.insns[i].branch_target_offset;
+	}
+
+	bina_finish_instructions(ctx);
+	rc = 0;
+
+out:
+	free(walk.covered);
+	free(walk.stack);
+	free(walk.insns);
+	return rc;
+}
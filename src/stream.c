@@ -0,0 +1,162 @@
+#include <bina.h>
+#include <malloc.h>
+#include <string.h>
+
+/* The most instructions held at once.  A straight-line run longer than
+ * this is delivered as several blocks. */
+#define STREAM_WINDOW		4096
+
+struct stream {
+	struct bina_context ctx;
+	const struct bina_stream_ops *ops;
+	void *priv;
+
+	/* One bit per byte, set for forward branch targets not yet reached. */
+	unsigned char *leaders;
+
+	struct bina_instruction *window;
+	unsigned int nr_window;
+
+	struct bina_basic_block block;
+	unsigned int nr_blocks;
+};
+
+static inline int is_leader(struct stream *stream, unsigned int offset)
+{
+	return stream->leaders[offset >> 3] & (1 << (offset & 7));
+}
+
+static inline void set_leader(struct stream *stream, unsigned int offset)
+{
+	stream->leaders[offset >> 3] |= 1 << (offset & 7);
+}
+
+static int flush_block(struct stream *stream)
+{
+	struct bina_basic_block *block = &stream->block;
+	int rc = 0;
+
+	if (!stream->nr_window)
+		return 0;
+
+	memset(block, 0, sizeof(*block));
+	block->index = stream->nr_blocks++;
+	block->offset = stream->window[0].offset;
+	block->base = stream->window[0].base;
+	block->instructions = stream->window;
+	block->nr_instructions = stream->nr_window;
+	block->size = stream->window[stream->nr_window - 1].offset +
+		stream->window[stream->nr_window - 1].size - block->offset;
+
+	if (stream->ops->block)
+		rc = stream->ops->block(block, stream->priv);
+
+	/* Anything the callbacks decoded for this window goes away with it. */
+	stream->nr_window = 0;
+	bina_arena_reset(&stream->ctx.arena);
+
+	return rc;
+}
+
+int bina_stream(const struct bina_arch *arch, char *base, unsigned int size, const struct bina_stream_ops *ops, void *priv)
+{
+	struct stream stream;
+	unsigned int offset = 0, length;
+	int rc = 0;
+
+	if (!arch || !base || !ops || !arch->decode_instruction)
+		return -1;
+
+	memset(&stream, 0, sizeof(stream));
+	stream.ops = ops;
+	stream.priv = priv;
+
+	/* A context with no instruction array, so the usual per-instruction
+	 * helpers (operands, text) still work on what we hand out. */
+	stream.ctx.arch = arch;
+	stream.ctx.base = base;
+	stream.ctx.size = size;
+	stream.ctx.flags = BINA_FAST_DECODE | BINA_LAZY_OPERANDS;
+	pthread_mutex_init(&stream.ctx.lock, NULL);
+
+	stream.leaders = calloc(size / 8 + 1, 1);
+	stream.window = calloc(STREAM_WINDOW, sizeof(*stream.window));
+	if (!stream.leaders || !stream.window) {
+		rc = -1;
+		goto out;
+	}
+
+	while (offset < size) {
+		struct bina_instruction *ins;
+
+		/* Reaching a forward branch target, or filling the window,
+		 * ends the current block. */
+		if (is_leader(&stream, offset) || stream.nr_window == STREAM_WINDOW) {
+			rc = flush_block(&stream);
+			if (rc)
+				goto out;
+		}
+
+		ins = &stream.window[stream.nr_window];
+		memset(ins, 0, sizeof(*ins));
+
+		length = arch->decode_instruction(base, size, offset, ins);
+		if (!length) {
+			/* Undecodable bytes break the block too. */
+			rc = flush_block(&stream);
+			if (rc)
+				goto out;
+
+			offset++;
+			continue;
+		}
+
+		ins->index = stream.nr_window;
+		ins->offset = offset;
+		ins->base = base + offset;
+		ins->size = length;
+		ins->context = &stream.ctx;
+
+		if (ins->index > 0) {
+			ins->prev = ins - 1;
+			ins->prev->next = ins;
+		}
+
+		stream.nr_window++;
+		offset += length;
+
+		if (ops->instruction) {
+			rc = ops->instruction(ins, priv);
+			if (rc)
+				goto out;
+		}
+
+		switch (ins->type) {
+		case IT_CALL:
+		case IT_U_BRANCH:
+		case IT_C_BRANCH:
+			/* Targets behind us have already been delivered, so only
+			 * forward targets can still start a block. */
+			if (ins->branch_target_offset >= offset && ins->branch_target_offset < size)
+				set_leader(&stream, ins->branch_target_offset);
+
+			/* Fall through. */
+		case IT_RETURN:
+			rc = flush_block(&stream);
+			if (rc)
+				goto out;
+			break;
+		default:
+			break;
+		}
+	}
+
+	rc = flush_block(&stream);
+
+out:
+	bina_arena_destroy(&stream.ctx.arena);
+	pthread_mutex_destroy(&stream.ctx.lock);
+	free(stream.window);
+	free(stream.leaders);
+	return rc;
+}
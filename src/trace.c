@@ -1,25 +1,179 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <malloc.h>
 #include <unistd.h>
+#include <sys/mman.h>
 #include <sys/ptrace.h>
 #include <sys/user.h>
 #include <sys/wait.h>
 #include <bina.h>
 
+/* The most text read and written back in one go when patching a batch
+ * of breakpoints. */
+#define BREAKPOINT_RANGE	(1024 * 1024)
+
+/* Threads the tracee creates are traced from their first instruction,
+ * and the tracee goes with the tracer. */
+#define TRACE_OPTIONS	(PTRACE_O_TRACECLONE | PTRACE_O_TRACEEXEC | PTRACE_O_EXITKILL)
+
+static struct bina_thread *find_thread(struct bina_trace *trace, pid_t tid)
+{
+	unsigned int i;
+	
+	for (i = 0; i < trace->nr_threads; i++) {
+		if (trace->threads[i].tid == tid)
+			return &trace->threads[i];
+	}
+	
+	return NULL;
+}
+
+/* Track a thread, if it isn't already.  This can move the others. */
+static struct bina_thread *add_thread(struct bina_trace *trace, pid_t tid)
+{
+	struct bina_thread *thread = find_thread(trace, tid);
+	
+	if (thread)
+		return thread;
+	
+	if (trace->nr_threads == trace->max_threads) {
+		unsigned int capacity = trace->max_threads ? trace->max_threads * 2 : 8;
+		
+		thread = realloc(trace->threads, capacity * sizeof(*thread));
+		if (!thread)
+			return NULL;
+		
+		trace->threads = thread;
+		trace->max_threads = capacity;
+	}
+	
+	thread = &trace->threads[trace->nr_threads++];
+	thread->tid = tid;
+	thread->stopped = 0;
+	thread->stepping = NULL;
+	
+	return thread;
+}
+
+static void remove_thread(struct bina_trace *trace, struct bina_thread *thread)
+{
+	*thread = trace->threads[--trace->nr_threads];
+}
+
+/* Map the scratch area for out of line instructions, by having the
+ * stopped tracee make an mmap2 system call from an int $0x80 put over
+ * its next instruction for a moment.  Every instruction gets a slot, so
+ * the area is big, but only the pages that get used are ever touched. */
+static int map_scratch(struct bina_trace *trace)
+{
+	static const unsigned char syscall_code[2] = { 0xcd, 0x80 };
+	struct user_regs_struct regs, saved;
+	unsigned char code[sizeof(syscall_code)];
+	unsigned long size;
+	int status, rc = -1;
+	
+	size = ((unsigned long)trace->context->nr_instructions * BINA_DISPLACED_SIZE + 4095) & ~4095UL;
+	
+	/* The exec stop is still inside the system call, whose return value
+	 * would land on top of ours, so run on to its exit first. */
+	if (ptrace(PTRACE_SYSCALL, trace->pid, NULL, NULL) < 0 ||
+			waitpid(trace->pid, &status, 0) < 0 || !WIFSTOPPED(status))
+		return -1;
+	
+	if (ptrace(PTRACE_GETREGS, trace->pid, NULL, &saved) < 0)
+		return -1;
+	
+	if (pread(trace->mem_fd, code, sizeof(code), saved.eip) != sizeof(code) ||
+			pwrite(trace->mem_fd, syscall_code, sizeof(code), saved.eip) != sizeof(code))
+		return -1;
+	
+	regs = saved;
+	regs.orig_eax = -1;
+	regs.eax = 192;
+	regs.ebx = 0;
+	regs.ecx = size;
+	regs.edx = PROT_READ | PROT_EXEC;
+	regs.esi = MAP_PRIVATE | MAP_ANONYMOUS;
+	regs.edi = -1;
+	regs.ebp = 0;
+	
+	if (ptrace(PTRACE_SETREGS, trace->pid, NULL, &regs) < 0 ||
+			ptrace(PTRACE_SINGLESTEP, trace->pid, NULL, NULL) < 0 ||
+			waitpid(trace->pid, &status, 0) < 0 || !WIFSTOPPED(status) ||
+			ptrace(PTRACE_GETREGS, trace->pid, NULL, &regs) < 0)
+		goto out;
+	
+	if ((unsigned long)regs.eax < (unsigned long)-4095)
+		trace->scratch = regs.eax;
+	
+	rc = 0;
+	
+out:
+	pwrite(trace->mem_fd, code, sizeof(code), saved.eip);
+	ptrace(PTRACE_SETREGS, trace->pid, NULL, &saved);
+	return rc;
+}
+
+/* The child stops itself before the exec, so it can be seized rather
+ * than asking to be traced, and the tracer then runs it up to the start
+ * of the new program. */
 static int start_child(struct bina_trace *trace)
 {
+	char path[64];
+	int status;
+	
 	trace->pid = fork();
 	
 	if (trace->pid == 0) {
-		ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+		raise(SIGSTOP);
 		execl(trace->path, trace->path, NULL);
-	} else if (trace->pid > 0) {
-		wait(NULL);
-	} else {
+		_exit(127);
+	} else if (trace->pid < 0) {
 		return (int)trace->pid;
 	}
 	
+	if (waitpid(trace->pid, &status, WUNTRACED) < 0 ||
+			ptrace(PTRACE_SEIZE, trace->pid, NULL, (void *)TRACE_OPTIONS) < 0)
+		goto fail;
+	
+	kill(trace->pid, SIGCONT);
+	
+	do {
+		if (waitpid(trace->pid, &status, 0) < 0 || !WIFSTOPPED(status))
+			goto fail;
+		
+		if (status >> 8 == (SIGTRAP | (PTRACE_EVENT_EXEC << 8)))
+			break;
+		
+		ptrace(PTRACE_CONT, trace->pid, NULL, (void *)(long)(status >> 16 ? 0 : WSTOPSIG(status)));
+	} while (1);
+	
+	if (!add_thread(trace, trace->pid))
+		goto fail;
+	
+	trace->threads[0].stopped = 1;
+	trace->current = trace->pid;
+	
+	/* Text is written through the tracee's memory file where we can,
+	 * since a tracer may write to read-only pages that way, and it
+	 * doesn't need the thread it goes through to be stopped. */
+	snprintf(path, sizeof(path), "/proc/%d/mem", (int)trace->pid);
+	trace->mem_fd = open(path, O_RDWR);
+	
+	/* Without somewhere to run instructions out of line, breakpoints
+	 * are all stepped over in place, so failing to map one isn't fatal. */
+	if (trace->mem_fd >= 0 && trace->context->arch->displace && map_scratch(trace))
+		trace->scratch = 0;
+	
 	return 0;
+	
+fail:
+	kill(trace->pid, SIGKILL);
+	waitpid(trace->pid, NULL, 0);
+	return -1;
 }
 
 struct bina_trace *bina_trace_init(struct bina_context *ctx, const char *path, void *text_base, bina_break_handler_fn handler)
@@ -35,9 +189,18 @@ struct bina_trace *bina_trace_init(struct bina_context *ctx, const char *path, v
 	trace->handler = handler;
 	trace->path = path;
 	trace->text_base = text_base;
+	trace->mem_fd = -1;
+	
+	trace->breakpoints = calloc(ctx->nr_instructions + 1, sizeof(*trace->breakpoints));
+	if (!trace->breakpoints) {
+		free(trace);
+		return NULL;
+	}
 	
 	rc = start_child(trace);
 	if (rc) {
+		free(trace->threads);
+		free(trace->breakpoints);
 		free(trace);
 		trace = NULL;
 	}
@@ -49,34 +212,98 @@ void bina_trace_destroy(struct bina_trace *trace)
 {
 	if (trace->pid > 0)
 		ptrace(PTRACE_KILL, trace->pid, NULL, NULL);
+	
+	if (trace->mem_fd >= 0)
+		close(trace->mem_fd);
+	
+	bina_arena_destroy(&trace->breakpoint_arena);
+	free(trace->threads);
+	free(trace->breakpoints);
 	free(trace);
 }
 
-static inline int do_install(struct bina_breakpoint *brk)
+/* Patch a byte buffer holding the tracee's memory from base, changing
+ * only the bytes of a breakpoint's break code that are under the break
+ * mask. */
+static void patch_bytes(struct bina_trace *trace, unsigned char *buffer, unsigned long base,
+	struct bina_breakpoint *brk, unsigned long code)
 {
-	ptrace(PTRACE_POKETEXT, brk->trace->pid, (void *)brk->addr, brk->code_break);
+	unsigned long mask = trace->context->arch->break_mask;
+	unsigned int n;
+	
+	for (n = 0; n < trace->context->arch->break_size; n++) {
+		if ((mask >> (8 * n)) & 0xff)
+			buffer[brk->addr - base + n] = (code >> (8 * n)) & 0xff;
+	}
+}
+
+/* Breakpoints on neighbouring instructions can share a word, so only
+ * the bytes under the break mask are ever changed.  Through the memory
+ * file only the break code's own bytes are read and written back, so a
+ * breakpoint near the end of a mapping is fine.  Without it, this goes
+ * a word at a time through whichever thread is stopped. */
+static inline int poke_masked(struct bina_breakpoint *brk, unsigned long code)
+{
+	struct bina_trace *trace = brk->trace;
+	unsigned long mask = trace->context->arch->break_mask;
+	unsigned int size = trace->context->arch->break_size;
+	unsigned char bytes[sizeof(unsigned long)];
+	unsigned long word;
+	
+	if (trace->mem_fd >= 0) {
+		if (pread(trace->mem_fd, bytes, size, brk->addr) != (ssize_t)size)
+			return -1;
+		
+		patch_bytes(trace, bytes, brk->addr, brk, code);
+		
+		if (pwrite(trace->mem_fd, bytes, size, brk->addr) != (ssize_t)size)
+			return -1;
+		
+		return 0;
+	}
+	
+	errno = 0;
+	word = ptrace(PTRACE_PEEKTEXT, trace->current, (void *)brk->addr, NULL);
+	if (errno)
+		return -1;
+	
+	word = (word & ~mask) | (code & mask);
+	if (ptrace(PTRACE_POKETEXT, trace->current, (void *)brk->addr, word) < 0)
+		return -1;
+	
 	return 0;
 }
 
+static inline int do_install(struct bina_breakpoint *brk)
+{
+	return poke_masked(brk, brk->code_break);
+}
+
 static inline int do_uninstall(struct bina_breakpoint *brk)
 {
-	ptrace(PTRACE_POKETEXT, brk->trace->pid, (void *)brk->addr, brk->code_real);
-	return 0;
+	return poke_masked(brk, brk->code_real);
 }
 
-struct bina_breakpoint *bina_install_breakpoint(struct bina_trace *trace, struct bina_instruction *ins, void *state)
+/* Set up the breakpoint for an instruction, without writing anything
+ * to the tracee.  An instruction's existing breakpoint is reused. */
+static struct bina_breakpoint *new_breakpoint(struct bina_trace *trace, struct bina_instruction *ins, void *state, unsigned int flags)
 {
 	struct bina_breakpoint *brk;
-	int rc;
 	
-	if (trace->nr_breakpoints == MAX_BREAKPOINTS - 1)
+	if (ins->context != trace->context || ins->index >= trace->context->nr_instructions)
+		return NULL;
+	
+	brk = trace->breakpoints[ins->index];
+	if (brk)
+		return brk;
+	
+	brk = bina_arena_alloc(&trace->breakpoint_arena, 1, sizeof(*brk));
+	if (!brk)
 		return NULL;
 	
-	brk = &trace->breakpoints[trace->nr_breakpoints];
-	trace->nr_breakpoints++;
-		
 	brk->trace = trace;
 	brk->instruction = ins;
+	brk->flags = flags;
 	brk->state = state;
 	
 	/* Calculate the real memory address to insert the breakpoint code. */
@@ -90,40 +317,347 @@ struct bina_breakpoint *bina_install_breakpoint(struct bina_trace *trace, struct
 		(brk->code_real & ~trace->context->arch->break_mask) | 
 		(trace->context->arch->break_code & trace->context->arch->break_mask);
 	
-	/* Install the breakpoint. */
-	rc = do_install(brk);
-	if (rc) {
+	trace->breakpoints[ins->index] = brk;
+	trace->nr_breakpoints++;
+	
+	return brk;
+}
+
+struct bina_breakpoint *bina_install_breakpoint(struct bina_trace *trace, struct bina_instruction *ins, void *state)
+{
+	return bina_install_breakpoint_flags(trace, ins, state, 0);
+}
+
+/* Install a breakpoint on an instruction.  There's at most one per
+ * instruction, so installing another on the same one just returns it,
+ * armed again if it had been removed.  A one-shot breakpoint is removed
+ * the first time it's hit, without single stepping, so code that's
+ * already been seen runs at full speed. */
+struct bina_breakpoint *bina_install_breakpoint_flags(struct bina_trace *trace, struct bina_instruction *ins, void *state, unsigned int flags)
+{
+	struct bina_breakpoint *brk = new_breakpoint(trace, ins, state, flags);
+	
+	if (!brk || brk->armed)
+		return brk;
+	
+	brk->flags = flags;
+	brk->state = state;
+	
+	if (do_install(brk))
 		return NULL;
+	
+	brk->armed = 1;
+	return brk;
+}
+
+static int compare_breakpoints(const void *a, const void *b)
+{
+	const struct bina_breakpoint *x = *(struct bina_breakpoint * const *)a;
+	const struct bina_breakpoint *y = *(struct bina_breakpoint * const *)b;
+	
+	return (x->addr > y->addr) - (x->addr < y->addr);
+}
+
+/* Write the break code (or the original code) for a batch of
+ * breakpoints, sorted by address.  Breakpoints close enough together
+ * share a range, which is read out of the tracee, patched here and
+ * written back, so a whole text section takes a handful of calls.
+ * Without the memory file, each breakpoint is poked on its own. */
+static int write_breakpoints(struct bina_trace *trace, struct bina_breakpoint **brks, unsigned int nr, int install)
+{
+	unsigned int break_size = trace->context->arch->break_size;
+	unsigned char *buffer = NULL;
+	unsigned int i, j;
+	unsigned long start, end;
+	ssize_t size;
+	int rc = -1;
+	
+	if (trace->mem_fd < 0) {
+		for (i = 0; i < nr; i++) {
+			if (poke_masked(brks[i], install ? brks[i]->code_break : brks[i]->code_real))
+				return -1;
+		}
+		
+		return 0;
 	}
+	
+	buffer = malloc(BREAKPOINT_RANGE + break_size);
+	if (!buffer)
+		return -1;
+	
+	for (i = 0; i < nr; i = j) {
+		start = brks[i]->addr;
 		
-	return brk;
+		for (j = i + 1; j < nr && brks[j]->addr - start < BREAKPOINT_RANGE; j++)
+			;
+		
+		end = brks[j - 1]->addr + break_size;
+		
+		size = pread(trace->mem_fd, buffer, end - start, start);
+		if (size != (ssize_t)(end - start))
+			goto out;
+		
+		for (; i < j; i++) {
+			patch_bytes(trace, buffer, start, brks[i], install ? brks[i]->code_break : brks[i]->code_real);
+		}
+		
+		size = pwrite(trace->mem_fd, buffer, end - start, start);
+		if (size != (ssize_t)(end - start))
+			goto out;
+	}
+	
+	rc = 0;
+	
+out:
+	free(buffer);
+	return rc;
+}
+
+/* Install breakpoints on many instructions at once, all with the same
+ * state and flags, returning how many are armed afterwards, or -1.  The
+ * text is patched in large ranges rather than a word at a time, so
+ * covering every block of a big binary costs a few system calls. */
+int bina_install_breakpoints(struct bina_trace *trace, struct bina_instruction **instructions, unsigned int count,
+	void *state, unsigned int flags)
+{
+	struct bina_breakpoint **brks, *brk;
+	unsigned int i, n, nr = 0, armed = 0;
+	int rc = -1;
+	
+	brks = malloc((count + 1) * sizeof(*brks));
+	if (!brks)
+		return -1;
+	
+	/* Take each one once, however often it was asked for. */
+	for (i = 0; i < count; i++) {
+		brk = new_breakpoint(trace, instructions[i], state, flags);
+		if (!brk)
+			break;
+		
+		if (!brk->queued) {
+			brk->queued = 1;
+			brks[nr++] = brk;
+		}
+	}
+	
+	for (n = 0; n < nr; n++) {
+		brks[n]->queued = 0;
+	}
+	
+	if (i < count)
+		goto out;
+	
+	/* The ones already armed count, but aren't written again. */
+	for (i = 0, n = 0; i < nr; i++) {
+		brk = brks[i];
+		if (brk->armed) {
+			armed++;
+			continue;
+		}
+		
+		brk->flags = flags;
+		brk->state = state;
+		brks[n++] = brk;
+	}
+	
+	nr = n;
+	
+	qsort(brks, nr, sizeof(*brks), compare_breakpoints);
+	
+	if (write_breakpoints(trace, brks, nr, 1))
+		goto out;
+	
+	for (i = 0; i < nr; i++) {
+		brks[i]->armed = 1;
+	}
+	
+	rc = armed + nr;
+	
+out:
+	free(brks);
+	return rc;
+}
+
+/* Remove every armed breakpoint, putting the original code back in the
+ * same few large writes. */
+int bina_remove_breakpoints(struct bina_trace *trace)
+{
+	struct bina_breakpoint **brks;
+	unsigned int i, nr = 0;
+	int rc;
+	
+	brks = malloc((trace->nr_breakpoints + 1) * sizeof(*brks));
+	if (!brks)
+		return -1;
+	
+	/* Instructions are in address order, so these are already sorted. */
+	for (i = 0; i < trace->context->nr_instructions; i++) {
+		if (trace->breakpoints[i] && trace->breakpoints[i]->armed)
+			brks[nr++] = trace->breakpoints[i];
+	}
+	
+	rc = write_breakpoints(trace, brks, nr, 0);
+	if (!rc) {
+		for (i = 0; i < nr; i++) {
+			brks[i]->armed = 0;
+		}
+	}
+	
+	free(brks);
+	return rc;
 }
 
 static struct bina_breakpoint *find_breakpoint(struct bina_trace *trace, unsigned long addr)
 {
-	unsigned long offset = addr - (unsigned long)trace->text_base;
-	int i;
+	struct bina_breakpoint *brk;
+	struct bina_instruction *ins;
+	
+	/* Resolve the trap address through the context's lookup index, and
+	 * from there it's one load. */
+	if (!bina_lookup_instructions(trace->context, (unsigned long)trace->text_base, &addr, 1, &ins))
+		return NULL;
 	
-	for (i = 0; i < trace->nr_breakpoints; i++) {
-		if (trace->breakpoints[i].instruction->offset == offset) {
-			return &trace->breakpoints[i];
+	brk = trace->breakpoints[ins->index];
+	return (brk && brk->addr == addr) ? brk : NULL;
+}
+
+/* Set a stopped thread going again, still stepping if it was, with the
+ * signal it stopped for, if any. */
+static void resume_thread(struct bina_thread *thread, int sig)
+{
+	ptrace(thread->stepping ? PTRACE_SINGLESTEP : PTRACE_CONT, thread->tid, NULL, (void *)(long)sig);
+	thread->stopped = 0;
+}
+
+/* Stop every thread, to take the breakpoints out from under them.  A
+ * thread that had just trapped is put back on the instruction, which
+ * will have its original code by the time it runs again.  Signals that
+ * were on their way in are kept for the detach. */
+static int stop_threads(struct bina_trace *trace, int *signals)
+{
+	int break_size = trace->context->arch->break_size;
+	struct bina_thread *thread;
+	struct user_regs_struct regs;
+	struct bina_breakpoint *brk;
+	unsigned int i;
+	int status;
+	
+	for (i = 0; i < trace->nr_threads; i++) {
+		if (!trace->threads[i].stopped)
+			ptrace(PTRACE_INTERRUPT, trace->threads[i].tid, NULL, NULL);
+	}
+	
+	for (i = 0; i < trace->nr_threads; i++) {
+		thread = &trace->threads[i];
+		signals[i] = 0;
+		
+		if (thread->stopped)
+			continue;
+		
+		if (waitpid(thread->tid, &status, __WALL) < 0)
+			return -1;
+		
+		if (!WIFSTOPPED(status)) {
+			remove_thread(trace, thread);
+			i--;
+			continue;
+		}
+		
+		thread->stopped = 1;
+		trace->current = thread->tid;
+		
+		if (status >> 16)
+			continue;
+		
+		if (WSTOPSIG(status) != SIGTRAP) {
+			signals[i] = WSTOPSIG(status);
+			continue;
+		}
+		
+		if (thread->stepping)
+			continue;
+		
+		ptrace(PTRACE_GETREGS, thread->tid, NULL, &regs);
+		brk = find_breakpoint(trace, regs.eip - break_size);
+		if (brk && brk->armed) {
+			regs.eip -= break_size;
+			ptrace(PTRACE_SETREGS, thread->tid, NULL, &regs);
 		}
 	}
 	
-	return NULL;
+	return 0;
+}
+
+/* Take every breakpoint out and let the tracee carry on by itself.  This
+ * can be called from a breakpoint handler. */
+int bina_trace_detach(struct bina_trace *trace)
+{
+	unsigned int i;
+	int *signals;
+	int rc = -1;
+	
+	if (trace->pid <= 0)
+		return -1;
+	
+	signals = malloc((trace->nr_threads + 1) * sizeof(*signals));
+	if (!signals)
+		return -1;
+	
+	if (stop_threads(trace, signals) || bina_remove_breakpoints(trace))
+		goto out;
+	
+	for (i = 0; i < trace->nr_threads; i++) {
+		ptrace(PTRACE_DETACH, trace->threads[i].tid, NULL, (void *)(long)signals[i]);
+	}
+	
+	trace->nr_threads = 0;
+	trace->pid = 0;
+	rc = 0;
+	
+out:
+	free(signals);
+	return rc;
+}
+
+/* Copy a breakpoint's instruction into its slot in the scratch area,
+ * the first time it's hit. */
+static void displace(struct bina_trace *trace, struct bina_breakpoint *brk)
+{
+	unsigned char code[BINA_DISPLACED_SIZE];
+	unsigned long slot = trace->scratch + brk->instruction->index * BINA_DISPLACED_SIZE;
+	int size;
+	
+	brk->displaced = -1;
+	
+	if (!trace->scratch)
+		return;
+	
+	size = trace->context->arch->displace(brk->instruction, brk->addr, slot, code);
+	if (size < 0 || pwrite(trace->mem_fd, code, size, slot) != size)
+		return;
+	
+	brk->displaced = 1;
 }
 
-static int handle_breakpoint(struct bina_trace *trace)
+/* A thread has trapped on a breakpoint.  The real instruction is run
+ * out of line where it can be, so the breakpoint stays in and a hit is
+ * one stop, a register read and a register write.  Otherwise the original
+ * code goes back while the thread single steps over it, and the rest of
+ * the tracee keeps running meanwhile, so another thread can pass through
+ * in that window without a hit.  The breakpoint counts the threads
+ * stepping over it and goes back in after the last. */
+static int handle_breakpoint(struct bina_trace *trace, struct bina_thread *thread)
 {
 	int break_size = trace->context->arch->break_size;
 	struct bina_breakpoint *brk;
 	struct user_regs_struct regs;
 
 	/* Read the child registers, and set the instruction pointer
-	 * to the location where the breakpoint occurred. */
-	ptrace(PTRACE_GETREGS, trace->pid, NULL, &regs);
+	 * to the location where the breakpoint occurred, before the handler
+	 * can let the tracee go. */
+	ptrace(PTRACE_GETREGS, thread->tid, NULL, &regs);
 	regs.eip -= break_size;
-	ptrace(PTRACE_SETREGS, trace->pid, NULL, &regs);
+	ptrace(PTRACE_SETREGS, thread->tid, NULL, &regs);
 
 	/* Find the breakpoint descriptor, based on where we've stopped. */
 	brk = find_breakpoint(trace, regs.eip);
@@ -132,57 +666,137 @@ static int handle_breakpoint(struct bina_trace *trace)
 		return -1;
 	}
 	
+	/* It was taken out after this thread trapped on it, so the real
+	 * instruction is already back. */
+	if (!brk->armed) {
+		resume_thread(thread, 0);
+		return 0;
+	}
+	
 	/* Call user-defined breakpoint handler. */
 	trace->handler(brk);
-	 
-	/* Step 1: Uninstall the breakpoint, to reassert the original
-	 * code. */
-	do_uninstall(brk);
 	
-	/* Step 2: Single step through the real instruction, and wait for
-	 * that to complete. */
-	ptrace(PTRACE_SINGLESTEP, trace->pid, NULL, NULL);
-	wait(NULL);
+	/* The handler let the tracee go. */
+	if (trace->pid <= 0)
+		return 0;
+	
+	/* A one-shot breakpoint just goes, and the real instruction runs
+	 * from the rewound instruction pointer. */
+	if (brk->flags & BINA_BREAK_ONESHOT) {
+		if (!brk->lifted && do_uninstall(brk))
+			return -1;
+		
+		brk->armed = 0;
+		resume_thread(thread, 0);
+		return 0;
+	}
 	
-	/* Step 3: Reinstall the breakpoint, so it continues to get hit. */
-	do_install(brk);
+	/* Run the copy of the instruction in the scratch area, which jumps
+	 * back after it, so the breakpoint never comes out. */
+	if (!brk->displaced)
+		displace(trace, brk);
 	
-	/* Continue execution of the child. */
-	ptrace(PTRACE_CONT, trace->pid, NULL, NULL);
+	if (brk->displaced > 0) {
+		regs.eip = trace->scratch + brk->instruction->index * BINA_DISPLACED_SIZE;
+		ptrace(PTRACE_SETREGS, thread->tid, NULL, &regs);
+		resume_thread(thread, 0);
+		return 0;
+	}
+	
+	/* Otherwise put the original code back, unless another thread has
+	 * already, and single step through the real instruction. */
+	if (!brk->lifted++ && do_uninstall(brk))
+		return -1;
+	
+	thread->stepping = brk;
+	resume_thread(thread, 0);
 	
 	return 0;
 }
 
+/* A thread has stepped over a breakpoint's instruction, so reinstall
+ * it, if no other thread is still stepping over it. */
+static int finish_step(struct bina_thread *thread)
+{
+	struct bina_breakpoint *brk = thread->stepping;
+	
+	thread->stepping = NULL;
+	
+	if (!--brk->lifted && brk->armed && do_install(brk))
+		return -1;
+	
+	return 0;
+}
+
+/* Run the tracee until its main thread exits.  Stops are taken from
+ * any thread, one at a time, and each thread is continued as soon as
+ * its own stop is dealt with, so the others never wait on it.  Job
+ * control stops aren't kept: a stopped thread is simply continued. */
 int bina_trace_run(struct bina_trace *trace)
 {
-	int status;
-	siginfo_t signal;
+	struct bina_thread *thread;
+	unsigned long message;
+	int status, sig;
+	pid_t tid;
 
+	trace->threads[0].stopped = 0;
 	ptrace(PTRACE_CONT, trace->pid, NULL, NULL);
 	
-	do {
-		wait(&status);
+	while (trace->pid > 0) {
+		tid = waitpid(-1, &status, __WALL);
+		if (tid < 0)
+			return -1;
+		
+		/* A new thread can report before its parent's clone does. */
+		thread = add_thread(trace, tid);
+		if (!thread)
+			return -1;
 		
-		if (WIFEXITED(status)) {
-			return 0;
+		if (WIFEXITED(status) || WIFSIGNALED(status)) {
+			if (thread->stepping)
+				finish_step(thread);
+			
+			remove_thread(trace, thread);
+			
+			if (tid == trace->pid)
+				return 0;
+			
+			continue;
 		}
 		
-		ptrace(PTRACE_GETSIGINFO, trace->pid, NULL, &signal);
+		thread->stopped = 1;
+		trace->current = tid;
+		sig = WSTOPSIG(status);
 		
-		/* If we stopped because of a SIGTRAP, then we more than likely
-		 * hit a breakpoint.  So, pass off handling the breakpoint to
-		 * the handler routine. */
-		if (signal.si_signo == SIGTRAP) {
-			status = handle_breakpoint(trace);
+		if (status >> 16 == PTRACE_EVENT_CLONE) {
+			ptrace(PTRACE_GETEVENTMSG, tid, NULL, &message);
+			if (!add_thread(trace, (pid_t)message))
+				return -1;
+			
+			thread = find_thread(trace, tid);
+			sig = 0;
+		} else if (status >> 16) {
+			/* A new thread's first stop, or an exec or group stop. */
+			sig = 0;
+		} else if (sig == SIGTRAP && thread->stepping) {
+			if (finish_step(thread))
+				return -1;
 			
+			sig = 0;
+		} else if (sig == SIGTRAP) {
 			/* If for some reason we couldn't handle the breakpoint,
 			 * then we probably can't continue because we've corrupted
 			 * the memory space by messing around with inserting
 			 * breakpoint opcodes. */
+			status = handle_breakpoint(trace, thread);
 			if (status)
 				return status;
+			
+			continue;
 		}
-	} while(1);
+		
+		resume_thread(thread, sig);
+	}
 	
 	return 0;
 }
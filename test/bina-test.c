@@ -1,13 +1,8 @@
 #include <stdio.h>
-#include <fcntl.h>
+#include <stdlib.h>
 #include <unistd.h>
-#include <sys/stat.h>
-#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/wait.h>
-#include <libelf.h>
-#include <gelf.h>
-#include <string.h>
 #include <bina.h>
 #include <sys/ptrace.h>
 #include <sys/user.h>
@@ -52,29 +47,37 @@ static int break_handler(struct bina_breakpoint *breakpoint)
 	return 0;
 }
 
-static int process(char *base, unsigned int size, void *text_base)
+static int process(struct bina_context *ctx)
 {
-	struct bina_context *ctx;
 	struct bina_trace *trace;
+	struct bina_instruction **leaders;
 	FILE *graph;
 	int i;
 	
-	ctx = bina_create(&x86_32_arch, base, size);
-	if (!ctx) {
-		printf("error: unable to create context\n");
-		return -1;
-	}
-	
 	bina_detect_basic_blocks(ctx);
 	create_graph(ctx);
 	
-	bina_analyse_loops(ctx);
+	printf("%u jump tables\n", ctx->nr_jump_tables);
+	
+	if (!bina_analyse_loops(ctx)) {
+		printf("%u loops, %u irreducible edges\n", ctx->loops->nr_loops,
+			ctx->loops->nr_irreducible_edges);
+	}
+	
+	if (!bina_estimate_trip_counts(ctx)) {
+		for (i = 0; i < ctx->loops->nr_loops; i++) {
+			struct bina_trip_count *tc = &ctx->loops->trip_counts[i];
+			
+			if (tc->kind == TK_CONSTANT)
+				printf("loop %d at %04x runs %llu times\n", i,
+					ctx->blocks[ctx->loops->loops[i].header].offset, tc->count);
+		}
+	}
 	
 	printf("starting trace\n");
 	
-	trace = bina_trace_init(ctx, binary_file, text_base, break_handler);
+	trace = bina_trace_init(ctx, binary_file, (void *)ctx->load_address, break_handler);
 	if (!trace) {
-		bina_destroy(ctx);
 		printf("error: couldn't setup trace.\n");
 		return -1;
 	}
@@ -82,9 +85,14 @@ static int process(char *base, unsigned int size, void *text_base)
 	graph = fopen("./trace.dot", "wt");
 	fprintf(graph, "digraph g {\n");
 
-	
-	for (i = 0; i < ctx->nr_basic_blocks; i++) {
-		bina_install_breakpoint(trace, ctx->blocks[i].instructions, graph);
+	leaders = malloc((ctx->nr_basic_blocks + 1) * sizeof(*leaders));
+	if (leaders) {
+		for (i = 0; i < ctx->nr_basic_blocks; i++) {
+			leaders[i] = ctx->blocks[i].instructions;
+		}
+		
+		bina_install_breakpoints(trace, leaders, ctx->nr_basic_blocks, graph, 0);
+		free(leaders);
 	}
 	
 	bina_trace_run(trace);
@@ -95,58 +103,9 @@ static int process(char *base, unsigned int size, void *text_base)
 	printf("trace complete\n");
 	
 	bina_trace_destroy(trace);
-	bina_destroy(ctx);
 	return 0;
 }
 
-static int process_section(GElf_Shdr *hdr, Elf_Scn *scn)
-{
-	Elf_Data *edata = NULL;
-	edata = elf_getdata(scn, edata);
-	if (!edata) {
-		return -1;
-	}
-		
-	return process(edata->d_buf, edata->d_size, (void *)hdr->sh_addr);
-}
-
-static int process_elf(char *base, unsigned int size)
-{
-	Elf *elf;
-	GElf_Shdr section_hdr;
-	Elf_Scn *section = NULL;
-	Elf32_Ehdr *elf32header = (Elf32_Ehdr *)base;
-	char *name;
-	int rc = -1;
-	
-	/* Check the ELF library version. */
-	if (elf_version(EV_CURRENT) == EV_NONE) {
-		printf("warning: elf library is out of date\n");
-	}
-	
-	/* Open up the binary as an ELF file. */
-	elf = elf_memory(base, size);
-	if (!elf) {
-		printf("error: couldn't open elf file\n");
-		return -1;
-	}
-
-	/* Loop through the sections looking for the .text section. */
-	while ((section = elf_nextscn(elf, section)) != 0) {
-		gelf_getshdr(section, &section_hdr);
-		name = elf_strptr(elf, elf32header->e_shstrndx, section_hdr.sh_name);
-		
-		/* If we've found the .text section, process it. */
-		if (strcmp(name, ".text") == 0) {
-			rc = process_section(&section_hdr, section);
-			break;
-		}
-	}
-	
-	elf_end(elf);
-	return rc;
-}
-
 static void usage(char *progname)
 {
 	printf("usage: %s <binary>\n", progname);
@@ -154,9 +113,8 @@ static void usage(char *progname)
 
 int main(int argc, char **argv)
 {
-	struct stat st;
-	char *buffer;
-	int fd, rc;
+	struct bina_elf *elf;
+	int i, rc = -1;
 
 	if (argc != 2) {
 		usage(argv[0]);
@@ -164,29 +122,22 @@ int main(int argc, char **argv)
 	}
 	
 	binary_file = argv[1];
-	fd = open(binary_file, O_RDONLY);
-	if (fd < 0) {
-		printf("error: unable to open file\n");
-		return -1;
-	}
-	
-	rc = fstat(fd, &st);
-	if (rc) {
-		close(fd);
-		printf("error: unable to stat file\n");
+	elf = bina_open_elf(&x86_32_arch, binary_file, 0);
+	if (!elf) {
+		printf("error: unable to load elf file\n");
 		return -1;
 	}
 	
-	buffer = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-	close(fd);
-	
-	if (!buffer) {
-		printf("error: unable to map file\n");
-		return -1;
+	/* Trace the section holding the entry point. */
+	for (i = 0; i < elf->nr_sections; i++) {
+		struct bina_elf_section *section = &elf->sections[i];
+		
+		if (elf->entry >= section->address && elf->entry < section->address + section->size) {
+			rc = process(section->ctx);
+			break;
+		}
 	}
 	
-	rc = process_elf(buffer, st.st_size);
-	munmap(buffer, st.st_size);
-	
+	bina_close_elf(elf);
 	return rc;
 }
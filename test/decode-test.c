@@ -0,0 +1,86 @@
+#include <stdio.h>
+#include <bina.h>
+
+/* Check the fast decoder against libdisasm over every executable section
+ * of a binary: the same instructions at the same offsets, with the same
+ * lengths, types and direct branch targets. */
+
+#define MAX_REPORTS	20
+
+static int is_branch(struct bina_instruction *ins)
+{
+	return ins->type == IT_CALL || ins->type == IT_U_BRANCH || ins->type == IT_C_BRANCH;
+}
+
+static unsigned int compare(struct bina_elf_section *section, struct bina_context *full, struct bina_context *fast)
+{
+	unsigned int i = 0, j = 0, mismatches = 0;
+
+	while (i < full->nr_instructions && j < fast->nr_instructions) {
+		struct bina_instruction *a = &full->instructions[i];
+		struct bina_instruction *b = &fast->instructions[j];
+
+		/* After a disagreement the two can take a while to line up again,
+		 * so step whichever is behind. */
+		if (a->offset != b->offset) {
+			if (a->offset < b->offset)
+				i++;
+			else
+				j++;
+
+			continue;
+		}
+
+		if (a->size != b->size || a->type != b->type ||
+				(is_branch(a) && a->branch_target_offset != b->branch_target_offset)) {
+			if (mismatches < MAX_REPORTS)
+				printf("%s+%04x: libdisasm size %u type %d target %x, fast size %u type %d target %x\n",
+					section->name, a->offset, a->size, a->type, a->branch_target_offset,
+					b->size, b->type, b->branch_target_offset);
+			mismatches++;
+		}
+
+		i++;
+		j++;
+	}
+
+	return mismatches;
+}
+
+int main(int argc, char **argv)
+{
+	struct bina_elf *elf;
+	unsigned int i, nr_instructions = 0, mismatches = 0;
+
+	if (argc != 2) {
+		printf("usage: %s <binary>\n", argv[0]);
+		return -1;
+	}
+
+	elf = bina_open_elf(&x86_32_arch, argv[1], 0);
+	if (!elf) {
+		printf("error: unable to load elf file\n");
+		return -1;
+	}
+
+	for (i = 0; i < elf->nr_sections; i++) {
+		struct bina_elf_section *section = &elf->sections[i];
+		struct bina_context *fast;
+
+		fast = bina_create_flags(&x86_32_arch, section->base, section->size, BINA_FAST_DECODE);
+		if (!fast) {
+			printf("error: fast decode of %s failed\n", section->name);
+			mismatches++;
+			continue;
+		}
+
+		nr_instructions += section->ctx->nr_instructions;
+		mismatches += compare(section, section->ctx, fast);
+		bina_destroy(fast);
+	}
+
+	bina_close_elf(elf);
+
+	printf("%u instructions, %u mismatches\n", nr_instructions, mismatches);
+	return mismatches ? 1 : 0;
+}
@@ -0,0 +1,85 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <bina.h>
+
+/* Check that BINA_PARALLEL stitches its chunks into exactly the stream a
+ * single linear sweep decodes, on random bytes, where instructions
+ * straddle the chunk boundaries and the chunk starts are rarely real
+ * instruction boundaries. */
+
+static unsigned int compare(struct bina_context *linear, struct bina_context *parallel)
+{
+	unsigned int i;
+
+	if (linear->nr_instructions != parallel->nr_instructions) {
+		printf("linear sweep found %u instructions, parallel %u\n",
+			linear->nr_instructions, parallel->nr_instructions);
+	}
+
+	for (i = 0; i < linear->nr_instructions && i < parallel->nr_instructions; i++) {
+		struct bina_instruction *a = &linear->instructions[i];
+		struct bina_instruction *b = &parallel->instructions[i];
+
+		if (a->offset != b->offset || a->size != b->size || a->type != b->type ||
+				a->branch_target_offset != b->branch_target_offset) {
+			printf("instruction %u: linear %04x size %u type %d, parallel %04x size %u type %d\n",
+				i, a->offset, a->size, a->type, b->offset, b->size, b->type);
+			return 1;
+		}
+	}
+
+	return linear->nr_instructions != parallel->nr_instructions;
+}
+
+static int check(unsigned int size, unsigned int seed)
+{
+	struct bina_context *linear, *parallel;
+	unsigned int i;
+	char *code;
+	int rc = 1;
+
+	code = malloc(size);
+	if (!code)
+		return 1;
+
+	srand(seed);
+	for (i = 0; i < size; i++) {
+		code[i] = rand();
+	}
+
+	linear = bina_create_flags(&x86_32_arch, code, size, BINA_FAST_DECODE);
+	parallel = bina_create_flags(&x86_32_arch, code, size, BINA_PARALLEL);
+
+	if (!linear || !parallel)
+		printf("error: couldn't decode %u bytes\n", size);
+	else
+		rc = compare(linear, parallel);
+
+	if (linear)
+		bina_destroy(linear);
+	if (parallel)
+		bina_destroy(parallel);
+
+	free(code);
+	return rc;
+}
+
+int main(void)
+{
+	/* Sizes either side of splitting at all, and ones that don't divide
+	 * evenly into chunks. */
+	static const unsigned int sizes[] = { 128 * 1024 - 1, 128 * 1024, 1024 * 1024 + 7, 4 * 1024 * 1024 + 13 };
+	unsigned int i, seed, failures = 0;
+
+	for (i = 0; i < sizeof(sizes) / sizeof(*sizes); i++) {
+		for (seed = 1; seed <= 8; seed++) {
+			if (check(sizes[i], seed)) {
+				printf("mismatch at size %u, seed %u\n", sizes[i], seed);
+				failures++;
+			}
+		}
+	}
+
+	printf("%u failures\n", failures);
+	return failures ? 1 : 0;
+}
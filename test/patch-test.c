@@ -0,0 +1,445 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <bina.h>
+
+/* Check that bina_patch_range() leaves a context just as detecting its
+ * blocks from scratch over the patched bytes would: the same
+ * instructions, leaders, branch targets and jump tables, the same
+ * blocks, and the same edges in the same order, in the compact view
+ * too.  The patches are random bytes, branches, returns and nops, some
+ * changing the number of instructions and some not, over code with
+ * and without switch tables, and from the entry points as well as by
+ * linear sweep. */
+
+#define CODE_SIZE	(16 * 1024)
+#define NR_PATCHES	200
+#define NR_SEEDS	4
+
+#define LOAD_ADDRESS	0x1000
+#define TABLE_ADDRESS	0x800000
+#define MAX_TABLES	64
+
+struct test_case {
+	const char *name;
+	unsigned int flags;
+	int compact;
+	int tables;
+};
+
+static const struct test_case cases[] = {
+	{ "linear", BINA_FAST_DECODE, 0, 0 },
+	{ "linear compact", BINA_FAST_DECODE, 1, 0 },
+	{ "tables", BINA_FAST_DECODE, 0, 1 },
+	{ "tables compact", BINA_FAST_DECODE, 1, 1 },
+	{ "recursive", BINA_RECURSIVE, 0, 0 },
+	{ "recursive compact", BINA_RECURSIVE, 1, 1 },
+};
+
+static unsigned int table[MAX_TABLES * 4];
+static const struct bina_region region = { TABLE_ADDRESS, (const char *)table, sizeof(table) };
+static const unsigned int entries[] = { 0, CODE_SIZE / 3, 2 * CODE_SIZE / 3 };
+
+static void put_rel32(char *code, int rel)
+{
+	memcpy(code, &rel, 4);
+}
+
+/* A switch over four cases, as a compiler lays one out:
+ *
+ *	cmp $3, %eax
+ *	ja default
+ *	jmp *table(,%eax,4)
+ *	nop; ret; ret; ret; ret
+ */
+static unsigned int put_switch(char *code, unsigned int pos, unsigned int nr)
+{
+	unsigned int address = TABLE_ADDRESS + nr * 16, k;
+
+	memcpy(&code[pos], "\x83\xf8\x03\x77\x0b\xff\x24\x85", 8);
+	memcpy(&code[pos + 8], &address, 4);
+	memcpy(&code[pos + 12], "\x90\xc3\xc3\xc3\xc3", 5);
+
+	for (k = 0; k < 4; k++) {
+		table[nr * 4 + k] = LOAD_ADDRESS + pos + 13 + k;
+	}
+
+	return 17;
+}
+
+/* Something that looks like code: mostly two byte register operations,
+ * with branches, calls and returns in between, and switches if asked. */
+static void generate(char *code, unsigned int size, int tables)
+{
+	unsigned int pos = 0, nr_tables = 0;
+
+	while (pos + 32 < size) {
+		unsigned int r = rand() % 32;
+
+		if (r < 2) {
+			code[pos++] = r ? 0xeb : 0x70 + rand() % 16;
+			code[pos++] = rand() % 160 - 80;
+		} else if (r < 4) {
+			code[pos++] = r == 2 ? 0xe8 : 0xe9;
+			put_rel32(&code[pos], rand() % 4000 - 2000);
+			pos += 4;
+		} else if (r < 5) {
+			code[pos++] = 0xc3;
+		} else if (r < 6 && tables && nr_tables < MAX_TABLES) {
+			pos += put_switch(code, pos, nr_tables++);
+		} else {
+			code[pos++] = 0x01 + 8 * (rand() % 7);
+			code[pos++] = 0xc0 + rand() % 64;
+		}
+	}
+
+	memset(&code[pos], 0x90, size - pos);
+}
+
+/* Aim a branch at an instruction near offset, or anywhere at all. */
+static int branch_to(struct bina_context *ctx, unsigned int offset, unsigned int from, int range)
+{
+	int rel = rand() % (2 * range) - range;
+	struct bina_instruction *ins;
+
+	if (rand() % 4 == 0)
+		return rel;
+
+	ins = bina_instruction_covering(ctx, (int)offset + rel < 0 ? 0 : offset + rel);
+	return ins ? (int)ins->offset - (int)from : rel;
+}
+
+/* Write something over the code at a random spot, and return how many
+ * bytes were written. */
+static unsigned int patch_code(struct bina_context *ctx, char *code, unsigned int offset)
+{
+	unsigned int r = rand() % 10, length, k;
+	int rel;
+
+	if (r < 3) {
+		length = 1 + rand() % 8;
+		for (k = 0; k < length; k++) {
+			code[offset + k] = rand();
+		}
+	} else if (r < 5) {
+		rel = branch_to(ctx, offset, offset + 2, 120);
+		code[offset] = rand() % 2 ? 0xeb : 0x70 + rand() % 16;
+		code[offset + 1] = rel < -128 || rel > 127 ? 0 : rel;
+		length = 2;
+	} else if (r < 7) {
+		rel = branch_to(ctx, offset, offset + 5, 2000);
+		code[offset] = rand() % 2 ? 0xe8 : 0xe9;
+		put_rel32(&code[offset + 1], rel);
+		length = 5;
+	} else if (r < 8) {
+		code[offset] = 0xc3;
+		length = 1;
+	} else {
+		length = 1 + rand() % 8;
+		memset(&code[offset], 0x90, length);
+	}
+
+	return length;
+}
+
+/* Detect the blocks over the code.  The one to be patched has some
+ * operands decoded up front too, so they're in its compact view. */
+static struct bina_context *open_context(const struct test_case *c, char *code, unsigned int size, int operands)
+{
+	struct bina_context *ctx;
+	unsigned int i;
+
+	if (c->flags & BINA_RECURSIVE)
+		ctx = bina_create_recursive(&x86_32_arch, code, size, c->flags, entries, sizeof(entries) / sizeof(*entries));
+	else
+		ctx = bina_create_flags(&x86_32_arch, code, size, c->flags);
+
+	if (!ctx)
+		return NULL;
+
+	if (c->tables) {
+		ctx->load_address = LOAD_ADDRESS;
+		ctx->regions = &region;
+		ctx->nr_regions = 1;
+	}
+
+	for (i = 0; operands && i < ctx->nr_instructions; i += 4) {
+		bina_decode_operands(&ctx->instructions[i]);
+	}
+
+	if (bina_detect_basic_blocks(ctx) || (c->compact && bina_build_compact(ctx))) {
+		bina_destroy(ctx);
+		return NULL;
+	}
+
+	return ctx;
+}
+
+static unsigned int instruction_index(struct bina_context *ctx, struct bina_instruction *ins)
+{
+	return ins ? (unsigned int)(ins - ctx->instructions) : BINA_NO_INDEX;
+}
+
+static int compare_instructions(struct bina_context *a, struct bina_context *b)
+{
+	unsigned int i, n;
+
+	if (a->nr_instructions != b->nr_instructions) {
+		printf("patched %u instructions, fresh %u\n", a->nr_instructions, b->nr_instructions);
+		return 1;
+	}
+
+	for (i = 0; i < a->nr_instructions; i++) {
+		struct bina_instruction *x = &a->instructions[i];
+		struct bina_instruction *y = &b->instructions[i];
+
+		if (x->offset != y->offset || x->size != y->size || x->type != y->type || x->index != i ||
+				x->basic_block_leader != y->basic_block_leader ||
+				instruction_index(a, x->branch_target) != instruction_index(b, y->branch_target) ||
+				!x->basic_block || x->basic_block->index != y->basic_block->index ||
+				!x->jump_table != !y->jump_table) {
+			printf("instruction %u at %04x differs\n", i, x->offset);
+			return 1;
+		}
+
+		if (x->prev != (i ? x - 1 : NULL) || x->next != (i + 1 < a->nr_instructions ? x + 1 : NULL)) {
+			printf("instruction %u at %04x isn't linked to its neighbours\n", i, x->offset);
+			return 1;
+		}
+
+		for (n = 0; n < x->nr_operands; n++) {
+			if (x->operands[n].ins != x) {
+				printf("operand %u of instruction %u at %04x points elsewhere\n", n, i, x->offset);
+				return 1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+static int compare_jump_tables(struct bina_context *a, struct bina_context *b)
+{
+	unsigned int i;
+
+	if (a->nr_jump_tables != b->nr_jump_tables) {
+		printf("patched %u jump tables, fresh %u\n", a->nr_jump_tables, b->nr_jump_tables);
+		return 1;
+	}
+
+	for (i = 0; i < a->nr_jump_tables; i++) {
+		struct bina_jump_table *x = &a->jump_tables[i];
+		struct bina_jump_table *y = &b->jump_tables[i];
+
+		if (x->instruction != y->instruction || x->address != y->address || x->nr_entries != y->nr_entries ||
+				x->nr_targets != y->nr_targets ||
+				memcmp(x->targets, y->targets, x->nr_targets * sizeof(*x->targets)) ||
+				a->instructions[x->instruction].jump_table != x) {
+			printf("jump table %u differs\n", i);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static int compare_edges(struct bina_context *a, struct bina_basic_block **x, unsigned char *x_kinds,
+		struct bina_basic_block **y, unsigned char *y_kinds, unsigned int nr)
+{
+	unsigned int n;
+
+	for (n = 0; n < nr; n++) {
+		if (x[n] != &a->blocks[y[n]->index] || x_kinds[n] != y_kinds[n])
+			return 1;
+	}
+
+	return 0;
+}
+
+static int compare_blocks(struct bina_context *a, struct bina_context *b)
+{
+	unsigned int i;
+
+	if (a->nr_basic_blocks != b->nr_basic_blocks || a->nr_edges != b->nr_edges) {
+		printf("patched %u blocks and %u edges, fresh %u and %u\n",
+			a->nr_basic_blocks, a->nr_edges, b->nr_basic_blocks, b->nr_edges);
+		return 1;
+	}
+
+	for (i = 0; i < a->nr_basic_blocks; i++) {
+		struct bina_basic_block *x = &a->blocks[i];
+		struct bina_basic_block *y = &b->blocks[i];
+
+		if (x->index != i || x->offset != y->offset || x->size != y->size ||
+				x->nr_instructions != y->nr_instructions ||
+				x->instructions != &a->instructions[y->instructions - b->instructions] ||
+				x->prev != (i ? x - 1 : NULL) || x->next != (i + 1 < a->nr_basic_blocks ? x + 1 : NULL)) {
+			printf("block %u at %04x differs\n", i, x->offset);
+			return 1;
+		}
+
+		if (x->nr_successors != y->nr_successors || x->nr_predecessors != y->nr_predecessors ||
+				x->successors < a->successors || x->successors + x->nr_successors > a->successors + a->nr_edges ||
+				x->predecessors < a->predecessors || x->predecessors + x->nr_predecessors > a->predecessors + a->nr_edges ||
+				x->successor_kinds - a->successor_kinds != x->successors - a->successors ||
+				x->predecessor_kinds - a->predecessor_kinds != x->predecessors - a->predecessors ||
+				compare_edges(a, x->successors, x->successor_kinds, y->successors, y->successor_kinds, x->nr_successors) ||
+				compare_edges(a, x->predecessors, x->predecessor_kinds, y->predecessors, y->predecessor_kinds, x->nr_predecessors)) {
+			printf("edges of block %u at %04x differ\n", i, x->offset);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* The compact view has to agree with its own context, and with the one
+ * built from scratch. */
+static int compare_compact(struct bina_context *a, struct bina_context *b)
+{
+	struct bina_compact *c = a->compact, *d = b->compact;
+	unsigned int i, n;
+
+	if (!c) {
+		printf("patched context lost its compact view\n");
+		return 1;
+	}
+
+	if (c->nr_instructions != a->nr_instructions || c->nr_blocks != a->nr_basic_blocks || c->nr_edges != a->nr_edges) {
+		printf("compact view has %u instructions, %u blocks and %u edges\n",
+			c->nr_instructions, c->nr_blocks, c->nr_edges);
+		return 1;
+	}
+
+	for (i = 0; i < c->nr_instructions; i++) {
+		struct bina_hot_instruction *x = &c->instructions[i];
+		struct bina_hot_instruction *y = &d->instructions[i];
+
+		if (x->offset != y->offset || x->size != y->size || x->type != y->type ||
+				x->basic_block_leader != y->basic_block_leader || x->basic_block != y->basic_block ||
+				x->branch_target != y->branch_target ||
+				c->operand_index[i + 1] - c->operand_index[i] != x->nr_operands) {
+			printf("hot instruction %u at %04x differs\n", i, x->offset);
+			return 1;
+		}
+	}
+
+	for (i = 0; i < c->nr_blocks; i++) {
+		struct bina_basic_block *block = &a->blocks[i];
+		struct bina_hot_block *x = &c->blocks[i];
+
+		if (memcmp(x, &d->blocks[i], sizeof(*x))) {
+			printf("hot block %u at %04x differs\n", i, x->offset);
+			return 1;
+		}
+
+		for (n = 0; n < block->nr_successors; n++) {
+			if (c->successors[x->first_successor + n] != block->successors[n]->index)
+				break;
+		}
+
+		if (n < block->nr_successors) {
+			printf("hot successors of block %u at %04x differ\n", i, x->offset);
+			return 1;
+		}
+
+		for (n = 0; n < block->nr_predecessors; n++) {
+			if (c->predecessors[x->first_predecessor + n] != block->predecessors[n]->index)
+				break;
+		}
+
+		if (n < block->nr_predecessors) {
+			printf("hot predecessors of block %u at %04x differ\n", i, x->offset);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static int compare(const struct test_case *c, struct bina_context *patched, char *code, unsigned int size)
+{
+	struct bina_context *fresh;
+	int rc;
+
+	fresh = open_context(c, code, size, 0);
+	if (!fresh) {
+		printf("error: couldn't detect the blocks from scratch\n");
+		return 1;
+	}
+
+	rc = compare_instructions(patched, fresh) || compare_jump_tables(patched, fresh) ||
+		compare_blocks(patched, fresh) || (c->compact && compare_compact(patched, fresh));
+
+	bina_destroy(fresh);
+	return rc;
+}
+
+static int check(const struct test_case *c, unsigned int seed)
+{
+	struct bina_context *ctx;
+	unsigned int i, k;
+	char *code;
+	int rc = 1;
+
+	code = malloc(CODE_SIZE);
+	if (!code)
+		return 1;
+
+	srand(seed);
+	memset(table, 0, sizeof(table));
+	generate(code, CODE_SIZE, c->tables);
+
+	ctx = open_context(c, code, CODE_SIZE, 1);
+	if (!ctx) {
+		printf("error: couldn't detect the blocks\n");
+		goto out;
+	}
+
+	for (i = 0; i < NR_PATCHES; i++) {
+		unsigned int offset = rand() % (CODE_SIZE - 16);
+		unsigned int length = patch_code(ctx, code, offset);
+
+		if (bina_patch_range(ctx, offset, length)) {
+			printf("error: couldn't patch %u bytes at %04x\n", length, offset);
+			goto out;
+		}
+
+		/* Some instructions with operands, to see they're kept and
+		 * given back along with their instructions. */
+		for (k = 0; k < 8 && ctx->nr_instructions; k++) {
+			bina_decode_operands(&ctx->instructions[rand() % ctx->nr_instructions]);
+		}
+
+		if (compare(c, ctx, code, CODE_SIZE)) {
+			printf("after patch %u, of %u bytes at %04x\n", i, length, offset);
+			goto out;
+		}
+	}
+
+	rc = 0;
+
+out:
+	if (ctx)
+		bina_destroy(ctx);
+
+	free(code);
+	return rc;
+}
+
+int main(void)
+{
+	unsigned int i, seed, failures = 0;
+
+	for (i = 0; i < sizeof(cases) / sizeof(*cases); i++) {
+		for (seed = 1; seed <= NR_SEEDS; seed++) {
+			if (check(&cases[i], seed)) {
+				printf("mismatch in %s, seed %u\n", cases[i].name, seed);
+				failures++;
+			}
+		}
+	}
+
+	printf("%u failures\n", failures);
+	return failures ? 1 : 0;
+}